@@ -1,10 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <condition_variable>
+#include <filesystem>
 #include <functional>
+#include <future>
 
 #include "airreplay/airreplay.h"
 #include "airreplay/airreplay.pb.h"
+#include "airreplay/in_memory_transport.h"
 
 using airreplay::PingPongRequest;
 using airreplay::PingPongResponse;
@@ -269,4 +273,66 @@ TEST_F(PingPongTestAsync, testCaseAsync) {
       << "Some events at the tail did not replay properly";
 
   delete airreplay::airr;
-}
\ No newline at end of file
+}
+
+namespace {
+const int kAsyncKind = 20;
+
+bool IsReady(std::future<int> &future) {
+  return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+std::unique_ptr<airreplay::Airreplay> AsyncNode(const std::string &trace,
+                                                airreplay::Mode mode) {
+  // with a transport the node opens no mock sockets
+  auto node = std::make_unique<airreplay::Airreplay>(
+      trace, mode, airreplay::TraceOptions(),
+      std::make_shared<airreplay::InMemoryTransport>());
+  node->RegisterKind<PingPongRequest>(kAsyncKind, "async");
+  return node;
+}
+
+PingPongRequest Ping(const std::string &text) {
+  PingPongRequest request;
+  request.set_message(text);
+  return request;
+}
+}  // namespace
+
+TEST(AsyncTest, RecordReplayAsyncCompletesAtTheHead) {
+  std::string dir =
+      std::filesystem::temp_directory_path() / "airr-test-async";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::string trace = dir + "/async";
+  {
+    // recorded right away
+    auto node = AsyncNode(trace, airreplay::Mode::kRecord);
+    std::future<int> first =
+        node->RecordReplayAsync("first", "a#b", Ping("1"), kAsyncKind);
+    ASSERT_TRUE(IsReady(first));
+    EXPECT_EQ(first.get(), 0);
+    EXPECT_EQ(node->RecordReplay("second", "a#b", Ping("2"), kAsyncKind), 1);
+    std::future<int> third =
+        node->RecordReplayAsync("third", "a#b", Ping("3"), kAsyncKind);
+    ASSERT_TRUE(IsReady(third));
+    EXPECT_EQ(third.get(), 2);
+  }
+
+  auto node = AsyncNode(trace, airreplay::Mode::kReplay);
+  // issued out of order, waits for the head to get to it
+  std::future<int> third =
+      node->RecordReplayAsync("third", "a#b", Ping("3"), kAsyncKind);
+  EXPECT_FALSE(IsReady(third));
+  std::future<int> first =
+      node->RecordReplayAsync("first", "a#b", Ping("1"), kAsyncKind);
+  ASSERT_TRUE(IsReady(first));
+  EXPECT_EQ(first.get(), 0);
+  EXPECT_FALSE(IsReady(third));
+  // consuming the entry before it completes the waiting call
+  EXPECT_EQ(node->RecordReplay("second", "a#b", Ping("2"), kAsyncKind), 1);
+  ASSERT_TRUE(IsReady(third));
+  EXPECT_EQ(third.get(), 2);
+  node.reset();
+  std::filesystem::remove_all(dir);
+}
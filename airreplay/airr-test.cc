@@ -1,9 +1,14 @@
 #include <gtest/gtest.h>
+#include <sys/uio.h>
 
+#include <deque>
+#include <filesystem>
 #include <functional>
 
 #include "airreplay/airreplay.h"
 #include "airreplay/airreplay.pb.h"
+#include "airreplay/in_memory_transport.h"
+#include "airreplay/trace.h"
 #include "kudu/gutil/bind.h"
 #include "kudu/gutil/callback.h"
 
@@ -242,4 +247,49 @@ TEST(SanityTest, stdBind) {
     SaveCallback(cp3);
   }
   (*savedcp)();
-}
\ No newline at end of file
+}
+
+namespace {
+const int kBytesKind = 30;
+
+std::unique_ptr<airreplay::Airreplay> BytesNode(const std::string &trace,
+                                                airreplay::Mode mode) {
+  // with a transport the node opens no mock sockets
+  auto node = std::make_unique<airreplay::Airreplay>(
+      trace, mode, airreplay::TraceOptions(),
+      std::make_shared<airreplay::InMemoryTransport>());
+  node->RegisterMessageKindName(kBytesKind, "bytes");
+  return node;
+}
+}  // namespace
+
+TEST(BytesTest, ScatteredPayloadMatchesContiguous) {
+  std::string dir = std::filesystem::temp_directory_path() / "airr-test-bytes";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  std::string trace = dir + "/bytes";
+  std::string payload = "header|body|trailer";
+  std::string header = "header|", body = "body|", trailer = "trailer";
+  struct iovec iov[3] = {{header.data(), header.size()},
+                         {body.data(), body.size()},
+                         {trailer.data(), trailer.size()}};
+  {
+    auto node = BytesNode(trace, airreplay::Mode::kRecord);
+    EXPECT_EQ(node->RecordReplay("msg", "a#b", payload, kBytesKind), 0);
+    EXPECT_EQ(node->RecordReplay("msg", "a#b", iov, 3, kBytesKind), 1);
+  }
+  std::deque<airreplay::OpequeEntry> entries =
+      airreplay::ReadTraceEntries(trace);
+  ASSERT_EQ(entries.size(), 2);
+  EXPECT_EQ(entries[0].bytes_message(), payload);
+  EXPECT_EQ(entries[1].bytes_message(), payload);
+  EXPECT_EQ(entries[0].body_size(), entries[1].body_size());
+  EXPECT_EQ(entries[0].kind(), entries[1].kind());
+
+  // each overload replays against the entry the other one recorded
+  auto node = BytesNode(trace, airreplay::Mode::kReplay);
+  EXPECT_EQ(node->RecordReplay("msg", "a#b", iov, 3, kBytesKind), 0);
+  EXPECT_EQ(node->RecordReplay("msg", "a#b", payload, kBytesKind), 1);
+  node.reset();
+  std::filesystem::remove_all(dir);
+}
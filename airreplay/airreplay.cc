@@ -2,8 +2,11 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <deque>
+#include <fstream>
 #include <thread>
 
 #include "airreplay.pb.h"
@@ -11,6 +14,7 @@
 #define BACKWARD_HAS_BFD 1
 #include "backward.hpp"
 #include "utils.h"
+#include "worker_process.h"
 
 namespace airreplay {
 
@@ -31,13 +35,52 @@ void log(const std::string &context, const std::string &msg) {
   // std::cerr << utils::Backtrace() << std::endl;
 }
 
-Airreplay::Airreplay(std::string tracename, Mode mode)
+Airreplay::Airreplay(std::string tracename, Mode mode,
+                     TraceOptions trace_options,
+                     std::shared_ptr<InMemoryTransport> transport)
     : rrmode_(mode),
-      trace_(tracename, mode),
-      socketReplay_("10.0.0.0", {7000, 7001}) {
+      trace_(tracename, mode, true, trace_options),
+      transport_(std::move(transport)) {
   rrmode_ = mode;
+  if (!transport_) {
+    // airreplay-farm and airreplay-bisect give every concurrent replay its
+    // own mock ports as <recorded>:<listen>
+    std::string mock_host = "10.0.0.0";
+    std::vector<MockPort> mock_ports = {7000, 7001};
+    if (const char *host = std::getenv("AIRREPLAY_MOCK_HOST")) {
+      mock_host = host;
+    }
+    if (const char *ports = std::getenv("AIRREPLAY_MOCK_PORTS")) {
+      mock_ports = ParseMockPorts(ports);
+    }
+    SocketReplayOptions socket_options;
+    if (const char *backend = std::getenv("AIRREPLAY_SOCKET_BACKEND")) {
+      if (std::string(backend) == "io_uring") {
+        socket_options.backend = SocketReplayOptions::kIoUring;
+      }
+    }
+    socketReplay_ = std::make_unique<SocketTraffic>(mock_host, mock_ports,
+                                                    socket_options);
+  }
+
+  // set by airreplay-bisect and airreplay-farm for their replay workers
+  if (const char *stop_at = std::getenv("AIRREPLAY_STOP_AT")) {
+    stop_at_ = std::stoi(stop_at);
+  }
+  if (const char *report = std::getenv("AIRREPLAY_DIVERGENCE_REPORT")) {
+    divergence_report_ = report;
+  }
 
   if (rrmode_ == Mode::kReplay) {
+    int threads = std::max(8u, std::thread::hardware_concurrency());
+    if (const char *n = std::getenv("AIRREPLAY_REPRODUCER_THREADS")) {
+      threads = std::max(1, std::stoi(n));
+    }
+    reproducers_ = std::make_unique<ReproducerExecutor>(threads);
+    if (transport_) {
+      transport_listener_ =
+          transport_->AddListener([this]() { WakeExternalReplayer(); });
+    }
     // start replay thread
     running_callbacks_.push_back(
         std::thread(&airreplay::Airreplay::externalReplayerLoop, this));
@@ -45,10 +88,22 @@ Airreplay::Airreplay(std::string tracename, Mode mode)
 }
 
 Airreplay::~Airreplay() {
+  if (transport_listener_ >= 0) {
+    transport_->RemoveListener(transport_listener_);
+  }
   shutdown_ = true;
+  WakeExternalReplayer();
+  WakeLookahead();
   for (auto &t : running_callbacks_) {
     t.join();
   }
+  if (lookahead_thread_.joinable()) {
+    lookahead_thread_.join();
+  }
+  if (reproducers_) {
+    log("Airreplay", ReproducerExecutor::StatsString(reproducers_->GetStats()));
+    reproducers_.reset();
+  }
 }
 
 // *** accounting and convenience ***
@@ -60,9 +115,12 @@ std::string Airreplay::MessageKindName(int kind) {
       return "kDefault";
     case kSaveRestore:
       return "kSaveRestore";
+    case kCheckpoint:
+      return "kCheckpoint";
   }
-  if (userMsgKinds_.find(kind) != userMsgKinds_.end()) {
-    return "UserMessage(" + userMsgKinds_[kind] + ")";
+  const KindInfo *info = FindKindUnlocked(kind);
+  if (info != nullptr && !info->name.empty()) {
+    return "UserMessage(" + info->name + ")";
   }
   return "UnnamedMessageKind(" + std::to_string(kind) + ")";
 }
@@ -73,7 +131,17 @@ void Airreplay::RegisterMessageKindName(int kind, const std::string &name) {
         "kind " + std::to_string(kind) + " is reserved for internal use" +
         "Please use kinds larger than " + std::to_string(kMaxReservedMsgKind));
   }
-  userMsgKinds_[kind] = name;
+  std::lock_guard lock(recordOrder_);
+  KindInfoUnlocked(kind).name = name;
+}
+
+Airreplay::KindInfo &Airreplay::KindInfoUnlocked(int kind) {
+  // kinds are small application-defined enums
+  CHECK(kind >= 0 && kind < (1 << 16)) << "kind out of range: " << kind;
+  if (kind >= (int)kinds_.size()) {
+    kinds_.resize(kind + 1);
+  }
+  return kinds_[kind];
 }
 
 bool Airreplay::isReplay() { return rrmode_ == Mode::kReplay; }
@@ -87,7 +155,16 @@ void Airreplay::RegisterReproducers(std::map<int, ReproducerFunction> hooks) {
                                std::to_string(kMaxReservedMsgKind));
     }
   }
-  hooks_ = hooks;
+  {
+    std::lock_guard lock(recordOrder_);
+    for (auto &info : kinds_) {
+      info.reproducer = nullptr;
+    }
+    for (auto &kv : hooks) {
+      KindInfoUnlocked(kv.first).reproducer = kv.second;
+    }
+  }
+  WakeExternalReplayer();
 }
 
 void Airreplay::RegisterReproducer(int kind, ReproducerFunction reproducer) {
@@ -96,7 +173,37 @@ void Airreplay::RegisterReproducer(int kind, ReproducerFunction reproducer) {
         "kind " + std::to_string(kind) + " is reserved for internal use" +
         "Please use kinds larger than " + std::to_string(kMaxReservedMsgKind));
   }
-  hooks_[kind] = reproducer;
+  {
+    std::lock_guard lock(recordOrder_);
+    KindInfoUnlocked(kind).reproducer = reproducer;
+  }
+  WakeExternalReplayer();
+}
+
+void Airreplay::RegisterDirectReproducer(int kind,
+                                         ReproducerFunction reproducer) {
+  RegisterReproducer(kind, reproducer);
+  {
+    std::lock_guard lock(recordOrder_);
+    KindInfoUnlocked(kind).direct = true;
+  }
+  WakeExternalReplayer();
+}
+
+void Airreplay::RegisterKindType(int kind,
+                                 const google::protobuf::Message &prototype) {
+  std::shared_ptr<const google::protobuf::Message> copy(prototype.New());
+  std::lock_guard lock(recordOrder_);
+  KindInfoUnlocked(kind).prototype = std::move(copy);
+  has_typed_kinds_ = true;
+  if (rrmode_ != Mode::kReplay) return;
+
+  // rescan the window for the new kind
+  lookahead_pos_ = 0;
+  if (!lookahead_thread_.joinable()) {
+    lookahead_thread_ = std::thread(&Airreplay::lookaheadLoop, this);
+  }
+  WakeLookahead();
 }
 
 airreplay::OpequeEntry Airreplay::NewOpequeEntry(
@@ -121,12 +228,60 @@ airreplay::OpequeEntry Airreplay::NewOpequeEntry(
   return header;
 }
 
+void Airreplay::ConsumeHeadUnlocked(const airreplay::OpequeEntry &head) {
+  if (transport_) {
+    transport_->Send(head);
+  }
+  trace_.ConsumeHead(head);
+  if (!last_divergence_.empty()) {
+    // the mismatch was a thread arriving early, not a divergence
+    std::remove(divergence_report_.c_str());
+    last_divergence_.clear();
+  }
+  WakeExternalReplayer();
+  if (has_typed_kinds_) {
+    WakeLookahead();
+  }
+  if (stop_at_ >= 0 && trace_.pos() >= stop_at_) {
+    log("Airreplay", "reached AIRREPLAY_STOP_AT=" + std::to_string(stop_at_) +
+                         ". Stopping replay");
+    // other threads may be blocked in replay, so do not run destructors
+    std::_Exit(kReachedStopAtStatus);
+  }
+  if (!async_matches_.empty()) {
+    MatchAsyncUnlocked();
+  }
+}
+
+void Airreplay::WakeExternalReplayer() {
+  {
+    std::lock_guard lock(wake_mutex_);
+    wakeup_pending_ = true;
+  }
+  wake_cv_.notify_one();
+}
+
+void Airreplay::LogDivergence(const std::string &context,
+                              const airreplay::OpequeEntry &expected,
+                              const std::string &msg) {
+  log(context, msg);
+  if (divergence_report_.empty() || msg == last_divergence_) return;
+
+  last_divergence_ = msg;
+  std::ofstream report(divergence_report_, std::ios::out | std::ios::trunc);
+  report << context << "\n"
+         << "expected: " << expected.ShortDebugString() << "\n"
+         << msg << std::endl;
+}
+
 // todo:: move to external_replayer.cc
 // replay external RPCs. Since Responses of outgoing RPCs are taken care of
 // by RROutgoingCallAsync, this function only handles incoming RPC calls
 bool Airreplay::MaybeReplayExternalRPCUnlocked(
     const airreplay::OpequeEntry &req_peek) {
-  if (hooks_.find(req_peek.kind()) == hooks_.end()) return false;
+  const KindInfo *info = FindKindUnlocked(req_peek.kind());
+  if (info == nullptr || !info->reproducer) return false;
+  if (transport_ || info->direct) return ReproduceUnlocked(req_peek);
 
   if (!trace_.SoftConsumeHead(req_peek)) {
     log("MaybeReplayExternalRPCUnlocked",
@@ -136,12 +291,57 @@ bool Airreplay::MaybeReplayExternalRPCUnlocked(
   }
 
   // auto callback = [=]() {
-  //   hooks_[req_peek.kind()](req_peek.connection_info(), req_peek.message());
+  //   reproducer(req_peek.connection_info(), req_peek.message());
   // };
   // auto running_callback = std::thread(callback);
   // q:: does std::move do something here?
   // running_callbacks_.push_back(std::move(running_callback));
-  socketReplay_.SendTraffic(req_peek.connection_info(), req_peek);
+  // only queues the message. Connecting and sending happen on the
+  // SocketTraffic dispatcher thread, outside of recordOrder_
+  socketReplay_->SendTraffic(req_peek.connection_info(), req_peek);
+  return true;
+}
+
+bool Airreplay::ReproduceUnlocked(const airreplay::OpequeEntry &req_peek) {
+  if (trace_.IsSoftConsumed(req_peek)) {
+    log("ReproduceUnlocked",
+        "Warning: callback had previously been scheduled but still is on the "
+        "trace");
+    return false;
+  }
+
+  airreplay::OpequeEntry msg;
+  if (transport_ && transport_->IsInbound(req_peek.kind())) {
+    // the peer has not replayed the matching outbound message yet
+    if (!transport_->TryReceive(req_peek.connection_info(), req_peek.kind(),
+                                transport_listener_, &msg)) {
+      return false;
+    }
+    if (PayloadBytes(msg) != PayloadBytes(req_peek)) {
+      LogDivergence("InMemoryTransport", req_peek,
+                    "peer sent a different message on " +
+                        req_peek.connection_info() + ": " +
+                        msg.ShortDebugString());
+    }
+  } else {
+    msg = req_peek;
+  }
+
+  // the peer's payload only differs from ours after a divergence, and then
+  // the pre-decoded one is not the one delivered
+  bool same_payload = PayloadBytes(msg) == PayloadBytes(req_peek);
+  auto decoded = DecodedPayloadUnlocked(same_payload ? trace_.pos() : -1,
+                                        req_peek.kind(), PayloadBytes(msg));
+
+  trace_.SoftConsumeHead(req_peek);
+  // the reproducer calls back into RecordReplay, which needs recordOrder_
+  reproducers_->Submit(
+      req_peek.connection_info(),
+      [hook = FindKindUnlocked(req_peek.kind())->reproducer,
+       msg = std::move(msg),
+       decoded = std::move(decoded)]() {
+        hook(msg.connection_info(), decoded ? *decoded : msg.message());
+      });
   return true;
 }
 
@@ -174,11 +374,33 @@ int Airreplay::MaybeSaveRestore(const std::string &key, uint64_t &message) {
                              /*bail after*/ 100);
 }
 
+int Airreplay::Checkpoint(const std::string &key,
+                          google::protobuf::Message &snapshot) {
+  return SaveRestoreInternal(key, nullptr, nullptr, &snapshot, -1,
+                             kCheckpoint);
+}
+
+bool Airreplay::RestoreCheckpoint(google::protobuf::Message *snapshot) {
+  CHECK(rrmode_ == Mode::kReplay);
+  std::lock_guard lock(recordOrder_);
+  if (!trace_.StartedAtCheckpoint() || !trace_.HasNext()) return false;
+
+  int pos = -1;
+  const airreplay::OpequeEntry &req = trace_.PeekNext(&pos);
+  if (req.kind() != kCheckpoint) return false;
+
+  req.message().UnpackTo(snapshot);
+  log("RestoreCheckpoint@" + std::to_string(pos),
+      "restored checkpoint " + req.rr_debug_string());
+  ConsumeHeadUnlocked(req);
+  return true;
+}
+
 int Airreplay::SaveRestoreInternal(const std::string &key,
                                    std::string *str_message,
                                    uint64 *int_message,
                                    google::protobuf::Message *proto_message,
-                                   int bail_after) {
+                                   int bail_after, int kind) {
   // exactly one type of pointer can be saved/restored per call
   assert((str_message != nullptr) + (int_message != nullptr) +
              (proto_message != nullptr) ==
@@ -198,7 +420,7 @@ int Airreplay::SaveRestoreInternal(const std::string &key,
     save_restore_keys_.insert(key);
 
     airreplay::OpequeEntry header;
-    header.set_kind(kSaveRestore);
+    header.set_kind(kind);
     *header.mutable_rr_debug_string() = key;
     if (str_message != nullptr) {
       if (utils::isAscii(*str_message)) {
@@ -228,6 +450,10 @@ int Airreplay::SaveRestoreInternal(const std::string &key,
     // right places) and have appropriate app-level locks held for now this
     // ensured the debug txt trace does not get corrupted when rr is called from
     // multiple threads.
+    if (kind == kCheckpoint) {
+      header.set_num_message(trace_.pos());
+      return trace_.RecordCheckpoint(header);
+    }
     return trace_.Record(header);
   } else {
     int pos = -1;
@@ -238,12 +464,12 @@ int Airreplay::SaveRestoreInternal(const std::string &key,
 
       const airreplay::OpequeEntry &req = trace_.PeekNext(&pos);
 
-      if (req.kind() != kSaveRestore || req.rr_debug_string() != key) {
+      if (req.kind() != kind || req.rr_debug_string() != key) {
         if (!MaybeReplayExternalRPCUnlocked(req)) {
-          if (req.kind() != kSaveRestore) {
+          if (req.kind() != kind) {
             log("SaveRestoreInternal@" + std::to_string(pos),
-                "not the right kind. expected: " +
-                    MessageKindName(kSaveRestore) + " got tracePeek:" +
+                "not the right kind. expected: " + MessageKindName(kind) +
+                    " got tracePeek:" +
                     MessageKindName(req.kind()) + ")\t\tcalled with: " + key);
           } else {
             log("SaveRestoreInternal@" + std::to_string(pos),
@@ -282,7 +508,7 @@ int Airreplay::SaveRestoreInternal(const std::string &key,
       log("SaveRestoreInternal@" + std::to_string(pos),
           "just SaveRESTORED " + req.ShortDebugString());
 
-      trace_.ConsumeHead(req);
+      ConsumeHeadUnlocked(req);
       assert(lock.owns_lock());
       return pos;
     }
@@ -367,6 +593,122 @@ int Airreplay::SaveRestorePerThread(const thread_id tid, uint64 &message,
                      message, bail_after);
 }
 
+namespace {
+// payload of a RecordReplay call given as a protobuf
+class MessageBody {
+ public:
+  explicit MessageBody(const google::protobuf::Message &message)
+      : message_(message) {}
+
+  void Fill(bool typed, airreplay::OpequeEntry *header) const {
+    if (typed) {
+      // the type is known from the kind, so skip Any and its type url
+      message_.SerializeToString(header->mutable_bytes_message());
+      header->set_body_size(header->bytes_message().size());
+    } else if (message_.IsInitialized()) {
+#if USE_OLD_PROTOBUF
+      size_t mlen = message_.ByteSize();
+#else
+      size_t mlen = message_.ByteSizeLong();
+#endif
+      header->set_body_size(mlen);
+      header->mutable_message()->PackFrom(message_);
+    }
+  }
+
+  bool Matches(const airreplay::OpequeEntry &entry) const {
+    if (serialized_.empty()) serialized_ = message_.SerializeAsString();
+    return PayloadBytes(entry) == serialized_;
+  }
+
+  std::string Mismatch(const airreplay::OpequeEntry &entry,
+                       const google::protobuf::Message *) const {
+    if (entry.has_message()) {
+      return utils::compareMessageWithAny(message_, entry.message());
+    }
+    std::unique_ptr<google::protobuf::Message> expected(message_.New());
+    expected->ParseFromString(PayloadBytes(entry));
+    return utils::compareMessages(message_, *expected);
+  }
+
+  std::string DebugString() const { return message_.ShortDebugString(); }
+
+ private:
+  const google::protobuf::Message &message_;
+  // computed on the first comparison and reused across replay attempts
+  mutable std::string serialized_;
+};
+
+// payload of a RecordReplay call given as already serialized slices
+class BytesBody {
+ public:
+  BytesBody(const struct iovec *iov, int iovcnt) : iov_(iov), iovcnt_(iovcnt) {}
+
+  void Fill(bool, airreplay::OpequeEntry *header) const {
+    std::string *bytes = header->mutable_bytes_message();
+    bytes->reserve(Size());
+    for (int i = 0; i < iovcnt_; i++) {
+      bytes->append(static_cast<const char *>(iov_[i].iov_base),
+                    iov_[i].iov_len);
+    }
+    header->set_body_size(bytes->size());
+  }
+
+  bool Matches(const airreplay::OpequeEntry &entry) const {
+    std::string_view recorded = PayloadBytes(entry);
+    if (recorded.size() != Size()) return false;
+    for (int i = 0; i < iovcnt_; i++) {
+      std::string_view slice(static_cast<const char *>(iov_[i].iov_base),
+                             iov_[i].iov_len);
+      if (recorded.substr(0, slice.size()) != slice) return false;
+      recorded.remove_prefix(slice.size());
+    }
+    return true;
+  }
+
+  std::string Mismatch(const airreplay::OpequeEntry &entry,
+                       const google::protobuf::Message *prototype) const {
+    std::string bytes = Concat();
+    if (prototype != nullptr) {
+      std::unique_ptr<google::protobuf::Message> actual(prototype->New());
+      std::unique_ptr<google::protobuf::Message> expected(prototype->New());
+      actual->ParseFromString(bytes);
+      expected->ParseFromString(PayloadBytes(entry));
+      return utils::compareMessages(*actual, *expected);
+    }
+    const std::string &recorded = PayloadBytes(entry);
+    size_t i = 0;
+    while (i < bytes.size() && i < recorded.size() && bytes[i] == recorded[i]) {
+      i++;
+    }
+    return "payload of " + std::to_string(bytes.size()) +
+           " bytes differs from the recorded " +
+           std::to_string(recorded.size()) + " bytes at offset " +
+           std::to_string(i);
+  }
+
+  std::string DebugString() const {
+    return std::to_string(Size()) + " bytes in " + std::to_string(iovcnt_) +
+           " slices";
+  }
+
+ private:
+  size_t Size() const {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt_; i++) size += iov_[i].iov_len;
+    return size;
+  }
+  std::string Concat() const {
+    airreplay::OpequeEntry tmp;
+    Fill(false, &tmp);
+    return tmp.bytes_message();
+  }
+
+  const struct iovec *iov_;
+  int iovcnt_;
+};
+}  // namespace
+
 // for incoming requests
 // todo: should be used in some places of outgoing request where we currently
 // use save/restore
@@ -374,6 +716,107 @@ int Airreplay::RecordReplay(const std::string &key,
                             const std::string &connection_info,
                             const google::protobuf::Message &message, int kind,
                             const std::string &debug_info) {
+  return RecordReplayInternal(key, connection_info, kind, MessageBody(message));
+}
+
+int Airreplay::RecordReplay(const std::string &key,
+                            const std::string &connection_info,
+                            std::string_view bytes, int kind) {
+  struct iovec iov = {const_cast<char *>(bytes.data()), bytes.size()};
+  return RecordReplayInternal(key, connection_info, kind, BytesBody(&iov, 1));
+}
+
+int Airreplay::RecordReplay(const std::string &key,
+                            const std::string &connection_info,
+                            const struct iovec *iov, int iovcnt, int kind) {
+  return RecordReplayInternal(key, connection_info, kind,
+                              BytesBody(iov, iovcnt));
+}
+
+std::future<int> Airreplay::RecordReplayAsync(
+    const std::string &key, const std::string &connection_info,
+    const google::protobuf::Message &message, int kind) {
+  if (rrmode_ == Mode::kRecord) {
+    std::promise<int> done;
+    done.set_value(RecordReplay(key, connection_info, message, kind));
+    return done.get_future();
+  }
+  std::shared_ptr<google::protobuf::Message> copy(message.New());
+  copy->CopyFrom(message);
+  return ReplayAsync({key, connection_info, kind == 0 ? kDefault : kind,
+                      message.SerializeAsString(), std::move(copy),
+                      std::promise<int>()});
+}
+
+std::future<int> Airreplay::RecordReplayAsync(
+    const std::string &key, const std::string &connection_info,
+    std::string_view bytes, int kind) {
+  if (rrmode_ == Mode::kRecord) {
+    std::promise<int> done;
+    done.set_value(RecordReplay(key, connection_info, bytes, kind));
+    return done.get_future();
+  }
+  return ReplayAsync({key, connection_info, kind == 0 ? kDefault : kind,
+                      std::string(bytes), nullptr, std::promise<int>()});
+}
+
+std::future<int> Airreplay::ReplayAsync(AsyncMatch match) {
+  std::future<int> done = match.done.get_future();
+  std::lock_guard lock(recordOrder_);
+  async_matches_.push_back(std::move(match));
+  // the entry may already be at the head
+  MatchAsyncUnlocked();
+  return done;
+}
+
+void Airreplay::MatchAsyncUnlocked() {
+  // consuming a matched head below calls back into here
+  if (matching_async_) return;
+  matching_async_ = true;
+  bool matched = true;
+  while (matched && trace_.HasNext()) {
+    matched = false;
+    int pos = -1;
+    const airreplay::OpequeEntry &head = trace_.PeekNext(&pos);
+    for (auto it = async_matches_.begin(); it != async_matches_.end(); ++it) {
+      if (it->kind != head.kind() || it->key != head.rr_debug_string() ||
+          it->connection_info != head.connection_info()) {
+        continue;
+      }
+      if (it->payload != PayloadBytes(head)) {
+        const KindInfo *info = FindKindUnlocked(it->kind);
+        const google::protobuf::Message *prototype =
+            info != nullptr ? info->prototype.get() : nullptr;
+        struct iovec iov = {it->payload.data(), it->payload.size()};
+        std::string mismatch =
+            it->message ? MessageBody(*it->message).Mismatch(head, prototype)
+                        : BytesBody(&iov, 1).Mismatch(head, prototype);
+        // the bytes differ but the parsed messages do not, e.g. a field
+        // encoded twice. See RecordReplayInternal
+        if (!mismatch.empty() && mismatch != utils::PROTO_COMPARE_FALSE_ALARM) {
+          LogDivergence("RecordReplayAsync@" + std::to_string(pos), head,
+                        "right kind, entry key(" + it->key +
+                            ") and connection. wrong payload. " + mismatch);
+          continue;
+        }
+      }
+      std::promise<int> done = std::move(it->done);
+      async_matches_.erase(it);
+      log("RecordReplayAsync@" + std::to_string(pos),
+          "Just REPLAYED" + head.ShortDebugString());
+      ConsumeHeadUnlocked(head);
+      done.set_value(pos);
+      matched = true;
+      break;
+    }
+  }
+  matching_async_ = false;
+}
+
+template <typename Body>
+int Airreplay::RecordReplayInternal(const std::string &key,
+                                    const std::string &connection_info,
+                                    int kind, const Body &body) {
   if (rrmode_ == Mode::kRecord) {
     std::lock_guard lock(recordOrder_);
 
@@ -385,15 +828,8 @@ int Airreplay::RecordReplay(const std::string &key,
     header.set_rr_debug_string(key);
     header.set_connection_info(connection_info);
 
-    if (message.IsInitialized()) {
-#if USE_OLD_PROTOBUF
-      size_t mlen = message.ByteSize();
-#else
-      size_t mlen = message.ByteSizeLong();
-#endif
-      header.set_body_size(mlen);
-      header.mutable_message()->PackFrom(message);
-    }
+    const KindInfo *info = FindKindUnlocked(kind);
+    body.Fill(info != nullptr && info->prototype, &header);
     return trace_.Record(header);
   } else {
     int pos = -1;
@@ -408,29 +844,33 @@ int Airreplay::RecordReplay(const std::string &key,
         DLOG(ERROR) << "Replay attempt " << num_replay_attempts_
                     << " for key: " << key << " kind: " << kind
                     << " connection_info: " << connection_info
-                    << " message: " << message.ShortDebugString();
+                    << " message: " << body.DebugString();
       }
       num_replay_attempts_++;
 
       std::unique_lock lock(recordOrder_);
       const airreplay::OpequeEntry &req_peek = trace_.PeekNext(&pos);
       if (req_peek.kind() != kind) {
-        log("RecordReplay@" + std::to_string(pos),
+        LogDivergence(
+            "RecordReplay@" + std::to_string(pos), req_peek,
             "not the right kind expected: " + MessageKindName(req_peek.kind()) +
                 " called with: " + MessageKindName(kind) + "\t\tkey: " + key);
       } else if (key != req_peek.rr_debug_string()) {
-        log("RecordReplay@" + std::to_string(pos),
-            "right kind(" + MessageKindName(kind) +
-                ") but not the right entry\texpected key:" +
-                req_peek.rr_debug_string() + " but was called with:" + key);
+        LogDivergence("RecordReplay@" + std::to_string(pos), req_peek,
+                      "right kind(" + MessageKindName(kind) +
+                          ") but not the right entry\texpected key:" +
+                          req_peek.rr_debug_string() +
+                          " but was called with:" + key);
       } else if (connection_info != req_peek.connection_info()) {
-        log("RecordReplay@" + std::to_string(pos),
+        LogDivergence(
+            "RecordReplay@" + std::to_string(pos), req_peek,
             "right kind and entry key. wrong connection info. expected: " +
                 req_peek.connection_info() +
                 " called with: " + connection_info);
-      } else if (req_peek.message().value() != message.SerializeAsString()) {
-        auto mismatch =
-            utils::compareMessageWithAny(message, req_peek.message());
+      } else if (!body.Matches(req_peek)) {
+        const KindInfo *info = FindKindUnlocked(kind);
+        auto mismatch = body.Mismatch(
+            req_peek, info != nullptr ? info->prototype.get() : nullptr);
         assert(mismatch != "");
 
         // for some reason binary blobs were different but nothing different was
@@ -442,15 +882,16 @@ int Airreplay::RecordReplay(const std::string &key,
 
           log("RecordReplay@" + std::to_string(pos),
               "Just REPLAYED" + req_peek.ShortDebugString());
-          trace_.ConsumeHead(req_peek);
+          ConsumeHeadUnlocked(req_peek);
           num_replay_attempts_ = 0;
           assert(lock.owns_lock());
           return pos;
         }
 
-        log("RecordReplay@" + std::to_string(pos),
-            "right kind and entry key(" + key +
-                ") and connection. wrong proto message. " + mismatch);
+        LogDivergence("RecordReplay@" + std::to_string(pos), req_peek,
+                      "right kind and entry key(" + key +
+                          ") and connection. wrong proto message. " +
+                          mismatch);
         using namespace backward;
         StackTrace st;
         st.load_here(32);
@@ -463,11 +904,10 @@ int Airreplay::RecordReplay(const std::string &key,
         assert(req_peek.kind() == kind);
         assert(req_peek.rr_debug_string() == key);
         assert(req_peek.connection_info() == connection_info);
-        assert(req_peek.message().value() == message.SerializeAsString());
 
         log("RecordReplay@" + std::to_string(pos),
             "Just REPLAYED" + req_peek.ShortDebugString());
-        trace_.ConsumeHead(req_peek);
+        ConsumeHeadUnlocked(req_peek);
         num_replay_attempts_ = 0;
         assert(lock.owns_lock());
         return pos;
@@ -1,17 +1,26 @@
 #pragma once
 
 #include <google/protobuf/any.pb.h>
+#include <sys/uio.h>
 
+#include <atomic>
 #include <boost/function.hpp>  // AsyncRequest uses boost::function
+#include <condition_variable>
 #include <deque>
 #include <functional>
+#include <future>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 #include "airreplay.pb.h"
+#include "in_memory_transport.h"
 #include "mock_socket_traffic.h"
+#include "reproducer_executor.h"
 #include "trace.h"
 
 namespace airreplay {
@@ -24,8 +33,11 @@ enum ReservedMsgKinds {
   kInvalid,
   kDefault,
   kSaveRestore,
+  // takes the slot kMaxReservedMsgKind had so kinds 4 and up, which
+  // applications already record, stay theirs
+  kCheckpoint,
 
-  kMaxReservedMsgKind,  // should be last!
+  kMaxReservedMsgKind = kCheckpoint,  // should be last!
 };
 
 void log(const std::string &context, const std::string &msg);
@@ -34,7 +46,13 @@ class Airreplay {
   using thread_id = uint64;
   // same as the static interface below but allows for multiple independent
   // recordings in the same app used for testing mainly
-  Airreplay(std::string tracename, Mode mode);
+  // trace_options controls segment rotation and retention of the recorded
+  // trace (see TraceOptions in trace.h)
+  // When transport is given, inbound messages are reproduced from the peers
+  // replaying in the same process through it instead of over the mock
+  // sockets of SocketTraffic (see InMemoryTransport)
+  Airreplay(std::string tracename, Mode mode, TraceOptions trace_options = {},
+            std::shared_ptr<InMemoryTransport> transport = nullptr);
   ~Airreplay();
 
   std::string MessageKindName(int kind);
@@ -47,6 +65,18 @@ class Airreplay {
 
   int MaybeSaveRestore(const std::string &key, uint64_t &message);
 
+  // Records an application snapshot together with the current trace position
+  // so replay can later start from here instead of from the head of the trace
+  // (see TraceOptions::replay_from_checkpoint_before).
+  // Call it periodically from a point where snapshot fully describes the
+  // application state. In replay it behaves like SaveRestore.
+  int Checkpoint(const std::string &key, google::protobuf::Message &snapshot);
+  // Replay only. If replay was started from a checkpoint and the checkpoint is
+  // at the head of the trace, populates snapshot with the recorded snapshot,
+  // consumes the entry and returns true. The application must then restore
+  // its state from snapshot before issuing any other AirReplay calls
+  bool RestoreCheckpoint(google::protobuf::Message *snapshot);
+
   int RegisterThreadForSaveRestore(const std::string &key, const thread_id tid);
   // note that unlike SaveRestore, no unique-ish key is required here (-ish,
   // because the unique key is not that unique in SaveRestore) key is required
@@ -80,12 +110,64 @@ class Airreplay {
   int RecordReplay(const std::string &key, const std::string &connection_info,
                    const google::protobuf::Message &message, int kind = 0,
                    const std::string &debug_info = "");
+  // same as above for messages the application already holds in wire
+  // format. kind identifies the type of bytes (see RegisterKindType). The
+  // bytes are copied into the trace once and compared as raw bytes in replay,
+  // without building protobuf objects
+  int RecordReplay(const std::string &key, const std::string &connection_info,
+                   std::string_view bytes, int kind);
+  // scatter-gather version. The message is the concatenation of the slices
+  int RecordReplay(const std::string &key, const std::string &connection_info,
+                   const struct iovec *iov, int iovcnt, int kind);
+
+  // non-blocking RecordReplay for event-loop threads. In record mode the
+  // entry is recorded right away. In replay the returned future completes
+  // with the entry's trace position once the entry reaches the head of the
+  // trace and is consumed, so the caller never sleeps waiting for its turn.
+  // If the Airreplay instance is destroyed first, the future throws
+  // std::future_error (broken_promise)
+  std::future<int> RecordReplayAsync(const std::string &key,
+                                     const std::string &connection_info,
+                                     const google::protobuf::Message &message,
+                                     int kind = 0);
+  std::future<int> RecordReplayAsync(const std::string &key,
+                                     const std::string &connection_info,
+                                     std::string_view bytes, int kind);
 
   bool isReplay();
 
   // ****************** the next two are only used in replay ******************
   void RegisterReproducers(std::map<int, ReproducerFunction> reproduers);
   void RegisterReproducer(int kind, ReproducerFunction reproducer);
+  // reproducers are normally only used to tell which kinds are inbound, and
+  // the inbound traffic itself is replayed from the recorded sockets by
+  // SocketTraffic. Reproducers registered here are instead called with the
+  // recorded message and deliver it to the application themselves
+  void RegisterDirectReproducer(int kind, ReproducerFunction reproducer);
+  // registers the message type recorded for kind. Such kinds are recorded as
+  // plain bytes instead of an Any. In replay their payloads are decoded by a
+  // background thread ahead of the replay cursor, and their reproducers
+  // receive the decoded prototype type instead of an Any
+  void RegisterKindType(int kind, const google::protobuf::Message &prototype);
+
+  // typed versions of RegisterMessageKindName + RegisterKindType and of
+  // RegisterReproducer
+  template <typename T>
+  void RegisterKind(int kind, const std::string &name) {
+    RegisterMessageKindName(kind, name);
+    RegisterKindType(kind, T::default_instance());
+  }
+  template <typename T>
+  void RegisterReproducer(
+      int kind,
+      std::function<void(const std::string &connection_info, const T &msg)>
+          reproducer) {
+    RegisterKindType(kind, T::default_instance());
+    RegisterReproducer(kind, [reproducer](const std::string &connection_info,
+                                          const google::protobuf::Message &msg) {
+      reproducer(connection_info, static_cast<const T &>(msg));
+    });
+  }
 
  private:
   // this API is necessary for 2 reasons
@@ -98,16 +180,48 @@ class Airreplay {
   int SaveRestoreInternal(const std::string &key, std::string *str_message,
                           uint64 *int_message,
                           google::protobuf::Message *proto_message,
-                          int bail_after = -1);
+                          int bail_after = -1, int kind = kSaveRestore);
+  // shared by the RecordReplay overloads. Body is one of the payload
+  // adapters in airreplay.cc
+  template <typename Body>
+  int RecordReplayInternal(const std::string &key,
+                           const std::string &connection_info, int kind,
+                           const Body &body);
   Mode rrmode_;
   Trace trace_;
   int num_replay_attempts_ = 0;
-  SocketTraffic socketReplay_;
+  // exactly one of the two is set
+  std::unique_ptr<SocketTraffic> socketReplay_;
+  std::shared_ptr<InMemoryTransport> transport_;
 
-  std::map<int, std::string> userMsgKinds_;
+  // per-kind registrations, indexed by kind. Protected by recordOrder_
+  struct KindInfo {
+    std::string name;
+    // set by RegisterKindType
+    std::shared_ptr<const google::protobuf::Message> prototype;
+    ReproducerFunction reproducer;
+    // set by RegisterDirectReproducer
+    bool direct = false;
+  };
+  std::vector<KindInfo> kinds_;
+  bool has_typed_kinds_ = false;
+  // returns the registrations of kind, growing the table if needed
+  KindInfo &KindInfoUnlocked(int kind);
+  // returns nullptr if nothing was registered for kind
+  const KindInfo *FindKindUnlocked(int kind) const {
+    return kind >= 0 && kind < (int)kinds_.size() ? &kinds_[kind] : nullptr;
+  }
 
   // used to inform background threads about shutdown
-  bool shutdown_ = false;
+  std::atomic<bool> shutdown_{false};
+
+  // the external replayer sleeps on wake_cv_ until the trace head advances,
+  // a reproducer is registered or the peer sends on transport_.
+  // wake_mutex_ is a leaf lock: nothing else is acquired while holding it
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  bool wakeup_pending_ = false;
+  int transport_listener_ = -1;
 
   // mutex and vars protected by it
   std::mutex recordOrder_;
@@ -118,12 +232,70 @@ class Airreplay {
 
   // ****************** below are only used in replay ******************
   bool MaybeReplayExternalRPCUnlocked(const airreplay::OpequeEntry &req_peek);
+  // delivers req_peek to its reproducer. With transport_, the message comes
+  // from the peer for routed inbound kinds and from our own trace otherwise
+  bool ReproduceUnlocked(const airreplay::OpequeEntry &req_peek);
+  // runs reproducers. Sized by AIRREPLAY_REPRODUCER_THREADS
+  std::unique_ptr<ReproducerExecutor> reproducers_;
+
+  // lookahead decoding of payloads for kinds registered via RegisterKindType
+  void lookaheadLoop();
+  void WakeLookahead();
+  // returns payload decoded into the type registered for kind, or nullptr if
+  // there is none. Takes the result of the lookahead thread for trace
+  // position pos if there is one, otherwise decodes inline
+  std::shared_ptr<const google::protobuf::Message> DecodedPayloadUnlocked(
+      int pos, int kind, const std::string &payload);
+  // first position the lookahead thread has not scanned yet
+  int lookahead_pos_ = 0;
+  std::thread lookahead_thread_;
+  // leaf lock, protects the vars below
+  std::mutex lookahead_mutex_;
+  std::condition_variable lookahead_cv_;
+  bool lookahead_pending_ = false;
+  // trace position -> decoded payload
+  std::map<int, std::shared_ptr<const google::protobuf::Message>> decoded_;
   // Constructs and returns an opeque entry
   airreplay::OpequeEntry NewOpequeEntry(
       const std::string &debugstring, const google::protobuf::Message &request,
       int kind, int linkToken = -1);
 
   void externalReplayerLoop();
+  void WakeExternalReplayer();
+
+  // consumes the trace head. Stops the process once the position given by
+  // the AIRREPLAY_STOP_AT environment variable is reached
+  void ConsumeHeadUnlocked(const airreplay::OpequeEntry &head);
+
+  // RecordReplayAsync calls waiting for their entry, in call order.
+  // Protected by recordOrder_
+  struct AsyncMatch {
+    std::string key;
+    std::string connection_info;
+    int kind;
+    std::string payload;
+    // copy of the message of the proto overload, null for bytes. Compared
+    // field by field when the payload differs, like RecordReplay does
+    std::shared_ptr<const google::protobuf::Message> message;
+    std::promise<int> done;
+  };
+  std::list<AsyncMatch> async_matches_;
+  bool matching_async_ = false;
+  std::future<int> ReplayAsync(AsyncMatch match);
+  // consumes the head for as long as it is the entry of a waiting
+  // RecordReplayAsync call. Called after every head advance
+  void MatchAsyncUnlocked();
+  // logs a replay mismatch against the expected head entry. When
+  // AIRREPLAY_DIVERGENCE_REPORT names a file, the mismatch is also written
+  // there for airreplay-bisect and airreplay-farm. The file is removed again
+  // once the head advances, so it only exists while replay is stuck
+  void LogDivergence(const std::string &context,
+                     const airreplay::OpequeEntry &expected,
+                     const std::string &msg);
+  int stop_at_ = -1;
+  std::string divergence_report_;
+  // the mismatch in the report file, empty if there is none
+  std::string last_divergence_;
 
   // maps replay runtime thread ids back to the corresponding recorded
   // thread ids.
@@ -131,7 +303,6 @@ class Airreplay {
   // and this will be used to convert them back to a value that can be looked up
   // on the recorded trace
   std::map<thread_id, thread_id> thread_id_map_;
-  std::map<int, ReproducerFunction> hooks_;
   std::function<void()> kUnreachableCallback_{
       []() { std::runtime_error("must have been unreachable"); }};
 };
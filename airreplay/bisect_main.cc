@@ -0,0 +1,249 @@
+// airreplay-bisect: finds the first trace position at which replay diverges.
+//
+// Usage:
+//   airreplay-bisect --trace <prefix> [--jobs N] [--timeout SECONDS]
+//                    [--workdir DIR] [--ports 7000,7001] [--port-stride 100]
+//                    -- <replay command> [args...]
+//
+// The replay command is any program that replays <prefix> through AirReplay
+// (e.g. a kudu test binary in replay mode). Each worker runs it with
+// AIRREPLAY_STOP_AT=<position>. The library exits the worker with status
+// kReachedStopAtStatus (86) once the trace head reaches that position. A
+// worker that exits with an error or does not get there within the timeout
+// has diverged before that position. Workers also get
+// AIRREPLAY_DIVERGENCE_REPORT so the last replay mismatch (including the
+// compareMessages diff) can be reported.
+//
+// Workers of a round run side by side like airreplay-farm cases: each one in
+// its own working directory --workdir/worker.<position>, which links to every
+// file next to the trace, so the literal {trace} in the command is replaced by
+// the trace file name. The i-th worker of a round listens with the mock
+// servers of --ports shifted by i * --port-stride (AIRREPLAY_MOCK_PORTS), and
+// {ports} in the command is replaced by those shifted ports.
+//
+// The whole trace is replayed first. If that diverges, each round runs --jobs
+// workers in parallel at evenly spaced positions strictly inside the current
+// interval and narrows it to the last passing and the first failing position.
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "worker_process.h"
+
+namespace {
+
+struct Options {
+  std::string trace;
+  int jobs = std::max(1u, std::thread::hardware_concurrency());
+  std::chrono::seconds timeout{60};
+  std::string workdir;
+  std::vector<int> ports = {7000, 7001};
+  int port_stride = 100;
+  std::vector<std::string> command;
+};
+
+void Usage() {
+  std::cerr << "usage: airreplay-bisect --trace <prefix> [--jobs N] "
+               "[--timeout SECONDS] [--workdir DIR] [--ports P1,P2] "
+               "[--port-stride N] -- <replay command> [args...]"
+            << std::endl;
+  exit(2);
+}
+
+Options ParseArgs(int argc, char **argv) {
+  Options options;
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      i++;
+      break;
+    }
+    if (i + 1 >= argc) Usage();
+    if (arg == "--trace") {
+      options.trace = argv[++i];
+    } else if (arg == "--jobs") {
+      options.jobs = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--timeout") {
+      options.timeout = std::chrono::seconds(std::stoi(argv[++i]));
+    } else if (arg == "--workdir") {
+      options.workdir = argv[++i];
+    } else if (arg == "--ports") {
+      options.ports.clear();
+      std::stringstream ss(argv[++i]);
+      std::string port;
+      while (std::getline(ss, port, ',')) {
+        options.ports.push_back(std::stoi(port));
+      }
+    } else if (arg == "--port-stride") {
+      options.port_stride = std::stoi(argv[++i]);
+    } else {
+      Usage();
+    }
+  }
+  for (; i < argc; i++) {
+    options.command.push_back(argv[i]);
+  }
+  if (options.trace.empty() || options.command.empty()) Usage();
+  if (options.workdir.empty()) {
+    options.workdir = "airreplay-bisect." + std::to_string(getpid());
+  }
+  // workers run in their own directories below it
+  options.workdir = std::filesystem::absolute(options.workdir).string();
+  return options;
+}
+
+std::string ReportPath(const Options &options, int stop_at) {
+  return options.workdir + "/divergence." + std::to_string(stop_at);
+}
+
+std::string LogPath(const Options &options, int stop_at) {
+  return options.workdir + "/worker." + std::to_string(stop_at) + ".log";
+}
+
+std::string WorkerDir(const Options &options, int stop_at) {
+  return options.workdir + "/worker." + std::to_string(stop_at);
+}
+
+struct Probe {
+  int stop_at;
+  bool passed;
+  std::string outcome;
+};
+
+// runs one worker per position in parallel and waits for all of them
+std::vector<Probe> RunRound(const Options &options,
+                            const std::vector<int> &positions) {
+  std::filesystem::path trace(options.trace);
+  std::string trace_dir =
+      trace.has_parent_path() ? trace.parent_path().string() : ".";
+  std::vector<airreplay::WorkerProcess> workers;
+  workers.reserve(positions.size());
+  for (size_t slot = 0; slot < positions.size(); slot++) {
+    int stop_at = positions[slot];
+    std::string workdir = WorkerDir(options, stop_at);
+    airreplay::LinkFiles(trace_dir, workdir);
+    workers.emplace_back(
+        airreplay::SubstituteCommand(
+            options.command,
+            {{"trace", trace.filename().string()},
+             {"ports", airreplay::SlotPorts(options.ports, slot,
+                                            options.port_stride)}}),
+        std::map<std::string, std::string>{
+            {"AIRREPLAY_MOCK_PORTS",
+             airreplay::SlotMockPorts(options.ports, slot,
+                                      options.port_stride)},
+            {"AIRREPLAY_STOP_AT", std::to_string(stop_at)},
+            {"AIRREPLAY_DIVERGENCE_REPORT", ReportPath(options, stop_at)}},
+        workdir, LogPath(options, stop_at));
+  }
+
+  size_t remaining = workers.size();
+  while (remaining > 0) {
+    for (size_t i = 0; i < workers.size(); i++) {
+      auto &worker = workers[i];
+      if (worker.done()) continue;
+      if (!worker.Poll() && worker.elapsed() > options.timeout) {
+        worker.Kill("stalled past the timeout");
+      }
+      if (worker.done()) {
+        remaining--;
+        std::cerr << "  stop_at=" << positions[i] << ": "
+                  << (worker.passed() ? "ok" : "DIVERGED") << " ("
+                  << worker.outcome() << ")" << std::endl;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  std::vector<Probe> probes;
+  for (size_t i = 0; i < workers.size(); i++) {
+    probes.push_back(
+        {positions[i], workers[i].passed(), workers[i].outcome()});
+  }
+  return probes;
+}
+
+// evenly spaced positions strictly between lo and hi. Both ends are known
+// already, so at most hi - lo - 1 workers have anything to probe
+std::vector<int> ProbePositions(int lo, int hi, int jobs) {
+  std::vector<int> positions;
+  int span = hi - lo;
+  int count = std::min(jobs, span - 1);
+  for (int k = 1; k <= count; k++) {
+    positions.push_back(lo + (int)((long long)span * k / (count + 1)));
+  }
+  return positions;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = ParseArgs(argc, argv);
+  mkdir(options.workdir.c_str(), 0755);
+
+  int first_pos;
+  std::deque<airreplay::OpequeEntry> entries =
+      airreplay::ReadTraceEntries(options.trace, &first_pos);
+  if (entries.empty()) {
+    std::cerr << "trace " << options.trace << " is empty" << std::endl;
+    return 2;
+  }
+
+  // invariant: replay reaches lo and does not reach hi. Position p means the
+  // first p entries were consumed, so replaying to first_pos trivially works
+  int lo = first_pos;
+  int hi = first_pos + entries.size();
+  std::map<int, std::string> outcomes;
+  // the whole trace once, most replays get through it
+  std::cerr << "replaying all " << entries.size() << " entries" << std::endl;
+  Probe full = RunRound(options, {hi}).front();
+  outcomes[hi] = full.outcome;
+  if (full.passed) {
+    std::cout << "replay of all " << entries.size()
+              << " entries completed without divergence" << std::endl;
+    return 0;
+  }
+  while (hi - lo > 1) {
+    std::vector<int> positions = ProbePositions(lo, hi, options.jobs);
+    std::cerr << "bisecting (" << lo << ", " << hi << ") with "
+              << positions.size() << " workers" << std::endl;
+    // positions are ascending. Passes after the first failure are ignored
+    for (const auto &probe : RunRound(options, positions)) {
+      outcomes[probe.stop_at] = probe.outcome;
+      if (!probe.passed) {
+        hi = probe.stop_at;
+        break;
+      }
+      lo = probe.stop_at;
+    }
+  }
+
+  // replay reached lo == hi - 1 but not hi, so the entry at lo never matched
+  const airreplay::OpequeEntry &entry = entries[lo - first_pos];
+  std::cout << "replay diverges at position " << lo << " ("
+            << outcomes[hi] << " when stopping at " << hi << ")\n"
+            << "entry: " << entry.ShortDebugString() << "\n";
+  std::ifstream report(ReportPath(options, hi));
+  if (report) {
+    std::stringstream ss;
+    ss << report.rdbuf();
+    std::cout << "last mismatch reported by the replay:\n" << ss.str();
+  } else {
+    std::cout << "the replay did not report a mismatch, see "
+              << LogPath(options, hi) << std::endl;
+  }
+  return 1;
+}
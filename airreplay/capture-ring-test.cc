@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "airreplay/capture_ring.h"
+
+namespace {
+bool Push(CaptureRing *ring, std::string a, std::string b = "") {
+  struct iovec pieces[2] = {{a.data(), a.size()}, {b.data(), b.size()}};
+  return ring->TryPush(pieces, 2);
+}
+
+std::vector<std::string> DrainAll(CaptureRing *ring) {
+  std::vector<std::string> records;
+  ring->Drain([&records](std::string_view record) {
+    records.emplace_back(record);
+  });
+  return records;
+}
+}  // namespace
+
+TEST(CaptureRingTest, RecordsJoinTheirPieces) {
+  CaptureRing ring(64);
+  EXPECT_TRUE(ring.Empty());
+  EXPECT_TRUE(Push(&ring, "head", "body"));
+  EXPECT_TRUE(Push(&ring, "x"));
+  EXPECT_EQ(DrainAll(&ring), std::vector<std::string>({"headbody", "x"}));
+  EXPECT_TRUE(ring.Empty());
+}
+
+TEST(CaptureRingTest, FullRingRefusesUntilDrained) {
+  CaptureRing ring(64);
+  // 4 byte length + 20 bytes, padded to 24
+  std::string record(20, 'a');
+  EXPECT_TRUE(Push(&ring, record));
+  EXPECT_TRUE(Push(&ring, record));
+  EXPECT_FALSE(Push(&ring, record));
+  EXPECT_EQ(DrainAll(&ring).size(), 2);
+  // wraps around the end of the buffer
+  EXPECT_TRUE(Push(&ring, record, "b"));
+  EXPECT_TRUE(Push(&ring, record, "c"));
+  EXPECT_EQ(DrainAll(&ring),
+            std::vector<std::string>({record + "b", record + "c"}));
+  EXPECT_FALSE(Push(&ring, std::string(ring.max_record() + 1, 'z')));
+}
+
+TEST(CaptureRingTest, ConsumerSeesRecordsInOrder) {
+  CaptureRing ring(256);
+  const int kRecords = 20000;
+  std::thread producer([&ring] {
+    for (int i = 0; i < kRecords; i++) {
+      std::string record = std::to_string(i);
+      while (!Push(&ring, record, std::string(i % 50, '.'))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int next = 0;
+  bool in_order = true;
+  while (next < kRecords) {
+    size_t drained = ring.Drain([&](std::string_view record) {
+      std::string expected =
+          std::to_string(next) + std::string(next % 50, '.');
+      in_order = in_order && record == expected;
+      next++;
+    });
+    if (drained == 0) std::this_thread::yield();
+  }
+  producer.join();
+  EXPECT_TRUE(in_order);
+  EXPECT_TRUE(ring.Empty());
+}
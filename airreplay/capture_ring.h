@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A lock-free ring of variable-length records with one producer and one
+// consumer thread. A record is a 4 byte length and the bytes, padded to 8
+// bytes, and may wrap around the end of the buffer. The producer publishes a
+// record with a release store of tail_, the consumer frees its space with a
+// release store of head_, so neither waits for the other.
+class CaptureRing {
+ public:
+  explicit CaptureRing(size_t capacity) : buffer_(capacity) {}
+  CaptureRing(const CaptureRing&) = delete;
+  CaptureRing& operator=(const CaptureRing&) = delete;
+
+  // the largest record that ever fits
+  size_t max_record() const {
+    return (buffer_.size() & ~size_t(7)) - kFrameBytes;
+  }
+
+  // producer only. Appends one record made of the pieces, or returns false
+  // and leaves the ring unchanged if there is no room for it now
+  bool TryPush(const struct iovec* pieces, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) len += pieces[i].iov_len;
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    size_t frame = Padded(kFrameBytes + len);
+    if (frame > buffer_.size() - (tail - head)) return false;
+    uint32_t len32 = len;
+    CopyIn(tail, &len32, kFrameBytes);
+    uint64_t pos = tail + kFrameBytes;
+    for (int i = 0; i < count; i++) {
+      CopyIn(pos, pieces[i].iov_base, pieces[i].iov_len);
+      pos += pieces[i].iov_len;
+    }
+    tail_.store(tail + frame, std::memory_order_release);
+    return true;
+  }
+
+  // consumer only. Calls f with every published record, oldest first, and
+  // returns how many there were. The view is valid during the call
+  template <typename F>
+  size_t Drain(F f) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    size_t records = 0;
+    while (head != tail) {
+      uint32_t len;
+      CopyOut(head, &len, kFrameBytes);
+      scratch_.resize(len);
+      CopyOut(head + kFrameBytes, scratch_.data(), len);
+      head += Padded(kFrameBytes + len);
+      // the space is reused once head_ moves, so f sees a copy
+      head_.store(head, std::memory_order_release);
+      f(std::string_view(scratch_));
+      records++;
+    }
+    return records;
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  static constexpr size_t kFrameBytes = sizeof(uint32_t);
+
+  static size_t Padded(size_t len) { return (len + 7) & ~size_t(7); }
+
+  void CopyIn(uint64_t pos, const void* data, size_t len) {
+    size_t offset = pos % buffer_.size();
+    size_t first = std::min(len, buffer_.size() - offset);
+    memcpy(buffer_.data() + offset, data, first);
+    memcpy(buffer_.data(), static_cast<const uint8_t*>(data) + first,
+           len - first);
+  }
+
+  void CopyOut(uint64_t pos, void* data, size_t len) const {
+    size_t offset = pos % buffer_.size();
+    size_t first = std::min(len, buffer_.size() - offset);
+    memcpy(data, buffer_.data() + offset, first);
+    memcpy(static_cast<uint8_t*>(data) + first, buffer_.data(), len - first);
+  }
+
+  std::vector<uint8_t> buffer_;
+  // positions grow without wrapping, the buffer offset is pos % capacity
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  // consumer only
+  std::string scratch_;
+};
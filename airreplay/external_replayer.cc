@@ -5,25 +5,23 @@
 #include <glog/logging.h>
 
 namespace airreplay {
+// dispatches inbound messages at the trace head to their reproducers. Instead
+// of polling, the loop sleeps until something that could make the head
+// dispatchable happens (see WakeExternalReplayer)
 void Airreplay::externalReplayerLoop() {
   int err = prctl(PR_SET_NAME, "AirReplayExternalReplayerLoop");
   DCHECK(err >= 0 || err == EPERM) << "prctl(PR_SET_NAME) failed. errno: " << err;
   int pos = 0;
   while (true) {
-    if (shutdown_) {
-      throw std::runtime_error("shutdown_ is true");
-      return;
-    }
-
     {
       std::lock_guard lock(recordOrder_);
+      if (shutdown_) return;
 
       if (!trace_.HasNext()) {
         log("ExternalReplayer", "external replayer reach end of the trace");
         return;
       }
       const airreplay::OpequeEntry &req = trace_.PeekNext(&pos);
-      log("ExternalReplayer@" + std::to_string(pos), "external replayer loop");
 
       if (MaybeReplayExternalRPCUnlocked(req)) {
         log("replayed external RPC", "@" + std::to_string(pos));
@@ -31,8 +29,11 @@ void Airreplay::externalReplayerLoop() {
       }
     }
 
-    log("did not replay external RPC", "@" + std::to_string(pos));
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // a wakeup that arrived since the check above is not lost since
+    // wakeup_pending_ stays set until we consume it here
+    std::unique_lock lock(wake_mutex_);
+    wake_cv_.wait(lock, [this]() { return wakeup_pending_ || shutdown_; });
+    wakeup_pending_ = false;
   }
 }
-}  // namespace airreplay
\ No newline at end of file
+}  // namespace airreplay
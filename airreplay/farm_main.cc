@@ -0,0 +1,398 @@
+// airreplay-farm: replays a directory of recorded traces concurrently.
+//
+// Usage:
+//   airreplay-farm --traces DIR --out DIR [--jobs N] [--timeout SECONDS]
+//                  [--ports 7000,7001] [--port-stride 100]
+//                  [--json FILE] [--junit FILE] -- <replay command> [args...]
+//
+// Every <prefix>.bin (or segmented <prefix>.manifest) in --traces, except
+// socket_rec_* traces, is one test case. Each case runs the replay command in
+// its own working directory --out/<prefix>, which links to every file of
+// --traces so socket traces and segments are found next to the trace. The
+// literal {trace} in the command is replaced by the trace prefix.
+//
+// Up to --jobs cases run at once. Worker slot i listens with the mock servers
+// of --ports shifted by i * --port-stride (AIRREPLAY_MOCK_PORTS), which still
+// replay the socket traces recorded on --ports, so concurrent replays do not
+// collide. The literal {ports} in the command is replaced by the shifted
+// ports, comma separated, for the application to connect to. Workers get
+// AIRREPLAY_STOP_AT set to the end of the trace, and a case passes if the
+// library exits the command with kReachedStopAtStatus (86) there within
+// --timeout. A command that exits on its own before replaying every entry
+// fails. The divergence position of failed cases comes from the
+// AIRREPLAY_DIVERGENCE_REPORT the replay writes.
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "worker_process.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Options {
+  std::string traces;
+  std::string out;
+  int jobs = std::max(1u, std::thread::hardware_concurrency());
+  std::chrono::seconds timeout{600};
+  std::vector<int> ports = {7000, 7001};
+  int port_stride = 100;
+  std::string json;
+  std::string junit;
+  std::vector<std::string> command;
+};
+
+struct Result {
+  std::string name;
+  // passed, diverged or failed (crashed without reporting a divergence)
+  std::string status;
+  std::string outcome;
+  double seconds = 0;
+  // position of the first entry and number of entries replayed, the whole
+  // trace until the case finished
+  int first_pos = 0;
+  long entries = 0;
+  int divergence_pos = -1;
+  std::string divergence;
+};
+
+void Usage() {
+  std::cerr << "usage: airreplay-farm --traces DIR --out DIR [--jobs N] "
+               "[--timeout SECONDS] [--ports P1,P2] [--port-stride N] "
+               "[--json FILE] [--junit FILE] -- <replay command> [args...]"
+            << std::endl;
+  exit(2);
+}
+
+Options ParseArgs(int argc, char **argv) {
+  Options options;
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      i++;
+      break;
+    }
+    if (i + 1 >= argc) Usage();
+    std::string value = argv[++i];
+    if (arg == "--traces") {
+      options.traces = value;
+    } else if (arg == "--out") {
+      options.out = value;
+    } else if (arg == "--jobs") {
+      options.jobs = std::max(1, std::stoi(value));
+    } else if (arg == "--timeout") {
+      options.timeout = std::chrono::seconds(std::stoi(value));
+    } else if (arg == "--ports") {
+      options.ports.clear();
+      std::stringstream ss(value);
+      std::string port;
+      while (std::getline(ss, port, ',')) {
+        options.ports.push_back(std::stoi(port));
+      }
+    } else if (arg == "--port-stride") {
+      options.port_stride = std::stoi(value);
+    } else if (arg == "--json") {
+      options.json = value;
+    } else if (arg == "--junit") {
+      options.junit = value;
+    } else {
+      Usage();
+    }
+  }
+  for (; i < argc; i++) {
+    options.command.push_back(argv[i]);
+  }
+  if (options.traces.empty() || options.out.empty() ||
+      options.command.empty()) {
+    Usage();
+  }
+  return options;
+}
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// trace prefixes in dir. Segment files (<prefix>.seg<N>.bin) belong to the
+// trace named by <prefix>.manifest
+std::vector<std::string> FindTraces(const std::string &dir) {
+  std::set<std::string> prefixes;
+  for (const auto &entry : fs::directory_iterator(dir)) {
+    std::string name = entry.path().filename();
+    if (name.find("socket_rec_") == 0) continue;
+
+    std::string prefix;
+    if (EndsWith(name, ".manifest")) {
+      prefix = name.substr(0, name.size() - std::string(".manifest").size());
+    } else if (EndsWith(name, ".bin")) {
+      prefix = name.substr(0, name.size() - std::string(".bin").size());
+      size_t seg = prefix.rfind(".seg");
+      if (seg != std::string::npos &&
+          prefix.find_first_not_of("0123456789", seg + 4) ==
+              std::string::npos) {
+        continue;
+      }
+    } else {
+      continue;
+    }
+    prefixes.insert(prefix);
+  }
+  return {prefixes.begin(), prefixes.end()};
+}
+
+// links every file of the traces directory into the case working directory
+void PrepareWorkdir(const Options &options, const std::string &workdir) {
+  airreplay::LinkFiles(options.traces, workdir);
+  // left by an earlier run into the same --out
+  std::error_code ec;
+  fs::remove(fs::path(workdir) / "divergence", ec);
+}
+
+void Finish(const airreplay::WorkerProcess &worker,
+            const std::string &workdir, Result *result) {
+  result->seconds = worker.elapsed().count();
+  result->outcome = worker.outcome();
+
+  if (worker.passed()) {
+    result->status = "passed";
+    return;
+  }
+
+  std::ifstream report(workdir + "/divergence");
+  if (!report) {
+    result->status = "failed";
+    result->entries = 0;
+    return;
+  }
+  result->status = "diverged";
+  std::stringstream ss;
+  ss << report.rdbuf();
+  result->divergence = ss.str();
+  // first line is the context, e.g. RecordReplay@42
+  std::string context = result->divergence.substr(
+      0, result->divergence.find('\n'));
+  size_t at = context.rfind('@');
+  if (at != std::string::npos) {
+    result->divergence_pos = std::atoi(context.c_str() + at + 1);
+    result->entries =
+        std::max(0, result->divergence_pos - result->first_pos);
+  }
+}
+
+std::string JsonEscape(const std::string &s) {
+  std::stringstream ss;
+  for (char c : s) {
+    switch (c) {
+      case '"':
+        ss << "\\\"";
+        break;
+      case '\\':
+        ss << "\\\\";
+        break;
+      case '\n':
+        ss << "\\n";
+        break;
+      case '\t':
+        ss << "\\t";
+        break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          ss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << (int)c << std::dec;
+        } else {
+          ss << c;
+        }
+    }
+  }
+  return ss.str();
+}
+
+std::string XmlEscape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    switch (c) {
+      case '<':
+        out += "&lt;";
+        break;
+      case '>':
+        out += "&gt;";
+        break;
+      case '&':
+        out += "&amp;";
+        break;
+      case '"':
+        out += "&quot;";
+        break;
+      default:
+        out += c;
+    }
+  }
+  return out;
+}
+
+double EntriesPerSecond(const Result &result) {
+  return result.seconds > 0 ? result.entries / result.seconds : 0;
+}
+
+void WriteJson(const std::string &path, const std::vector<Result> &results) {
+  std::ofstream out(path);
+  int passed =
+      std::count_if(results.begin(), results.end(),
+                    [](const Result &r) { return r.status == "passed"; });
+  out << "{\n  \"passed\": " << passed
+      << ",\n  \"failed\": " << results.size() - passed
+      << ",\n  \"traces\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    out << "    {\"name\": \"" << JsonEscape(r.name) << "\", \"status\": \""
+        << r.status << "\", \"outcome\": \"" << JsonEscape(r.outcome)
+        << "\", \"seconds\": " << r.seconds << ", \"entries\": " << r.entries
+        << ", \"entries_per_second\": " << EntriesPerSecond(r)
+        << ", \"divergence_position\": ";
+    if (r.divergence_pos >= 0) {
+      out << r.divergence_pos;
+    } else {
+      out << "null";
+    }
+    out << ", \"divergence\": \"" << JsonEscape(r.divergence) << "\"}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+void WriteJUnit(const std::string &path, const std::vector<Result> &results) {
+  std::ofstream out(path);
+  double total = 0;
+  int failures = 0;
+  for (const auto &r : results) {
+    total += r.seconds;
+    failures += r.status != "passed";
+  }
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<testsuite name=\"airreplay-farm\" tests=\"" << results.size()
+      << "\" failures=\"" << failures << "\" time=\"" << total << "\">\n";
+  for (const auto &r : results) {
+    out << "  <testcase classname=\"airreplay\" name=\"" << XmlEscape(r.name)
+        << "\" time=\"" << r.seconds << "\">\n"
+        << "    <properties>\n"
+        << "      <property name=\"entries\" value=\"" << r.entries
+        << "\"/>\n"
+        << "      <property name=\"entries_per_second\" value=\""
+        << EntriesPerSecond(r) << "\"/>\n"
+        << "      <property name=\"divergence_position\" value=\""
+        << r.divergence_pos << "\"/>\n"
+        << "    </properties>\n";
+    if (r.status != "passed") {
+      out << "    <failure message=\"" << XmlEscape(r.status + ": " + r.outcome)
+          << "\">" << XmlEscape(r.divergence) << "</failure>\n";
+    }
+    out << "  </testcase>\n";
+  }
+  out << "</testsuite>\n";
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = ParseArgs(argc, argv);
+  std::vector<std::string> traces = FindTraces(options.traces);
+  std::cerr << "found " << traces.size() << " traces in " << options.traces
+            << std::endl;
+
+  struct Running {
+    size_t index;
+    int slot;
+    std::string workdir;
+    std::unique_ptr<airreplay::WorkerProcess> worker;
+  };
+  std::vector<Result> results(traces.size());
+  std::vector<Running> running;
+  std::vector<int> free_slots;
+  for (int slot = options.jobs - 1; slot >= 0; slot--) {
+    free_slots.push_back(slot);
+  }
+
+  size_t next = 0;
+  while (next < traces.size() || !running.empty()) {
+    while (next < traces.size() && !free_slots.empty()) {
+      int slot = free_slots.back();
+      free_slots.pop_back();
+      std::string workdir =
+          fs::absolute(fs::path(options.out) / traces[next]).string();
+      PrepareWorkdir(options, workdir);
+      Result &result = results[next];
+      result.name = traces[next];
+      // counted from the record frames. A replay Trace would parse every
+      // entry and join its debug thread
+      int end_pos = 0;
+      airreplay::TraceExtent(workdir + "/" + result.name, &result.first_pos,
+                             &end_pos);
+      result.entries = end_pos - result.first_pos;
+      running.push_back(
+          {next, slot, workdir,
+           std::make_unique<airreplay::WorkerProcess>(
+               airreplay::SubstituteCommand(
+                   options.command,
+                   {{"trace", traces[next]},
+                    {"ports", airreplay::SlotPorts(options.ports, slot,
+                                                   options.port_stride)}}),
+               std::map<std::string, std::string>{
+                   {"AIRREPLAY_MOCK_PORTS",
+                    airreplay::SlotMockPorts(options.ports, slot,
+                                             options.port_stride)},
+                   {"AIRREPLAY_STOP_AT", std::to_string(end_pos)},
+                   {"AIRREPLAY_DIVERGENCE_REPORT", workdir + "/divergence"}},
+               workdir, workdir + "/replay.log")});
+      next++;
+    }
+
+    for (auto it = running.begin(); it != running.end();) {
+      auto &worker = *it->worker;
+      if (!worker.Poll() && worker.elapsed() > options.timeout) {
+        worker.Kill("timed out after " +
+                    std::to_string(options.timeout.count()) + "s");
+      }
+      if (!worker.done()) {
+        ++it;
+        continue;
+      }
+      Result &result = results[it->index];
+      Finish(worker, it->workdir, &result);
+      std::cerr << "[" << result.status << "] " << result.name << " "
+                << result.seconds << "s " << result.entries << " entries"
+                << (result.divergence_pos >= 0
+                        ? " diverged@" + std::to_string(result.divergence_pos)
+                        : "")
+                << std::endl;
+      free_slots.push_back(it->slot);
+      it = running.erase(it);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  if (!options.json.empty()) WriteJson(options.json, results);
+  if (!options.junit.empty()) WriteJUnit(options.junit, results);
+
+  int failed =
+      std::count_if(results.begin(), results.end(),
+                    [](const Result &r) { return r.status != "passed"; });
+  std::cout << results.size() - failed << "/" << results.size()
+            << " traces replayed without divergence" << std::endl;
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,376 @@
+#include "grpc_interceptors.h"
+
+#include <glog/logging.h>
+#include <google/protobuf/any.pb.h>
+
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+namespace airreplay {
+
+using grpc::experimental::InterceptionHookPoints;
+using grpc::experimental::InterceptorBatchMethods;
+
+namespace {
+// metadata GrpcReproducer uses to pass the recorded call id to the server
+const char kCallIdMetadata[] = "airreplay-call-id";
+
+std::string ByteBufferToString(grpc::ByteBuffer *buffer) {
+  std::vector<grpc::Slice> slices;
+  std::string bytes;
+  if (buffer == nullptr || !buffer->Dump(&slices).ok()) return bytes;
+  for (const auto &slice : slices) {
+    bytes.append(reinterpret_cast<const char *>(slice.begin()), slice.size());
+  }
+  return bytes;
+}
+
+// records or checks the message of a PRE_SEND_MESSAGE batch
+void RecordReplaySend(Airreplay *airr, InterceptorBatchMethods *methods,
+                      const std::string &connection_info, int kind) {
+  auto *msg =
+      static_cast<const google::protobuf::Message *>(methods->GetSendMessage());
+  if (msg != nullptr) {
+    airr->RecordReplay("send", connection_info, *msg, kind);
+  } else {
+    // the message was handed to gRPC already serialized
+    std::string bytes = ByteBufferToString(methods->GetSerializedSendMessage());
+    airr->RecordReplay("send", connection_info, std::string_view(bytes), kind);
+  }
+}
+
+class ServerInterceptor : public grpc::experimental::Interceptor {
+ public:
+  ServerInterceptor(Airreplay *airr, int base_kind, std::string method,
+                    int call_id)
+      : airr_(airr),
+        base_kind_(base_kind),
+        method_(std::move(method)),
+        call_id_(std::to_string(call_id)) {}
+
+  void Intercept(InterceptorBatchMethods *methods) override {
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::POST_RECV_INITIAL_METADATA)) {
+      // in replay the call comes from GrpcReproducer with the recorded id
+      auto *metadata = methods->GetRecvInitialMetadata();
+      auto it = metadata->find(kCallIdMetadata);
+      if (it != metadata->end()) {
+        call_id_ = std::string(it->second.data(), it->second.size());
+      }
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::POST_RECV_MESSAGE)) {
+      auto *msg =
+          static_cast<google::protobuf::Message *>(methods->GetRecvMessage());
+      if (msg != nullptr) {
+        airr_->RecordReplay("recv", ConnectionInfo(), *msg,
+                            base_kind_ + kGrpcServerRecv);
+      } else {
+        airr_->RecordReplay("recv close", ConnectionInfo(), std::string_view(),
+                            base_kind_ + kGrpcServerRecvClose);
+      }
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+      RecordReplaySend(airr_, methods, ConnectionInfo(),
+                       base_kind_ + kGrpcServerSend);
+    }
+    methods->Proceed();
+  }
+
+ private:
+  std::string ConnectionInfo() const { return method_ + "#" + call_id_; }
+
+  Airreplay *airr_;
+  int base_kind_;
+  std::string method_;
+  std::string call_id_;
+};
+
+class ClientInterceptor : public grpc::experimental::Interceptor {
+ public:
+  ClientInterceptor(Airreplay *airr, int base_kind, std::string method,
+                    int call_id)
+      : airr_(airr),
+        base_kind_(base_kind),
+        connection_info_(std::move(method) + "#" + std::to_string(call_id)) {}
+
+  void Intercept(InterceptorBatchMethods *methods) override {
+    bool replay = airr_->isReplay();
+    bool hijack = false;
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_INITIAL_METADATA)) {
+      // in replay the call never leaves the process
+      hijack = replay;
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+      RecordReplaySend(airr_, methods, connection_info_,
+                       base_kind_ + kGrpcClientSend);
+    }
+    // responses are recorded once they arrived and, since the call is
+    // hijacked in replay, restored before the application receives them
+    auto recv_message = replay ? InterceptionHookPoints::PRE_RECV_MESSAGE
+                               : InterceptionHookPoints::POST_RECV_MESSAGE;
+    auto recv_status = replay ? InterceptionHookPoints::PRE_RECV_STATUS
+                              : InterceptionHookPoints::POST_RECV_STATUS;
+    if (methods->QueryInterceptionHookPoint(recv_message)) {
+      if (!SaveRestoreResponse(static_cast<google::protobuf::Message *>(
+              methods->GetRecvMessage())) &&
+          replay) {
+        methods->FailHijackedRecvMessage();
+      }
+    }
+    if (methods->QueryInterceptionHookPoint(recv_status)) {
+      SaveRestoreStatus(methods->GetRecvStatus());
+    }
+
+    if (hijack) {
+      methods->Hijack();
+    } else {
+      methods->Proceed();
+    }
+  }
+
+ private:
+  // records whether a response arrived and the response itself. In replay
+  // restores them into msg and returns whether there was one
+  bool SaveRestoreResponse(google::protobuf::Message *msg) {
+    std::string key = "grpc response " + connection_info_ + "/" +
+                      std::to_string(num_responses_++);
+    uint64_t received = msg != nullptr;
+    airr_->SaveRestore(key + " received", received);
+    if (received && msg != nullptr) {
+      airr_->SaveRestore(key, *msg);
+    }
+    return received;
+  }
+
+  void SaveRestoreStatus(grpc::Status *status) {
+    // prefixed with the code so the saved string is never empty
+    std::string saved = std::to_string(status->error_code()) + " " +
+                        status->error_message();
+    airr_->SaveRestore("grpc status " + connection_info_, saved);
+    size_t space = saved.find(' ');
+    *status = grpc::Status(
+        static_cast<grpc::StatusCode>(std::stoi(saved.substr(0, space))),
+        saved.substr(space + 1));
+  }
+
+  Airreplay *airr_;
+  int base_kind_;
+  std::string connection_info_;
+  int num_responses_ = 0;
+};
+
+// returns the serialized message a reproducer was called with. It is an Any
+// unless a type was registered for the kind
+std::string PayloadOf(const google::protobuf::Message &msg) {
+  if (msg.GetDescriptor() == google::protobuf::Any::descriptor()) {
+    return static_cast<const google::protobuf::Any &>(msg).value();
+  }
+  return msg.SerializeAsString();
+}
+}  // namespace
+
+std::unique_ptr<Airreplay> AirreplayFromEnv(const std::string &default_trace) {
+  const char *mode = std::getenv("AIRREPLAY_MODE");
+  if (mode == nullptr) return nullptr;
+  const char *trace = std::getenv("AIRREPLAY_TRACE");
+  const char *txt = std::getenv("AIRREPLAY_TXT_TRACE");
+  TraceOptions options;
+  options.write_txt = txt == nullptr || std::string(txt) != "0";
+  return std::make_unique<Airreplay>(
+      trace != nullptr ? trace : default_trace,
+      std::string(mode) == "replay" ? Mode::kReplay : Mode::kRecord, options);
+}
+
+GrpcServerInterceptorFactory::GrpcServerInterceptorFactory(Airreplay *airr,
+                                                           int base_kind)
+    : airr_(airr), base_kind_(base_kind) {
+  airr_->RegisterMessageKindName(base_kind_ + kGrpcServerRecv,
+                                 "GrpcServerRecv");
+  airr_->RegisterMessageKindName(base_kind_ + kGrpcServerRecvClose,
+                                 "GrpcServerRecvClose");
+  airr_->RegisterMessageKindName(base_kind_ + kGrpcServerSend,
+                                 "GrpcServerSend");
+}
+
+grpc::experimental::Interceptor *
+GrpcServerInterceptorFactory::CreateServerInterceptor(
+    grpc::experimental::ServerRpcInfo *info) {
+  return new ServerInterceptor(airr_, base_kind_, info->method(),
+                               next_call_id_++);
+}
+
+GrpcClientInterceptorFactory::GrpcClientInterceptorFactory(Airreplay *airr,
+                                                           int base_kind)
+    : airr_(airr), base_kind_(base_kind) {
+  airr_->RegisterMessageKindName(base_kind_ + kGrpcClientSend,
+                                 "GrpcClientSend");
+}
+
+grpc::experimental::Interceptor *
+GrpcClientInterceptorFactory::CreateClientInterceptor(
+    grpc::experimental::ClientRpcInfo *info) {
+  return new ClientInterceptor(airr_, base_kind_, info->method(),
+                               next_call_id_++);
+}
+
+// one re-injected call. Writes are queued since a reactor allows only one
+// outstanding write
+class GrpcReproducer::Call
+    : public grpc::ClientBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer> {
+ public:
+  Call(GrpcReproducer *owner, const std::string &connection_info)
+      : owner_(owner), connection_info_(connection_info) {
+    size_t sep = connection_info.rfind('#');
+    context_.AddMetadata(kCallIdMetadata, connection_info.substr(sep + 1));
+    owner_->stub_.PrepareBidiStreamingCall(
+        &context_, connection_info.substr(0, sep), grpc::StubOptions(), this);
+  }
+
+  void Write(const std::string &bytes) {
+    std::lock_guard lock(mutex_);
+    if (done_) return;
+    grpc::Slice slice(bytes);
+    pending_.emplace_back(&slice, 1);
+    if (!writing_) StartNextWriteLocked();
+  }
+
+  void WritesDone() {
+    std::lock_guard lock(mutex_);
+    if (done_) return;
+    close_pending_ = true;
+    if (!writing_) StartNextWriteLocked();
+  }
+
+  void Cancel() { context_.TryCancel(); }
+
+  // the reactor takes a reference to itself until OnDone
+  void Start(std::shared_ptr<Call> self) {
+    self_ = std::move(self);
+    StartRead(&response_);
+    StartCall();
+  }
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard lock(mutex_);
+    writing_ = false;
+    if (!ok) {
+      // the call failed or was cancelled. Nothing more can be written, the
+      // queued writes are dropped and OnDone follows to clean up
+      done_ = true;
+      pending_.clear();
+      close_pending_ = false;
+      return;
+    }
+    StartNextWriteLocked();
+  }
+
+  void OnReadDone(bool ok) override {
+    if (ok) StartRead(&response_);
+  }
+
+  void OnDone(const grpc::Status &status) override {
+    if (!status.ok()) {
+      LOG(WARNING) << "re-injected call " << connection_info_
+                   << " failed: " << status.error_code() << " "
+                   << status.error_message();
+    }
+    {
+      std::lock_guard lock(mutex_);
+      done_ = true;
+    }
+    owner_->CallDone(connection_info_);
+    // may destroy this unless a reproducer still holds a reference
+    self_.reset();
+  }
+
+ private:
+  void StartNextWriteLocked() {
+    if (!pending_.empty()) {
+      writing_ = true;
+      current_ = std::move(pending_.front());
+      pending_.pop_front();
+      StartWrite(&current_);
+    } else if (close_pending_) {
+      close_pending_ = false;
+      StartWritesDone();
+    }
+  }
+
+  GrpcReproducer *owner_;
+  std::string connection_info_;
+  grpc::ClientContext context_;
+  grpc::ByteBuffer response_;
+
+  std::mutex mutex_;
+  std::deque<grpc::ByteBuffer> pending_;
+  grpc::ByteBuffer current_;
+  bool writing_ = false;
+  bool close_pending_ = false;
+  bool done_ = false;
+  std::shared_ptr<Call> self_;
+};
+
+GrpcReproducer::GrpcReproducer(Airreplay *airr,
+                               std::shared_ptr<grpc::Channel> channel,
+                               int base_kind)
+    : stub_(std::move(channel)) {
+  airr->RegisterDirectReproducer(
+      base_kind + kGrpcServerRecv,
+      [this](const std::string &connection_info,
+             const google::protobuf::Message &msg) {
+        Reproduce(connection_info, msg, false);
+      });
+  airr->RegisterDirectReproducer(
+      base_kind + kGrpcServerRecvClose,
+      [this](const std::string &connection_info,
+             const google::protobuf::Message &msg) {
+        Reproduce(connection_info, msg, true);
+      });
+}
+
+GrpcReproducer::~GrpcReproducer() {
+  std::unique_lock lock(mutex_);
+  for (auto &kv : calls_) {
+    kv.second->Cancel();
+  }
+  calls_done_.wait(lock, [this]() { return calls_.empty(); });
+}
+
+void GrpcReproducer::Reproduce(const std::string &connection_info,
+                               const google::protobuf::Message &msg,
+                               bool close) {
+  std::shared_ptr<Call> call;
+  bool started = false;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = calls_.find(connection_info);
+    if (it == calls_.end()) {
+      it = calls_.emplace(connection_info, std::make_shared<Call>(
+                                               this, connection_info))
+               .first;
+      started = true;
+    }
+    call = it->second;
+  }
+  // reproducers of one connection_info run one at a time, so no one else
+  // starts or writes to this call meanwhile
+  if (started) call->Start(call);
+  if (close) {
+    call->WritesDone();
+  } else {
+    call->Write(PayloadOf(msg));
+  }
+}
+
+void GrpcReproducer::CallDone(const std::string &connection_info) {
+  std::lock_guard lock(mutex_);
+  calls_.erase(connection_info);
+  calls_done_.notify_all();
+}
+
+}  // namespace airreplay
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/client_interceptor.h>
+#include <grpcpp/support/server_interceptor.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "airreplay.h"
+
+namespace airreplay {
+
+// Message kinds used by the gRPC interceptors, as offsets from the base kind
+// passed to them. The default base leaves room for application kinds below it
+enum GrpcKindOffset {
+  // a request message received by the server
+  kGrpcServerRecv,
+  // the client half-closed a streaming call
+  kGrpcServerRecvClose,
+  kGrpcServerSend,
+  kGrpcClientSend,
+  kNumGrpcKinds,
+};
+constexpr int kGrpcDefaultBaseKind = 100;
+
+// Creates the Airreplay instance of a gRPC example from the environment:
+//   AIRREPLAY_MODE=record|replay  returns nullptr when unset
+//   AIRREPLAY_TRACE=<prefix>      defaults to default_trace
+//   AIRREPLAY_TXT_TRACE=0         does not write the debug txt trace
+std::unique_ptr<Airreplay> AirreplayFromEnv(const std::string &default_trace);
+
+// Records the messages of every call on a gRPC server. In replay it checks
+// that the server receives and sends the recorded messages in the recorded
+// order. The received messages come from GrpcReproducer.
+//
+// The connection_info of an entry is "<method>#<call id>". Call ids are
+// assigned in the order calls reach the server and are passed back in the
+// call metadata by GrpcReproducer in replay.
+//
+// Usage:
+//   std::vector<std::unique_ptr<
+//       grpc::experimental::ServerInterceptorFactoryInterface>> creators;
+//   creators.push_back(
+//       std::make_unique<airreplay::GrpcServerInterceptorFactory>(airr));
+//   builder.experimental().SetInterceptorCreators(std::move(creators));
+//
+// Assumes protobuf generated services, where intercepted messages are
+// google::protobuf::Message objects.
+class GrpcServerInterceptorFactory
+    : public grpc::experimental::ServerInterceptorFactoryInterface {
+ public:
+  explicit GrpcServerInterceptorFactory(Airreplay *airr,
+                                        int base_kind = kGrpcDefaultBaseKind);
+  grpc::experimental::Interceptor *CreateServerInterceptor(
+      grpc::experimental::ServerRpcInfo *info) override;
+
+ private:
+  Airreplay *airr_;
+  int base_kind_;
+  std::atomic<int> next_call_id_{0};
+};
+
+// Records the messages an application sends as a gRPC client and the
+// responses it gets. In replay the call is not sent: the interceptor checks
+// the outgoing messages against the trace and completes the call with the
+// recorded responses and status, so the servers need not run.
+// Calls must be started in the recorded order since responses are looked up
+// by "<method>#<call number>".
+//
+// Usage:
+//   std::vector<std::unique_ptr<
+//       grpc::experimental::ClientInterceptorFactoryInterface>> creators;
+//   creators.push_back(
+//       std::make_unique<airreplay::GrpcClientInterceptorFactory>(airr));
+//   auto channel = grpc::experimental::CreateCustomChannelWithInterceptors(
+//       target, creds, grpc::ChannelArguments(), std::move(creators));
+class GrpcClientInterceptorFactory
+    : public grpc::experimental::ClientInterceptorFactoryInterface {
+ public:
+  explicit GrpcClientInterceptorFactory(Airreplay *airr,
+                                        int base_kind = kGrpcDefaultBaseKind);
+  grpc::experimental::Interceptor *CreateClientInterceptor(
+      grpc::experimental::ClientRpcInfo *info) override;
+
+ private:
+  Airreplay *airr_;
+  int base_kind_;
+  std::atomic<int> next_call_id_{0};
+};
+
+// Replay only. Re-injects the recorded inbound calls of a server that uses
+// GrpcServerInterceptorFactory by sending the recorded request messages to it
+// over channel when they reach the head of the trace. Responses are read and
+// dropped, the server interceptor checks them against the trace.
+class GrpcReproducer {
+ public:
+  GrpcReproducer(Airreplay *airr, std::shared_ptr<grpc::Channel> channel,
+                 int base_kind = kGrpcDefaultBaseKind);
+  GrpcReproducer(const GrpcReproducer &) = delete;
+  GrpcReproducer &operator=(const GrpcReproducer &) = delete;
+  // cancels the calls that are still open and waits for them
+  ~GrpcReproducer();
+
+ private:
+  class Call;
+
+  void Reproduce(const std::string &connection_info,
+                 const google::protobuf::Message &msg, bool close);
+  void CallDone(const std::string &connection_info);
+
+  grpc::GenericStub stub_;
+  std::mutex mutex_;
+  std::condition_variable calls_done_;
+  // open calls by connection_info
+  std::map<std::string, std::shared_ptr<Call>> calls_;
+};
+
+}  // namespace airreplay
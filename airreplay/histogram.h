@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+// Log-linear latency histogram in microseconds. Values below 16 have their
+// own bucket, larger ones are split into 16 buckets per power of two, so a
+// bucket is at most 1/16 of its lower bound wide
+class Histogram {
+ public:
+  void Record(uint64_t us) {
+    buckets_[Bucket(us)]++;
+    count_++;
+    sum_ += us;
+    max_ = std::max(max_, us);
+  }
+
+  void Merge(const Histogram &other) {
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64_t count() const { return count_; }
+  double mean() const { return count_ == 0 ? 0 : (double)sum_ / count_; }
+  uint64_t max() const { return max_; }
+
+  // upper bound of the bucket holding the q-th quantile
+  uint64_t Percentile(double q) const {
+    if (count_ == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      seen += buckets_[i];
+      if (seen >= rank) return std::min(max_, LowerBound(i + 1) - 1);
+    }
+    return max_;
+  }
+
+  // one row per power of two that has samples
+  void Print(std::ostream &out) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < buckets_.size();) {
+      size_t end = i < 16 ? 16 : i + 16;
+      uint64_t n = 0;
+      for (size_t j = i; j < end; j++) n += buckets_[j];
+      if (n > 0) {
+        cumulative += n;
+        int bar = (int)std::lround(60.0 * n / count_);
+        out << "  [" << std::setw(9) << LowerBound(i) << ", " << std::setw(9)
+            << LowerBound(end) << ") us " << std::setw(10) << n << " "
+            << std::fixed << std::setprecision(3) << std::setw(7)
+            << 100.0 * cumulative / count_ << "% " << std::string(bar, '#')
+            << "\n";
+      }
+      i = end;
+    }
+  }
+
+ private:
+  static constexpr int kSubBuckets = 16;
+
+  static size_t Bucket(uint64_t us) {
+    if (us < kSubBuckets) return us;
+    int exponent = 63 - __builtin_clzll(us);
+    uint64_t sub = (us >> (exponent - 4)) & (kSubBuckets - 1);
+    return (exponent - 3) * kSubBuckets + sub;
+  }
+
+  static uint64_t LowerBound(size_t bucket) {
+    if (bucket < kSubBuckets) return bucket;
+    int exponent = bucket / kSubBuckets + 3;
+    uint64_t sub = bucket % kSubBuckets;
+    return (kSubBuckets + sub) << (exponent - 4);
+  }
+
+  std::vector<uint64_t> buckets_ =
+      std::vector<uint64_t>((64 - 3) * kSubBuckets, 0);
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
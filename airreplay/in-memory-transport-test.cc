@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <string>
+
+#include "airreplay/airreplay.h"
+#include "airreplay/airreplay.pb.h"
+#include "airreplay/in_memory_transport.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+const int kPingOut = 10;
+const int kPingIn = 11;
+const int kPongOut = 12;
+const int kPongIn = 13;
+const std::string kConnection = "a:1#b:2";
+
+airreplay::OpequeEntry Entry(int kind, const std::string &bytes) {
+  airreplay::OpequeEntry entry;
+  entry.set_kind(kind);
+  entry.set_connection_info(kConnection);
+  entry.set_bytes_message(bytes);
+  return entry;
+}
+
+airreplay::PingPongRequest Message(const std::string &text) {
+  airreplay::PingPongRequest message;
+  message.set_message(text);
+  return message;
+}
+
+std::unique_ptr<airreplay::Airreplay> Node(
+    const std::string &trace, airreplay::Mode mode,
+    std::shared_ptr<airreplay::InMemoryTransport> transport) {
+  // with a transport the node opens no mock sockets
+  auto node = std::make_unique<airreplay::Airreplay>(
+      trace, mode, airreplay::TraceOptions(), transport);
+  for (int kind : {kPingOut, kPingIn, kPongOut, kPongIn}) {
+    node->RegisterKind<airreplay::PingPongRequest>(
+        kind, "pingpong" + std::to_string(kind));
+  }
+  return node;
+}
+}  // namespace
+
+TEST(InMemoryTransportTest, SendWakesOnlyTheWaitingReceiver) {
+  airreplay::InMemoryTransport transport;
+  transport.Route(kPingOut, kPingIn);
+  int woken_a = 0;
+  int woken_b = 0;
+  int a = transport.AddListener([&woken_a] { woken_a++; });
+  int b = transport.AddListener([&woken_b] { woken_b++; });
+
+  airreplay::OpequeEntry msg;
+  EXPECT_FALSE(transport.TryReceive(kConnection, kPingIn, b, &msg));
+  transport.Send(Entry(kPingOut, "ping"));
+  EXPECT_EQ(woken_a, 0);
+  EXPECT_EQ(woken_b, 1);
+  EXPECT_EQ(transport.InFlight(), 1);
+  ASSERT_TRUE(transport.TryReceive(kConnection, kPingIn, b, &msg));
+  EXPECT_EQ(msg.bytes_message(), "ping");
+  EXPECT_EQ(transport.InFlight(), 0);
+
+  // kinds that are not routed are not sent
+  transport.Send(Entry(kPongOut, "pong"));
+  EXPECT_EQ(transport.InFlight(), 0);
+  transport.RemoveListener(a);
+  transport.RemoveListener(b);
+}
+
+TEST(InMemoryTransportTest, MessageSentFirstWaitsForTheReceiver) {
+  airreplay::InMemoryTransport transport;
+  transport.Route(kPingOut, kPingIn);
+  int woken = 0;
+  int id = transport.AddListener([&woken] { woken++; });
+  transport.Send(Entry(kPingOut, "ping"));
+  EXPECT_EQ(woken, 0);
+
+  airreplay::OpequeEntry msg;
+  EXPECT_FALSE(transport.TryReceive("other#conn", kPingIn, id, &msg));
+  ASSERT_TRUE(transport.TryReceive(kConnection, kPingIn, id, &msg));
+  EXPECT_EQ(msg.bytes_message(), "ping");
+  transport.RemoveListener(id);
+}
+
+// node a sends a ping that node b answers with a pong. Both are recorded
+// separately, then replayed together: b's inbound ping comes from a's replay
+// and a's inbound pong from b's
+TEST(InMemoryTransportTest, ReplaysTwoNodesAgainstEachOther) {
+  std::string dir = fs::temp_directory_path() / "in-memory-transport-test";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  std::string trace_a = dir + "/node_a";
+  std::string trace_b = dir + "/node_b";
+  {
+    auto transport = std::make_shared<airreplay::InMemoryTransport>();
+    auto a = Node(trace_a, airreplay::Mode::kRecord, transport);
+    auto b = Node(trace_b, airreplay::Mode::kRecord, transport);
+    a->RecordReplay("ping", kConnection, Message("ping"), kPingOut);
+    b->RecordReplay("ping", kConnection, Message("ping"), kPingIn);
+    b->RecordReplay("pong", kConnection, Message("pong"), kPongOut);
+    a->RecordReplay("pong", kConnection, Message("pong"), kPongIn);
+  }
+
+  auto transport = std::make_shared<airreplay::InMemoryTransport>();
+  transport->Route(kPingOut, kPingIn);
+  transport->Route(kPongOut, kPongIn);
+  auto a = Node(trace_a, airreplay::Mode::kReplay, transport);
+  auto b = Node(trace_b, airreplay::Mode::kReplay, transport);
+  airreplay::Airreplay *node_a = a.get();
+  airreplay::Airreplay *node_b = b.get();
+  std::promise<std::string> pong;
+  // the reproducers stand in for the RPC handlers of the nodes
+  node_b->RegisterReproducer<airreplay::PingPongRequest>(
+      kPingIn, [node_b](const std::string &connection_info,
+                        const airreplay::PingPongRequest &ping) {
+        node_b->RecordReplay("ping", connection_info, ping, kPingIn);
+        node_b->RecordReplay("pong", connection_info, Message("pong"),
+                             kPongOut);
+      });
+  node_a->RegisterReproducer<airreplay::PingPongRequest>(
+      kPongIn, [node_a, &pong](const std::string &connection_info,
+                               const airreplay::PingPongRequest &msg) {
+        node_a->RecordReplay("pong", connection_info, msg, kPongIn);
+        pong.set_value(msg.message());
+      });
+
+  node_a->RecordReplay("ping", kConnection, Message("ping"), kPingOut);
+  std::future<std::string> received = pong.get_future();
+  ASSERT_EQ(received.wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  EXPECT_EQ(received.get(), "pong");
+  EXPECT_EQ(transport->InFlight(), 0);
+  a.reset();
+  b.reset();
+  fs::remove_all(dir);
+}
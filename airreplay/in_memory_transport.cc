@@ -0,0 +1,90 @@
+#include "in_memory_transport.h"
+
+namespace airreplay {
+
+void InMemoryTransport::Route(int outbound_kind, int inbound_kind) {
+  routes_[outbound_kind] = inbound_kind;
+  inbound_[inbound_kind] = outbound_kind;
+}
+
+bool InMemoryTransport::IsOutbound(int kind) const {
+  return routes_.find(kind) != routes_.end();
+}
+
+bool InMemoryTransport::IsInbound(int kind) const {
+  return inbound_.find(kind) != inbound_.end();
+}
+
+InMemoryTransport::Channel *InMemoryTransport::GetChannel(
+    const ChannelKey &key) {
+  {
+    std::shared_lock lock(channels_mutex_);
+    auto it = channels_.find(key);
+    if (it != channels_.end()) return it->second.get();
+  }
+  std::unique_lock lock(channels_mutex_);
+  auto &channel = channels_[key];
+  if (!channel) {
+    channel = std::make_unique<Channel>();
+  }
+  // channels are never removed so the pointer stays valid
+  return channel.get();
+}
+
+void InMemoryTransport::Send(const airreplay::OpequeEntry &msg) {
+  auto route = routes_.find(msg.kind());
+  if (route == routes_.end()) return;
+
+  Channel *channel = GetChannel({msg.connection_info(), route->second});
+  int receiver;
+  {
+    std::lock_guard lock(channel->mutex);
+    channel->messages.push_back(msg);
+    receiver = channel->receiver;
+  }
+  // a receiver that has not looked yet finds the message when it does
+  if (receiver < 0) return;
+
+  std::shared_lock lock(listeners_mutex_);
+  auto listener = listeners_.find(receiver);
+  if (listener != listeners_.end()) listener->second();
+}
+
+bool InMemoryTransport::TryReceive(const std::string &connection_info,
+                                   int inbound_kind, int receiver,
+                                   airreplay::OpequeEntry *msg) {
+  Channel *channel = GetChannel({connection_info, inbound_kind});
+  std::lock_guard lock(channel->mutex);
+  if (channel->messages.empty()) {
+    channel->receiver = receiver;
+    return false;
+  }
+
+  *msg = std::move(channel->messages.front());
+  channel->messages.pop_front();
+  return true;
+}
+
+size_t InMemoryTransport::InFlight() {
+  std::shared_lock lock(channels_mutex_);
+  size_t in_flight = 0;
+  for (auto &kv : channels_) {
+    std::lock_guard channel_lock(kv.second->mutex);
+    in_flight += kv.second->messages.size();
+  }
+  return in_flight;
+}
+
+int InMemoryTransport::AddListener(std::function<void()> listener) {
+  std::unique_lock lock(listeners_mutex_);
+  int id = next_listener_id_++;
+  listeners_[id] = std::move(listener);
+  return id;
+}
+
+void InMemoryTransport::RemoveListener(int id) {
+  std::unique_lock lock(listeners_mutex_);
+  listeners_.erase(id);
+}
+
+}  // namespace airreplay
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+
+#include "airreplay.pb.h"
+
+namespace airreplay {
+
+// Connects several Airreplay instances that replay the traces of different
+// nodes of one cluster inside a single process.
+// When a node consumes a recorded outbound message (a kind registered via
+// Route) from its trace, the message is queued on an in-memory channel keyed
+// by its connection_info. When the peer reaches the matching inbound entry on
+// its own trace, it takes the message from that channel and hands it to its
+// reproducer. So inbound messages are produced by the peer's replay instead of
+// being re-sent over the mock sockets of SocketTraffic.
+//
+// Both sides must record the connection with the same connection_info string
+// (client#server). Channels are independent so nodes only contend on the
+// channels they share, and a Send only wakes the node receiving on its
+// channel.
+class InMemoryTransport {
+ public:
+  InMemoryTransport() = default;
+  InMemoryTransport(const InMemoryTransport &) = delete;
+  InMemoryTransport &operator=(const InMemoryTransport &) = delete;
+
+  // messages recorded with outbound_kind are delivered to reproducers of
+  // inbound_kind on the peer. Must be called before replay starts
+  void Route(int outbound_kind, int inbound_kind);
+  bool IsOutbound(int kind) const;
+  bool IsInbound(int kind) const;
+
+  // queues msg for the peer if msg.kind() is a routed outbound kind
+  void Send(const airreplay::OpequeEntry &msg);
+  // pops the oldest message sent on connection_info for the inbound kind.
+  // Returns false if the peer has not sent it yet. Then receiver, the
+  // caller's listener id, is called once the message is sent
+  bool TryReceive(const std::string &connection_info, int inbound_kind,
+                  int receiver, airreplay::OpequeEntry *msg);
+  // number of messages sent but not yet received, across all channels
+  size_t InFlight();
+
+  // listener is called after a Send that queued a message on a channel it
+  // waited on in TryReceive, so it can retry. It must not call back into the
+  // transport. Returns an id for TryReceive and RemoveListener
+  int AddListener(std::function<void()> listener);
+  void RemoveListener(int id);
+
+ private:
+  struct Channel {
+    std::mutex mutex;
+    std::deque<airreplay::OpequeEntry> messages;
+    // listener of the node that found the channel empty, -1 if none did
+    int receiver = -1;
+  };
+  using ChannelKey = std::pair<std::string, int>;
+
+  Channel *GetChannel(const ChannelKey &key);
+
+  // outbound kind -> inbound kind. Written only before replay starts
+  std::map<int, int> routes_;
+  std::map<int, int> inbound_;
+
+  // both maps are read on every message and written only when a channel or
+  // node is added
+  std::shared_mutex channels_mutex_;
+  std::map<ChannelKey, std::unique_ptr<Channel>> channels_;
+
+  std::shared_mutex listeners_mutex_;
+  int next_listener_id_ = 0;
+  std::map<int, std::function<void()>> listeners_;
+};
+
+}  // namespace airreplay
@@ -0,0 +1,168 @@
+// airreplay-load: drives a live server with recorded socket traffic.
+//
+// Usage:
+//   airreplay-load --traces DIR --server HOST:PORT [--filter TEXT]
+//                  [--copies N] [--pacing recorded|flood] [--speed X]
+//                  [--threads N] [--idle-ms MS] [--timeout-ms MS]
+//                  [--compare-bytes N] [--label TEXT]
+//
+// Every socket_rec_*.bin trace in --traces whose name contains --filter is
+// one recorded connection. The tool plays its client: it sends what the
+// client sent and waits for what the server answered before sending the next
+// request. Each connection is replayed by --copies concurrent connections to
+// --server.
+//
+// Pacing recorded starts the connections and sends the requests with the
+// delays of the recording (from the entry timestamps), --speed times faster.
+// Pacing flood starts every connection at once and sends each request as soon
+// as the previous response arrived.
+//
+// Responses of a new build differ from the recorded ones, so they are matched
+// loosely: a response is complete once as many bytes as recorded arrived, or
+// once a shorter one was followed by --idle-ms of silence. A response that
+// does not start within --timeout-ms is counted as timed out. With
+// --compare-bytes the leading bytes of each response are compared with the
+// recorded ones and differences counted.
+//
+// Prints one "CONNECTION key=value ..." line per recorded connection, one
+// "RESULT key=value ..." line for all of them, and the latency histogram.
+// Latency runs from the start of a request to the last byte of its response.
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "socket_load.h"
+
+namespace {
+
+struct Options {
+  std::string traces;
+  std::string filter = "accept";
+  std::string label;
+  LoadOptions load;
+};
+
+void Usage() {
+  std::cerr << "usage: airreplay-load --traces DIR --server HOST:PORT "
+               "[--filter TEXT] [--copies N] [--pacing recorded|flood] "
+               "[--speed X] [--threads N] [--idle-ms MS] [--timeout-ms MS] "
+               "[--compare-bytes N] [--label TEXT]"
+            << std::endl;
+  exit(2);
+}
+
+Options ParseArgs(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) Usage();
+    std::string value = argv[++i];
+    if (arg == "--traces") {
+      options.traces = value;
+    } else if (arg == "--server") {
+      options.load.server = value;
+    } else if (arg == "--filter") {
+      options.filter = value;
+    } else if (arg == "--copies") {
+      options.load.copies = std::max(1, std::stoi(value));
+    } else if (arg == "--pacing") {
+      if (value == "recorded") {
+        options.load.pacing = LoadOptions::kRecorded;
+      } else if (value == "flood") {
+        options.load.pacing = LoadOptions::kFlood;
+      } else {
+        Usage();
+      }
+    } else if (arg == "--speed") {
+      options.load.speed = std::stod(value);
+    } else if (arg == "--threads") {
+      options.load.threads = std::max(1, std::stoi(value));
+    } else if (arg == "--idle-ms") {
+      options.load.response_idle = std::chrono::milliseconds(std::stoi(value));
+    } else if (arg == "--timeout-ms") {
+      options.load.response_timeout =
+          std::chrono::milliseconds(std::stoi(value));
+    } else if (arg == "--compare-bytes") {
+      options.load.compare_bytes = std::stoul(value);
+    } else if (arg == "--label") {
+      options.label = value;
+    } else {
+      Usage();
+    }
+  }
+  if (options.traces.empty() || options.load.server.empty() ||
+      options.load.speed <= 0) {
+    Usage();
+  }
+  return options;
+}
+
+double MegabytesPerSecond(uint64_t bytes, double seconds) {
+  return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = ParseArgs(argc, argv);
+  std::vector<Conversation> conversations =
+      LoadConversations(options.traces, options.filter);
+  if (conversations.empty()) {
+    std::cerr << "no socket_rec_* traces matching " << options.filter
+              << " in " << options.traces << std::endl;
+    return 1;
+  }
+  std::vector<ConversationStats> stats =
+      RunLoad(conversations, options.load);
+
+  ConversationStats total;
+  std::cout << std::fixed << std::setprecision(1);
+  for (size_t i = 0; i < conversations.size(); i++) {
+    const ConversationStats &s = stats[i];
+    double seconds = s.seconds();
+    std::cout << "CONNECTION trace=" << conversations[i].name
+              << " steps=" << conversations[i].steps.size()
+              << " copies=" << s.copies_done << " errors=" << s.errors
+              << " responses=" << s.responses << " timeouts=" << s.timeouts
+              << " mismatches=" << s.mismatches << " seconds=" << seconds
+              << " sent_mb_per_sec="
+              << MegabytesPerSecond(s.bytes_sent, seconds)
+              << " received_mb_per_sec="
+              << MegabytesPerSecond(s.bytes_received, seconds)
+              << " p50_us=" << s.latency.Percentile(0.5)
+              << " p99_us=" << s.latency.Percentile(0.99)
+              << " max_us=" << s.latency.max() << "\n";
+    total.Merge(s);
+  }
+
+  double seconds = total.seconds();
+  const char *pacing =
+      options.load.pacing == LoadOptions::kRecorded ? "recorded" : "flood";
+  std::cout << "RESULT label=" << options.label
+            << " connections=" << conversations.size()
+            << " copies=" << options.load.copies << " pacing=" << pacing;
+  if (options.load.pacing == LoadOptions::kRecorded) {
+    std::cout << " speed=" << options.load.speed;
+  }
+  std::cout << " completed=" << total.copies_done
+            << " errors=" << total.errors
+            << " responses=" << total.responses
+            << " timeouts=" << total.timeouts
+            << " mismatches=" << total.mismatches << " seconds=" << seconds
+            << " responses_per_sec="
+            << (seconds > 0 ? total.responses / seconds : 0)
+            << " sent_mb_per_sec="
+            << MegabytesPerSecond(total.bytes_sent, seconds)
+            << " received_mb_per_sec="
+            << MegabytesPerSecond(total.bytes_received, seconds)
+            << " mean_us=" << total.latency.mean()
+            << " p50_us=" << total.latency.Percentile(0.5)
+            << " p90_us=" << total.latency.Percentile(0.9)
+            << " p99_us=" << total.latency.Percentile(0.99)
+            << " p999_us=" << total.latency.Percentile(0.999)
+            << " max_us=" << total.latency.max() << "\n";
+  total.latency.Print(std::cout);
+  return total.errors == 0 && total.timeouts == 0 ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+#include <sys/prctl.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include "airreplay.h"
+
+namespace airreplay {
+namespace {
+// number of trace entries ahead of the head that are decoded in advance
+constexpr int kLookaheadWindow = 256;
+}  // namespace
+
+void Airreplay::WakeLookahead() {
+  {
+    std::lock_guard lock(lookahead_mutex_);
+    lookahead_pending_ = true;
+  }
+  lookahead_cv_.notify_one();
+}
+
+// decodes payloads of registered kinds in a window ahead of the trace head so
+// reproducers do not have to unpack their Any on the replay critical path
+void Airreplay::lookaheadLoop() {
+  int err = prctl(PR_SET_NAME, "AirReplayLookahead");
+  DCHECK(err >= 0 || err == EPERM) << "prctl(PR_SET_NAME) failed. errno: " << err;
+  using Pending =
+      std::tuple<int, std::shared_ptr<const google::protobuf::Message>,
+                 std::string>;
+  while (true) {
+    std::vector<Pending> batch;
+    int head;
+    {
+      std::lock_guard lock(recordOrder_);
+      if (shutdown_ || !trace_.HasNext()) return;
+
+      // only copy the bytes under the lock, parsing happens outside of it
+      head = trace_.pos();
+      int end = head + std::min<int>(kLookaheadWindow, trace_.size());
+      for (int pos = std::max(lookahead_pos_, head); pos < end; pos++) {
+        const airreplay::OpequeEntry &entry = trace_.traceEvents_[pos - head];
+        const KindInfo *info = FindKindUnlocked(entry.kind());
+        if (info == nullptr || !info->prototype) continue;
+        batch.emplace_back(pos, info->prototype, PayloadBytes(entry));
+      }
+      lookahead_pos_ = std::max(lookahead_pos_, end);
+    }
+
+    std::map<int, std::shared_ptr<const google::protobuf::Message>> decoded;
+    for (auto &[pos, prototype, bytes] : batch) {
+      std::shared_ptr<google::protobuf::Message> msg(prototype->New());
+      if (msg->ParseFromString(bytes)) {
+        decoded.emplace(pos, std::move(msg));
+      }
+    }
+
+    std::unique_lock lock(lookahead_mutex_);
+    // drop entries that were consumed without being reproduced
+    decoded_.erase(decoded_.begin(), decoded_.lower_bound(head));
+    decoded_.merge(decoded);
+    lookahead_cv_.wait(lock,
+                       [this]() { return lookahead_pending_ || shutdown_; });
+    lookahead_pending_ = false;
+  }
+}
+
+std::shared_ptr<const google::protobuf::Message>
+Airreplay::DecodedPayloadUnlocked(int pos, int kind,
+                                  const std::string &payload) {
+  const KindInfo *info = FindKindUnlocked(kind);
+  if (info == nullptr || !info->prototype) return nullptr;
+  {
+    std::lock_guard lock(lookahead_mutex_);
+    auto it = decoded_.find(pos);
+    if (it != decoded_.end()) {
+      auto msg = std::move(it->second);
+      decoded_.erase(it);
+      return msg;
+    }
+  }
+  std::shared_ptr<google::protobuf::Message> msg(info->prototype->New());
+  msg->ParseFromString(payload);
+  return msg;
+}
+}  // namespace airreplay
@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+
+#include "airreplay/mock_socket_traffic.h"
+#include "airreplay/socket.h"
+#include "airreplay/trace.h"
+#include "airreplay/worker_process.h"
+
+namespace {
+const int kRecordedPort = 17031;
+const int kPortStride = 100;
+
+airreplay::OpequeEntry Entry(const std::string &kind,
+                             const std::string &bytes) {
+  airreplay::OpequeEntry entry;
+  entry.set_rr_debug_string(kind);
+  entry.set_bytes_message(bytes);
+  entry.set_body_size(bytes.size());
+  return entry;
+}
+
+std::string Exchange(int port, const std::string &request, size_t len) {
+  Socket client;
+  struct sockaddr_in address;
+  EXPECT_TRUE(client.Create());
+  EXPECT_TRUE(ParseAddress("127.0.0.1:" + std::to_string(port), &address));
+  if (!client.Connect(address)) return "";
+  client.Write((const uint8_t *)request.data(), request.size());
+  std::string out;
+  uint8_t buf[4096];
+  while (out.size() < len) {
+    int n = client.Read(buf, sizeof(buf));
+    if (n <= 0) break;
+    out.append((char *)buf, n);
+  }
+  client.Close();
+  return out;
+}
+
+// runs the test in a fresh directory holding one socket trace recorded by a
+// server on kRecordedPort, which answers "ping" with "pong"
+class MockSocketTrafficTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_cwd_ = std::filesystem::current_path();
+    char dir[] = "/tmp/mock-socket-traffic-test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    std::filesystem::current_path(dir_);
+    std::string prefix = "socket_rec_accept_" + std::to_string(kRecordedPort) +
+                         "_from_127.0.0.1:5555";
+    airreplay::Trace trace(prefix, airreplay::Mode::kRecord);
+    trace.Record(Entry("Socket Read", "ping"));
+    trace.Record(Entry("Socket Write", "pong"));
+  }
+
+  void TearDown() override {
+    std::filesystem::current_path(old_cwd_);
+    std::filesystem::remove_all(dir_);
+  }
+
+  std::filesystem::path old_cwd_;
+  std::string dir_;
+};
+}  // namespace
+
+TEST(ParseMockPortsTest, ParsesPortsAndRecordedListenPairs) {
+  std::vector<MockPort> ports = ParseMockPorts("7000,7001:7101");
+  ASSERT_EQ(ports.size(), 2);
+  EXPECT_EQ(ports[0].recorded, 7000);
+  EXPECT_EQ(ports[0].listen, 7000);
+  EXPECT_EQ(ports[1].recorded, 7001);
+  EXPECT_EQ(ports[1].listen, 7101);
+}
+
+TEST(ParseMockPortsTest, SlotsShiftTheListenPorts) {
+  EXPECT_EQ(airreplay::SlotMockPorts({7000, 7001}, 2, 100),
+            "7000:7200,7001:7201");
+  EXPECT_EQ(airreplay::SlotPorts({7000, 7001}, 2, 100), "7200,7201");
+}
+
+TEST_F(MockSocketTrafficTest, SlotsReplayTheRecordedPortSideBySide) {
+  SocketTraffic slot0("127.0.0.1",
+                      ParseMockPorts(airreplay::SlotMockPorts(
+                          {kRecordedPort}, 0, kPortStride)));
+  SocketTraffic slot1("127.0.0.1",
+                      ParseMockPorts(airreplay::SlotMockPorts(
+                          {kRecordedPort}, 1, kPortStride)));
+  EXPECT_EQ(Exchange(kRecordedPort, "ping", 4), "pong");
+  EXPECT_EQ(Exchange(kRecordedPort + kPortStride, "ping", 4), "pong");
+}
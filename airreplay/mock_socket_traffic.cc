@@ -6,101 +6,205 @@
 #include <unistd.h>
 
 #include <filesystem>
+#include <sstream>
 
 #include "airreplay.h"
 #include "trace.h"
 
+namespace {
+const std::string kConnectTracePrefix = "socket_rec_connect_from_";
+}  // namespace
+
+std::vector<MockPort> ParseMockPorts(const std::string& ports) {
+  std::vector<MockPort> parsed;
+  std::stringstream ss(ports);
+  std::string port;
+  while (std::getline(ss, port, ',')) {
+    size_t colon = port.find(':');
+    if (colon == std::string::npos) {
+      parsed.emplace_back(std::stoi(port));
+    } else {
+      parsed.emplace_back(std::stoi(port.substr(0, colon)),
+                          std::stoi(port.substr(colon + 1)));
+    }
+  }
+  return parsed;
+}
+
 // create sockets and listen to all these ports
-SocketTraffic::SocketTraffic(std::string hoststr, std::vector<int> ports)
+SocketTraffic::SocketTraffic(std::string hoststr, std::vector<MockPort> ports,
+                             SocketReplayOptions options)
     : log_file_(std::string("socket_traffic.log"), std::ios::out) {
+  loop_ = SocketReplayLoop::Create(Log, options);
   Log("SocketTraffic", "Reading all traces");
   // create empty trace groups
-  for (int port : ports) {
-    traceGroups_.emplace(port, airreplay::TraceGroup());
-    // Parse traces and add them to relevant trace groups
-    ParseTraces(port, "accept");
+  for (const MockPort& port : ports) {
+    traceGroups_.emplace(port.recorded, airreplay::TraceGroup());
+    // Parse traces and add them to relevant trace groups. They are named
+    // after the recorded port, whatever port the server listens on now
+    ParseTraces(port.recorded, "accept");
     // create mock-servers around the trace groups
-    servers_.emplace(
-        port, std::make_unique<MockServer>(hoststr, port, traceGroups_[port]));
-    Log("SocketTraffic", "Created mock-server for port" + std::to_string(port));
+    servers_.emplace(port.listen, std::make_unique<MockServer>(
+                                      hoststr, port.listen,
+                                      traceGroups_[port.recorded],
+                                      loop_.get()));
+    Log("SocketTraffic", "Created mock-server for port " +
+                             std::to_string(port.recorded) + " on " +
+                             std::to_string(port.listen));
+  }
+  dispatcher_ = std::thread(&SocketTraffic::DispatchLoop, this);
+}
+
+SocketTraffic::~SocketTraffic() {
+  {
+    std::lock_guard lock(dispatch_mutex_);
+    stopping_ = true;
+  }
+  dispatch_cv_.notify_one();
+  dispatcher_.join();
+  // closes all replayed connections
+  loop_->Stop();
+  for (auto& kv : prepared_) {
+    kv.second.socket.Close();
   }
 }
 
 void SocketTraffic::SendTraffic(const std::string& connection_info,
                                 const airreplay::OpequeEntry& replay_until) {
-  Socket socket;
-  struct sockaddr_in address;
-  struct in_addr host;
+  {
+    std::lock_guard lock(dispatch_mutex_);
+    dispatch_queue_.emplace_back(connection_info, replay_until);
+  }
+  dispatch_cv_.notify_one();
+}
 
-  struct sockaddr_in conn_address;
-  struct in_addr conn_host;
-
-  if (connections_.find(connection_info) == connections_.end()) {
-    // split connection_info by chacater #
-    size_t pos = connection_info.find("#");
-    if (pos == std::string::npos) {
-      Log("SocketTraffic::SendTraffic",
-          "Invalid connection_info " + connection_info);
-      return;
-    }
-    std::string client = connection_info.substr(0, pos);
-    std::string server = connection_info.substr(pos + 1);
-    std::string client_host = client.substr(0, client.find(":"));
-    std::string client_port = client.substr(client.find(":") + 1);
-    std::string server_host = server.substr(0, server.find(":"));
-    std::string server_port = server.substr(server.find(":") + 1);
-    Log("hfh", "Serveris " + server);
-
-    if (!socket.Create()) {
-      Log("SocketTraffic", "Failed to create socket ");
-      return;
+void SocketTraffic::DispatchLoop() {
+  PrepareConnections();
+  while (true) {
+    std::pair<ConnectionInfo, airreplay::OpequeEntry> request;
+    {
+      std::unique_lock lock(dispatch_mutex_);
+      dispatch_cv_.wait(
+          lock, [this]() { return stopping_ || !dispatch_queue_.empty(); });
+      if (stopping_) return;
+      request = std::move(dispatch_queue_.front());
+      dispatch_queue_.pop_front();
     }
+    OpenConnection(request.first, request.second);
+  }
+}
 
-    if (inet_pton(AF_INET, client_host.c_str(), &host) != 1) {
-      throw new std::runtime_error("Invalid client host string " + client);
-    }
-    address.sin_family = AF_INET;
-    address.sin_addr = host;
-    address.sin_port = htons(stoi(client_port));
-    Log("send:traffic::", "Binding to port " + client_port);
-    if (!socket.Bind(address)) {
-      std::runtime_error("Failed to bind to port " + client_port);
+void SocketTraffic::PrepareConnections() {
+  for (const auto& entry : std::filesystem::directory_iterator(".")) {
+    std::string filename = entry.path().filename();
+    if (filename.rfind(kConnectTracePrefix, 0) != 0) continue;
+    size_t suffix_loc = filename.rfind(".bin");
+    if (suffix_loc == std::string::npos ||
+        suffix_loc + 4 != filename.size()) {
+      continue;
     }
+    // socket_rec_connect_from_<client>_from_<server>.bin
+    std::string endpoints = filename.substr(
+        kConnectTracePrefix.size(), suffix_loc - kConnectTracePrefix.size());
+    size_t sep = endpoints.find("_from_");
+    if (sep == std::string::npos) continue;
+    ConnectionInfo connection_info =
+        endpoints.substr(0, sep) + "#" + endpoints.substr(sep + 6);
 
-    if (inet_pton(AF_INET, server_host.c_str(), &conn_host) != 1) {
-      throw new std::runtime_error("Invalid client host string " + server);
-    }
-    conn_address.sin_family = AF_INET;
-    conn_address.sin_addr = conn_host;
-    conn_address.sin_port = htons(stoi(server_port));
-    Log("MockServer", "Binding to port " + server_port);
-    if (!socket.Connect(conn_address)) {
-      std::runtime_error("Failed to connect to port " + server_port);
+    PreparedConnection conn;
+    if (PrepareConnection(connection_info, &conn)) {
+      prepared_.emplace(connection_info, std::move(conn));
     }
+  }
+  Log("SocketTraffic",
+      "Prepared " + std::to_string(prepared_.size()) + " connections");
+}
 
-    Log("SocketTraffic::SendTraffic", "Trying to send" + connection_info);
-    std::string trace_pfix =
-        "socket_rec_connect_from_" + client + "_from_" + server;
-    if (!std::ifstream(trace_pfix + ".bin")) {
-      throw new std::runtime_error("SendTraffic::send: trace with prefix " +
-                                   trace_pfix + " does NOT exist");
-    }
-    airreplay::Trace trace(trace_pfix, airreplay::Mode::kReplay, false);
-    trace.Coalesce();
-    airreplay::TraceGroup trace_group({trace.traceEvents_});
-    conn_threads_.emplace_back(std::thread(
-        [this, replay_until, log_prefix = std::string(connection_info),
-         new_socket = std::move(socket),
-         traces = std::move(trace_group)]() mutable {
-          ReplayTrace(std::move(new_socket), traces, Log,
-                      "SocketTraffic::SendTraffic" + log_prefix, &replay_until);
-        }));
-
-    connections_.emplace(connection_info, std::move(socket));
+bool SocketTraffic::PrepareConnection(const ConnectionInfo& connection_info,
+                                      PreparedConnection* conn) {
+  // split connection_info by chacater #
+  size_t pos = connection_info.find("#");
+  if (pos == std::string::npos) {
+    Log("SocketTraffic::PrepareConnection",
+        "Invalid connection_info " + connection_info);
+    return false;
+  }
+  std::string client = connection_info.substr(0, pos);
+  conn->server = connection_info.substr(pos + 1);
+
+  std::string trace_pfix =
+      kConnectTracePrefix + client + "_from_" + conn->server;
+  if (!std::ifstream(trace_pfix + ".bin")) {
+    Log("SocketTraffic::PrepareConnection",
+        "trace with prefix " + trace_pfix + " does NOT exist");
+    return false;
+  }
+
+  struct sockaddr_in address;
+  if (!ParseAddress(client, &address)) {
+    Log("SocketTraffic::PrepareConnection",
+        "Invalid client host string " + client);
+    return false;
+  }
+  if (!conn->socket.Create()) {
+    Log("SocketTraffic", "Failed to create socket ");
+    return false;
+  }
+  // the port of an earlier replay may still be in TIME_WAIT
+  conn->socket.SetSockOpt(SOL_SOCKET, SO_REUSEADDR, 1);
+  Log("SocketTraffic::PrepareConnection", "Binding to " + client);
+  if (!conn->socket.Bind(address)) {
+    // connect from an ephemeral port instead
+    Log("SocketTraffic::PrepareConnection", "Failed to bind to " + client);
+  }
+
+  // a replay Trace per connection would start and join a debug thread
+  std::deque<airreplay::OpequeEntry> entries =
+      airreplay::ReadTraceEntries(trace_pfix);
+  airreplay::CoalesceSocketEntries(&entries);
+  conn->traces = airreplay::TraceGroup({std::move(entries)});
+  return true;
+}
+
+void SocketTraffic::OpenConnection(const ConnectionInfo& connection_info,
+                                   const airreplay::OpequeEntry& replay_until) {
+  if (connections_.find(connection_info) != connections_.end()) return;
+
+  auto prepared = prepared_.find(connection_info);
+  if (prepared == prepared_.end()) {
+    // the trace was not there when the dispatcher started
+    PreparedConnection conn;
+    if (!PrepareConnection(connection_info, &conn)) return;
+    prepared = prepared_.emplace(connection_info, std::move(conn)).first;
+  }
+  PreparedConnection conn = std::move(prepared->second);
+  prepared_.erase(prepared);
+
+  struct sockaddr_in conn_address;
+  if (!ParseAddress(conn.server, &conn_address)) {
+    Log("SocketTraffic::OpenConnection",
+        "Invalid server host string " + conn.server);
+    conn.socket.Close();
+    return;
+  }
+  Log("SocketTraffic::OpenConnection", "Connecting to " + conn.server);
+  if (!conn.socket.Connect(conn_address)) {
+    Log("SocketTraffic::OpenConnection",
+        "Failed to connect to " + conn.server);
+    conn.socket.Close();
+    return;
   }
+
+  Log("SocketTraffic::OpenConnection", "Trying to send" + connection_info);
+  loop_->AddConnection(std::move(conn.socket), std::move(conn.traces),
+                       "SocketTraffic::SendTraffic" + connection_info,
+                       &replay_until);
+  connections_.insert(connection_info);
 }
 
 void SocketTraffic::ParseTraces(int serverPort, std::string filter) {
+  // loaded once, every connection to the port replays against the same store
+  std::vector<std::vector<airreplay::OpequeEntry>> traces;
   // iterate over all files in the current directory
 
   for (const auto& entry : std::filesystem::directory_iterator(".")) {
@@ -110,24 +214,31 @@ void SocketTraffic::ParseTraces(int serverPort, std::string filter) {
     int suffix_loc = filename.find(".bin");
     if (suffix_loc == std::string::npos) continue;
 
-    if (filename.find(std::to_string(serverPort)) == std::string::npos)
+    // socket_rec_accept_<port>_from_<peer>
+    if (filename.find("_" + std::to_string(serverPort) + "_") ==
+        std::string::npos) {
       continue;
+    }
     if (filename.find(filter) == std::string::npos) continue;
 
     std::string traceprefix = filename.substr(0, suffix_loc);
-    airreplay::Trace trace(traceprefix, airreplay::Mode::kReplay);
-    int orig_len = trace.traceEvents_.size();
-    trace.Coalesce();
+    std::deque<airreplay::OpequeEntry> entries =
+        airreplay::ReadTraceEntries(traceprefix);
+    int orig_len = entries.size();
+    airreplay::CoalesceSocketEntries(&entries);
     Log("SocketTraffic", "Parsing trace " + filename + " which has " +
                              std::to_string(orig_len) + "-->" +
-                             std::to_string(trace.size()) + " elements");
+                             std::to_string(entries.size()) + " elements");
 
-    traceGroups_[serverPort].AddTrace(std::move(trace.traceEvents_));
+    traces.emplace_back(std::make_move_iterator(entries.begin()),
+                        std::make_move_iterator(entries.end()));
   }
+  traceGroups_[serverPort] = airreplay::TraceGroup(
+      std::make_shared<const airreplay::TraceStore>(std::move(traces)));
 }
 
 MockServer::MockServer(std::string hoststr, int port,
-                       airreplay::TraceGroup traces)
+                       airreplay::TraceGroup traces, SocketReplayLoop* loop)
     : log_file_("MockServer", std::ios::out), port_(port), traces_(traces) {
   Socket socket;
   if (!socket.Create()) {
@@ -142,113 +253,17 @@ MockServer::MockServer(std::string hoststr, int port,
   address.sin_family = AF_INET;
   address.sin_addr = host;
   address.sin_port = htons(port);
+  // the port of an earlier replay may still be in TIME_WAIT
+  socket.SetSockOpt(SOL_SOCKET, SO_REUSEADDR, 1);
   Log("MockServer", "Binding to port " + std::to_string(port));
   if (!socket.Bind(address)) {
     std::runtime_error("Failed to bind to port " + std::to_string(port));
   }
-  if (!socket.Listen(5)) {
+  // connections are accepted by the loop, so the backlog can fill up
+  // while it replays others
+  if (!socket.Listen(SOMAXCONN)) {
     std::runtime_error("Failed to listen on port " + std::to_string(port));
   }
-  bool is_nonblock = true;
-  socket.IsNonBlocking(&is_nonblock);
-  assert(!is_nonblock);
-  sockets_.emplace(port, std::move(socket));
-  assert(socket.fd_ == -1);
-
-  accept_thread_ = std::thread([this, port]() {
-    while (true) {
-      Socket new_socket;
-      if (!sockets_[port].Accept(new_socket)) {
-        Log("MockServer",
-            "Failed to accept connection on port " + std::to_string(port));
-        new_socket.Close();
-        return;
-      }
-      Log("MockServer", "Accepted connection to fd" +
-                            std::to_string(new_socket.fd_) + " on port " +
-                            std::to_string(port));
-
-      client_threads_.push_back(
-          std::thread([this, new_socket = std::move(new_socket),
-                       traces = traces_, port]() mutable {
-            ReplayTrace(std::move(new_socket), traces, Log, "MockServer");
-          }));
-    }
-  });
+  loop->AddListener(std::move(socket), traces_, "MockServer");
   Log("MockServer", "Started listening on port " + std::to_string(port));
 }
-
-MockServer::~MockServer() {
-  // Log("MockServer", "Shutting down");
-  // ^^ if this object was moved out of, Log will no logner be valid
-  for (auto& conn_thread : client_threads_) {
-    conn_thread.join();
-  }
-  if (accept_thread_.joinable()) {
-    accept_thread_.join();
-  }
-}
-
-void ReplayTrace(
-    Socket new_socket, airreplay::TraceGroup traces,
-    std::function<void(const std::string&, const std::string&)> Log,
-    std::string log_prefix, const airreplay::OpequeEntry* replay_until) {
-  int nodelay = 42;
-  DCHECK(new_socket.SetTCPNoDelay(true));
-  DCHECK(new_socket.GetTCPNoDelay(&nodelay));
-  Log(log_prefix, "just set to nodelay" + std::to_string(nodelay));
-  while (true) {
-    if (replay_until && !traces.StillBefore(*replay_until)) {
-      Log(log_prefix, "Reached replay_until");
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      continue;
-    }
-    Log(log_prefix, "SOMETHING WENT THRU, even after StillBefore");
-    uint8_t buffer[8192] = {0};
-    while (traces.NextIsReadOrEmpty()) {
-      Log(log_prefix, "about to attempt reading...");
-
-      int length = new_socket.Read(buffer, sizeof(buffer));
-      traces.ConsumeRead(buffer, length);
-      Log(log_prefix, "Read " + std::to_string(length) + " bytes");
-    }
-
-    if (replay_until && !traces.StillBefore(*replay_until)) {
-      Log(log_prefix, "Reached replay_until");
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      continue;
-    }
-
-    while (traces.NextIsWrite()) {
-      int trace_length = traces.NextCommonWrite(buffer, sizeof(buffer));
-      std::string s((char*)buffer, trace_length);
-      Log(log_prefix,
-          "should write " + std::to_string(trace_length) + " bytes(" + s + ")");
-      int written_length = new_socket.Write(buffer, trace_length);
-      Log(log_prefix, "wrote " + std::to_string(written_length) + " bytes");
-      DCHECK(trace_length == written_length);
-    }
-
-    if (replay_until && !traces.StillBefore(*replay_until)) {
-      Log(log_prefix, "Reached replay_until");
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      continue;
-    }
-
-    if (traces.AllEmpty()) {
-      Log(log_prefix, "All traces are empty, socket replay done!Sleeping.....");
-      Log(log_prefix, "Sleeping is over. closing socket");
-      new_socket.Close();
-      return;
-    }
-
-    if (!(traces.NextIsReadOrEmpty() || traces.NextIsWrite())) {
-      Log(log_prefix,
-          "The set of traces associated with socket cannot agree on the "
-          "next action");
-      throw new std::runtime_error(
-          "The set of traces associated with socket cannot agree on the "
-          "next action");
-    }
-  }
-}
\ No newline at end of file
@@ -1,48 +1,58 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "socket.h"
+#include "socket_replay_loop.h"
 #include "trace.h"
 
-void ReplayTrace(
-    Socket new_socket, airreplay::TraceGroup traces,
-    std::function<void(const std::string&, const std::string&)> Log =
-        [](std::string, std::string) {},
-    std::string log_prefix = "",
-    const airreplay::OpequeEntry* replay_until = nullptr);
+// a mocked server port. Connections accepted on listen are replayed against
+// the socket traces recorded on port recorded. The two differ when
+// airreplay-farm or airreplay-bisect run replays side by side
+struct MockPort {
+  MockPort(int port) : recorded(port), listen(port) {}
+  MockPort(int recorded, int listen) : recorded(recorded), listen(listen) {}
+  int recorded;
+  int listen;
+};
+
+// parses AIRREPLAY_MOCK_PORTS: comma separated ports, each either P or
+// <recorded>:<listen>
+std::vector<MockPort> ParseMockPorts(const std::string& ports);
+
+// Listens on a port and replays the recorded server side of every connection
+// accepted there on loop
 class MockServer {
  public:
-  MockServer(std::string hoststr, int port, airreplay::TraceGroup traces);
+  MockServer(std::string hoststr, int port, airreplay::TraceGroup traces,
+             SocketReplayLoop* loop);
   MockServer(const MockServer&) = delete;
   MockServer& operator=(const MockServer&) = delete;
-  // cannot move because it creates threads that reference self
   MockServer(MockServer&&) = delete;
   MockServer& operator=(MockServer&&) = delete;
-  ~MockServer();
-  void Start();
-  void Stop();
 
  private:
   using Logger = std::function<void(const std::string&, const std::string&)>;
   std::ofstream log_file_;
   std::mutex log_lock_;
   int port_;
-  std::thread accept_thread_;
-  std::vector<std::thread> client_threads_;
-  std::map<int, Socket> sockets_;
   // ground-truth traces for all sockets this server has to mock
   // the member is copied into each socket the MockServer manages and is
   // narrowed down to the correct socket trace, based on server-client
-  // conversation
+  // conversation. Copies share the recorded entries (see TraceStore)
   const airreplay::TraceGroup traces_;
-  bool running_ = false;
 
   Logger Log = [this](const std::string& tag, const std::string& msg) {
     std::lock_guard<std::mutex> lock(log_lock_);
@@ -53,10 +63,18 @@ class MockServer {
 
 class SocketTraffic {
  public:
-  SocketTraffic(std::string host, std::vector<int> ports);
+  SocketTraffic(std::string host, std::vector<MockPort> ports,
+                SocketReplayOptions options = SocketReplayOptions());
+  ~SocketTraffic();
   // void SendTraffic(int port, const uint8_t* buffer, int length);
+  // hands msg to the dispatcher thread, which opens the connection (unless
+  // it is already open) and hands it to loop_ to replay the recorded client
+  // side of it up to msg. Does no I/O itself, so it is cheap to call under
+  // recordOrder_
   void SendTraffic(const std::string& connection_info,
                    const airreplay::OpequeEntry& msg);
+  // loads the socket traces recorded on serverPort whose file name contains
+  // filter as the candidates of the port's mock server
   void ParseTraces(int serverPort, std::string filter);
 
  private:
@@ -64,12 +82,40 @@ class SocketTraffic {
   using Port = int;
   using ConnectionInfo = std::string;
 
+  // a client socket bound to its recorded address, together with the
+  // traffic recorded on it. Only connecting is left for dispatch time
+  struct PreparedConnection {
+    Socket socket;
+    std::string server;
+    airreplay::TraceGroup traces;
+  };
+
+  void DispatchLoop();
+  // prepares all connections that have a socket_rec_connect_from_ trace in
+  // the current directory
+  void PrepareConnections();
+  bool PrepareConnection(const ConnectionInfo& connection_info,
+                         PreparedConnection* conn);
+  void OpenConnection(const ConnectionInfo& connection_info,
+                      const airreplay::OpequeEntry& replay_until);
+
   // std::map<int, std::thread> conn_threads_;
   // std::map<int, Socket> sockets_;
   std::map<Port, airreplay::TraceGroup> traceGroups_;
+  // replays all mocked connections, inbound and outbound
+  std::unique_ptr<SocketReplayLoop> loop_;
   std::map<Port, std::unique_ptr<MockServer>> servers_;
-  std::map<ConnectionInfo, Socket> connections_;
-  std::vector<std::thread> conn_threads_;
+  // below are only accessed by the dispatcher thread
+  std::map<ConnectionInfo, PreparedConnection> prepared_;
+  std::set<ConnectionInfo> connections_;
+
+  std::mutex dispatch_mutex_;
+  std::condition_variable dispatch_cv_;
+  std::deque<std::pair<ConnectionInfo, airreplay::OpequeEntry>>
+      dispatch_queue_;
+  bool stopping_ = false;
+  std::thread dispatcher_;
+
   std::ofstream log_file_;
 
   std::mutex log_lock_;
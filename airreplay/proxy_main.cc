@@ -0,0 +1,82 @@
+// airreplay-proxy: records the traffic between clients and a server as
+// socket traces.
+//
+// Usage:
+//   airreplay-proxy --listen HOST:PORT --server HOST:PORT [--out DIR]
+//                   [--perspective client|server] [--pipe-bytes N]
+//
+// Point the clients at --listen instead of the server. Every connection is
+// forwarded to --server and both of its directions are recorded into one
+// trace in --out (see RecordingProxy). With --perspective client (the
+// default) the traces are socket_rec_connect_from_<client>_from_<server>,
+// which replay of the client reads, with --perspective server they are
+// socket_rec_accept_<server port>_from_<client> traces for mock servers.
+// Runs until SIGINT or SIGTERM, then closes the open connections and traces.
+#include <signal.h>
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "socket_proxy.h"
+
+namespace {
+
+void Usage() {
+  std::cerr << "usage: airreplay-proxy --listen HOST:PORT --server HOST:PORT "
+               "[--out DIR] [--perspective client|server] [--pipe-bytes N]"
+            << std::endl;
+  exit(2);
+}
+
+RecordingProxyOptions ParseArgs(int argc, char **argv) {
+  RecordingProxyOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) Usage();
+    std::string value = argv[++i];
+    if (arg == "--listen") {
+      options.listen = value;
+    } else if (arg == "--server") {
+      options.server = value;
+    } else if (arg == "--out") {
+      options.out_dir = value;
+    } else if (arg == "--perspective") {
+      if (value == "client") {
+        options.perspective = RecordingProxyOptions::kClient;
+      } else if (value == "server") {
+        options.perspective = RecordingProxyOptions::kServer;
+      } else {
+        Usage();
+      }
+    } else if (arg == "--pipe-bytes") {
+      options.pipe_bytes = std::stoul(value);
+    } else {
+      Usage();
+    }
+  }
+  if (options.listen.empty() || options.server.empty()) Usage();
+  return options;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  RecordingProxyOptions options = ParseArgs(argc, argv);
+  std::filesystem::create_directories(options.out_dir);
+
+  // blocked before the proxy thread starts so only sigwait sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  RecordingProxy proxy(options);
+  std::cerr << "recording " << options.listen << " -> " << options.server
+            << " into " << options.out_dir << std::endl;
+  int signal;
+  sigwait(&signals, &signal);
+  proxy.Stop();
+  return 0;
+}
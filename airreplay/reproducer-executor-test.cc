@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "airreplay/reproducer_executor.h"
+
+using airreplay::ReproducerExecutor;
+
+TEST(ReproducerExecutorTest, SameKeyRunsInOrder) {
+  std::mutex mutex;
+  std::vector<int> order;
+  std::atomic<int> concurrent{0};
+  bool overlapped = false;
+  {
+    ReproducerExecutor executor(4);
+    for (int i = 0; i < 100; i++) {
+      executor.Submit("a#b", [&, i]() {
+        if (concurrent.fetch_add(1) != 0) overlapped = true;
+        {
+          std::lock_guard lock(mutex);
+          order.push_back(i);
+        }
+        concurrent.fetch_sub(1);
+      });
+    }
+    while (executor.GetStats().executed < 100) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  EXPECT_FALSE(overlapped);
+  ASSERT_EQ(order.size(), 100u);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+}
+
+TEST(ReproducerExecutorTest, BlockedKeyDoesNotBlockOthers) {
+  ReproducerExecutor executor(2);
+  std::atomic<bool> release{false};
+  std::atomic<bool> other_ran{false};
+  executor.Submit("slow", [&]() {
+    while (!release) std::this_thread::yield();
+  });
+  // queued behind the blocked task of the same connection
+  executor.Submit("slow", [&]() {});
+  executor.Submit("fast", [&]() { other_ran = true; });
+  while (executor.GetStats().executed < 1) std::this_thread::yield();
+
+  auto stats = executor.GetStats();
+  EXPECT_TRUE(other_ran);
+  EXPECT_EQ(stats.executed, 1u);
+  EXPECT_EQ(stats.queued, 1u);
+  release = true;
+  while (executor.GetStats().executed < 3) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_GE(executor.GetStats().max_queued, 1u);
+}
@@ -0,0 +1,98 @@
+#include "reproducer_executor.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace airreplay {
+
+ReproducerExecutor::ReproducerExecutor(int num_threads) {
+  for (int i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&ReproducerExecutor::WorkerLoop, this);
+  }
+}
+
+ReproducerExecutor::~ReproducerExecutor() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ReproducerExecutor::Submit(const std::string &key,
+                                std::function<void()> task) {
+  {
+    std::lock_guard lock(mutex_);
+    auto it = pending_.find(key);
+    if (it == pending_.end()) {
+      // neither running nor queued, so a worker can pick it up right away
+      it = pending_.emplace(key, std::deque<Task>()).first;
+      ready_.push_back(key);
+    }
+    it->second.push_back({std::move(task), std::chrono::steady_clock::now()});
+    stats_.queued++;
+    stats_.max_queued = std::max(stats_.max_queued, stats_.queued);
+  }
+  cv_.notify_one();
+}
+
+void ReproducerExecutor::WorkerLoop() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !ready_.empty(); });
+    if (stopping_) return;
+
+    std::string key = std::move(ready_.front());
+    ready_.pop_front();
+    auto &queue = pending_[key];
+    Task task = std::move(queue.front());
+    queue.pop_front();
+    stats_.queued--;
+    auto start = std::chrono::steady_clock::now();
+    stats_.total_wait += start - task.submitted;
+
+    lock.unlock();
+    task.fn();
+    auto run_time = std::chrono::steady_clock::now() - start;
+    lock.lock();
+
+    stats_.executed++;
+    stats_.total_run_time += run_time;
+    stats_.max_run_time = std::max(
+        stats_.max_run_time,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(run_time));
+    // the map node is stable, but Submit may have added to the queue
+    auto it = pending_.find(key);
+    if (it->second.empty()) {
+      pending_.erase(it);
+    } else {
+      ready_.push_back(std::move(key));
+      cv_.notify_one();
+    }
+  }
+}
+
+ReproducerExecutor::Stats ReproducerExecutor::GetStats() {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+std::string ReproducerExecutor::StatsString(const Stats &stats) {
+  auto us = [](std::chrono::nanoseconds ns) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(ns).count();
+  };
+  std::stringstream ss;
+  ss << "executed " << stats.executed << " reproducers, " << stats.queued
+     << " queued (max " << stats.max_queued << ")";
+  if (stats.executed > 0) {
+    ss << ", avg wait " << us(stats.total_wait) / stats.executed
+       << "us, avg run " << us(stats.total_run_time) / stats.executed
+       << "us, max run " << us(stats.max_run_time) << "us";
+  }
+  return ss.str();
+}
+
+}  // namespace airreplay
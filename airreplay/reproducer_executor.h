@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace airreplay {
+
+// Runs reproducers on a fixed pool of worker threads.
+// Tasks submitted with the same key (the connection_info of the replayed
+// message) run one at a time in submission order, tasks with different keys
+// run in parallel. So a busy connection does not hold back the others and a
+// server with many clients does not need a thread per message.
+//
+// A reproducer occupies its worker until it returns, so reproducers of the
+// same connection must not wait on each other, and there must be enough
+// workers for all reproducers that block in RecordReplay at the same time.
+class ReproducerExecutor {
+ public:
+  struct Stats {
+    // tasks submitted but not started yet
+    size_t queued = 0;
+    size_t max_queued = 0;
+    uint64_t executed = 0;
+    // time from Submit until a worker started the task
+    std::chrono::nanoseconds total_wait{0};
+    std::chrono::nanoseconds total_run_time{0};
+    std::chrono::nanoseconds max_run_time{0};
+  };
+
+  explicit ReproducerExecutor(int num_threads);
+  ReproducerExecutor(const ReproducerExecutor &) = delete;
+  ReproducerExecutor &operator=(const ReproducerExecutor &) = delete;
+  // waits for running tasks. Tasks that have not started are dropped
+  ~ReproducerExecutor();
+
+  void Submit(const std::string &key, std::function<void()> task);
+  Stats GetStats();
+  static std::string StatsString(const Stats &stats);
+
+ private:
+  struct Task {
+    std::function<void()> fn;
+    std::chrono::steady_clock::time_point submitted;
+  };
+
+  void WorkerLoop();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  // pending tasks per key. A key is in ready_ iff it has pending tasks and
+  // none of its tasks is running
+  std::map<std::string, std::deque<Task>> pending_;
+  std::deque<std::string> ready_;
+  Stats stats_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace airreplay
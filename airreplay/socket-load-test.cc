@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "airreplay/socket.h"
+#include "airreplay/socket_load.h"
+
+using airreplay::OpequeEntry;
+
+namespace {
+OpequeEntry Entry(const std::string &debug_string, const std::string &bytes,
+                  uint64_t timestamp) {
+  OpequeEntry entry;
+  entry.set_rr_debug_string(debug_string);
+  entry.set_bytes_message(bytes);
+  entry.set_body_size(bytes.size());
+  entry.set_timestamp(timestamp);
+  return entry;
+}
+
+OpequeEntry Read(const std::string &bytes, uint64_t timestamp = 0) {
+  return Entry("Socket Read", bytes, timestamp);
+}
+
+OpequeEntry Write(const std::string &bytes, uint64_t timestamp = 0) {
+  return Entry("Socket Write", bytes, timestamp);
+}
+}  // namespace
+
+TEST(SocketLoadTest, ServerTracesSendTheirReads) {
+  Conversation conversation = ClientConversation(
+      "accept",
+      {Read("GET ", 1000), Read("/a", 1100), Write("A", 2000),
+       Read("GET /b", 5000), Write("B", 6000)},
+      /*recorded_by_client=*/false);
+  ASSERT_EQ(conversation.steps.size(), 2);
+  EXPECT_EQ(conversation.start.count(), 1000);
+  EXPECT_EQ(conversation.steps[0].request, "GET /a");
+  EXPECT_EQ(conversation.steps[0].response, "A");
+  EXPECT_EQ(conversation.steps[0].think.count(), 0);
+  EXPECT_EQ(conversation.steps[1].request, "GET /b");
+  // from the last response entry to the request
+  EXPECT_EQ(conversation.steps[1].think.count(), 3000);
+  EXPECT_EQ(conversation.request_bytes, 12);
+  EXPECT_EQ(conversation.response_bytes, 2);
+}
+
+TEST(SocketLoadTest, ClientTracesSendTheirWrites) {
+  // the server greets first
+  Conversation conversation = ClientConversation(
+      "connect_from", {Read("hello"), Write("q"), Read("r")},
+      /*recorded_by_client=*/true);
+  ASSERT_EQ(conversation.steps.size(), 2);
+  EXPECT_EQ(conversation.steps[0].request, "");
+  EXPECT_EQ(conversation.steps[0].response, "hello");
+  EXPECT_EQ(conversation.steps[1].request, "q");
+  EXPECT_EQ(conversation.steps[1].response, "r");
+}
+
+TEST(SocketLoadTest, RelaxedMatchingAcceptsDifferentResponses) {
+  Socket listener;
+  ASSERT_TRUE(listener.Create());
+  struct sockaddr_in address;
+  ASSERT_TRUE(ParseAddress("127.0.0.1:0", &address));
+  ASSERT_TRUE(listener.Bind(address));
+  ASSERT_TRUE(listener.Listen(16));
+  socklen_t len = sizeof(address);
+  getsockname(listener.fd_, (sockaddr *)&address, &len);
+
+  const int kCopies = 3;
+  // answers each request with a response shorter than the recorded one
+  std::thread server([&listener] {
+    std::vector<std::thread> connections;
+    for (int i = 0; i < kCopies; i++) {
+      Socket conn;
+      if (!listener.Accept(conn)) break;
+      connections.emplace_back([conn = std::move(conn)]() mutable {
+        uint8_t buf[64];
+        size_t got = 0;
+        for (size_t request = 0; request < 2; request++) {
+          while (got < 4 * (request + 1)) {
+            int n = conn.Read(buf, sizeof(buf));
+            if (n <= 0) break;
+            got += n;
+          }
+          if (got < 4 * (request + 1)) break;
+          conn.Write((const uint8_t *)"ok", 2);
+        }
+        conn.Close();
+      });
+    }
+    for (auto &connection : connections) connection.join();
+  });
+
+  std::vector<Conversation> conversations = {ClientConversation(
+      "accept", {Read("req1"), Write("okay"), Read("req2"), Write("okay")},
+      /*recorded_by_client=*/false)};
+  LoadOptions options;
+  options.server = "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+  options.copies = kCopies;
+  options.threads = 2;
+  options.pacing = LoadOptions::kFlood;
+  options.response_idle = std::chrono::milliseconds(20);
+  options.compare_bytes = 2;
+  std::vector<ConversationStats> stats = RunLoad(conversations, options);
+  server.join();
+  listener.Close();
+
+  ASSERT_EQ(stats.size(), 1);
+  EXPECT_EQ(stats[0].copies_done, kCopies);
+  EXPECT_EQ(stats[0].errors, 0);
+  EXPECT_EQ(stats[0].timeouts, 0);
+  EXPECT_EQ(stats[0].responses, 2 * kCopies);
+  EXPECT_EQ(stats[0].latency.count(), 2 * kCopies);
+  // "ok" starts like the recorded "okay"
+  EXPECT_EQ(stats[0].mismatches, 0);
+  EXPECT_EQ(stats[0].bytes_sent, 8 * kCopies);
+  EXPECT_EQ(stats[0].bytes_received, 4 * kCopies);
+}
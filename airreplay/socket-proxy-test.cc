@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "airreplay/socket.h"
+#include "airreplay/socket_proxy.h"
+#include "airreplay/trace.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+int ListenOnFreePort(Socket *listener) {
+  struct sockaddr_in address;
+  EXPECT_TRUE(listener->Create());
+  EXPECT_TRUE(ParseAddress("127.0.0.1:0", &address));
+  EXPECT_TRUE(listener->Bind(address));
+  EXPECT_TRUE(listener->Listen(16));
+  socklen_t len = sizeof(address);
+  getsockname(listener->fd_, (sockaddr *)&address, &len);
+  return ntohs(address.sin_port);
+}
+
+std::string ReadAll(Socket *socket, size_t len) {
+  std::string out;
+  uint8_t buf[4096];
+  while (out.size() < len) {
+    int n = socket->Read(buf, sizeof(buf));
+    if (n <= 0) break;
+    out.append((char *)buf, n);
+  }
+  return out;
+}
+}  // namespace
+
+TEST(SocketProxyTest, RecordsBothDirections) {
+  std::string dir = fs::temp_directory_path() / "socket-proxy-test";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+
+  Socket listener;
+  int server_port = ListenOnFreePort(&listener);
+  const std::string big(300000, 'x');
+  // answers a request with its upper-case form and a large payload, then
+  // closes after "bye"
+  std::thread server([&listener, &big] {
+    Socket conn;
+    if (!listener.Accept(conn)) return;
+    EXPECT_EQ(ReadAll(&conn, 5), "hello");
+    conn.Write((const uint8_t *)"HELLO", 5);
+    EXPECT_EQ(ReadAll(&conn, 3), "bye");
+    conn.Write((const uint8_t *)big.data(), big.size());
+    conn.Close();
+  });
+
+  RecordingProxyOptions options;
+  options.listen = "127.0.0.1:0";
+  options.server = "127.0.0.1:" + std::to_string(server_port);
+  options.out_dir = dir;
+  options.pipe_bytes = 1 << 16;
+  RecordingProxy proxy(options);
+
+  Socket client;
+  ASSERT_TRUE(client.Create());
+  struct sockaddr_in address;
+  ASSERT_TRUE(
+      ParseAddress("127.0.0.1:" + std::to_string(proxy.port()), &address));
+  ASSERT_TRUE(client.Connect(address));
+  client.Write((const uint8_t *)"hello", 5);
+  EXPECT_EQ(ReadAll(&client, 5), "HELLO");
+  client.Write((const uint8_t *)"bye", 3);
+  // the server closing reaches the client after everything was recorded
+  EXPECT_EQ(ReadAll(&client, big.size() + 1), big);
+  server.join();
+  proxy.Stop();
+  client.Close();
+  listener.Close();
+
+  std::vector<std::string> traces;
+  for (const auto &entry : fs::directory_iterator(dir)) {
+    traces.push_back(entry.path().filename());
+  }
+  ASSERT_EQ(traces.size(), 1);
+  EXPECT_EQ(traces[0].find("socket_rec_connect_from_127.0.0.1:"), 0);
+  std::string prefix = dir + "/" + traces[0].substr(0, traces[0].size() - 4);
+  airreplay::Trace trace(prefix, airreplay::Mode::kReplay);
+  trace.Coalesce();
+  ASSERT_EQ(trace.traceEvents_.size(), 4);
+  std::vector<std::pair<std::string, std::string>> expected = {
+      {"Socket Write", "hello"},
+      {"Socket Read", "HELLO"},
+      {"Socket Write", "bye"},
+      {"Socket Read", big}};
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(trace.traceEvents_[i].rr_debug_string(), expected[i].first);
+    EXPECT_EQ(trace.traceEvents_[i].bytes_message(), expected[i].second);
+    EXPECT_GT(trace.traceEvents_[i].timestamp(), 0);
+  }
+  fs::remove_all(dir);
+}
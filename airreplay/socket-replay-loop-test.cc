@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+#include "airreplay/socket.h"
+#include "airreplay/socket_replay_loop.h"
+#include "airreplay/trace.h"
+#ifndef AIRREPLAY_NO_IO_URING
+#include "airreplay/socket_uring_loop.h"
+#endif
+
+namespace {
+void IgnoreLog(const std::string &, const std::string &) {}
+
+airreplay::OpequeEntry Entry(const std::string &kind,
+                             const std::string &bytes) {
+  airreplay::OpequeEntry entry;
+  entry.set_rr_debug_string(kind);
+  entry.set_bytes_message(bytes);
+  entry.set_body_size(bytes.size());
+  return entry;
+}
+
+int ListenOnFreePort(Socket *listener) {
+  struct sockaddr_in address;
+  EXPECT_TRUE(listener->Create());
+  EXPECT_TRUE(ParseAddress("127.0.0.1:0", &address));
+  EXPECT_TRUE(listener->Bind(address));
+  EXPECT_TRUE(listener->Listen(16));
+  socklen_t len = sizeof(address);
+  getsockname(listener->fd_, (sockaddr *)&address, &len);
+  return ntohs(address.sin_port);
+}
+
+void Connect(Socket *client, int port) {
+  struct sockaddr_in address;
+  ASSERT_TRUE(client->Create());
+  ASSERT_TRUE(ParseAddress("127.0.0.1:" + std::to_string(port), &address));
+  ASSERT_TRUE(client->Connect(address));
+}
+
+std::string ReadAll(Socket *socket, size_t len) {
+  std::string out;
+  uint8_t buf[4096];
+  while (out.size() < len) {
+    int n = socket->Read(buf, sizeof(buf));
+    if (n <= 0) break;
+    out.append((char *)buf, n);
+  }
+  return out;
+}
+
+// a mock server on loop answers "ping" with the recorded "pong" and closes
+// the connection once the trace is done
+void ReplaysPingPong(SocketReplayLoop *loop) {
+  Socket listener;
+  int port = ListenOnFreePort(&listener);
+  loop->AddListener(std::move(listener),
+                    airreplay::TraceGroup({{Entry("Socket Read", "ping"),
+                                            Entry("Socket Write", "pong")}}),
+                    "mock server");
+
+  Socket client;
+  Connect(&client, port);
+  client.Write((const uint8_t *)"ping", 4);
+  EXPECT_EQ(ReadAll(&client, 5), "pong");
+  client.Close();
+  loop->Stop();
+}
+}  // namespace
+
+TEST(SocketReplayLoopTest, EpollRepliesWithTheRecordedWrite) {
+  EpollReplayLoop loop(IgnoreLog);
+  ReplaysPingPong(&loop);
+}
+
+TEST(SocketReplayLoopTest, IoUringRepliesWithTheRecordedWrite) {
+#ifdef AIRREPLAY_NO_IO_URING
+  GTEST_SKIP() << "built without io_uring";
+#else
+  std::string reason;
+  if (!UringReplayLoop::Supported(&reason)) GTEST_SKIP() << reason;
+  UringReplayLoop loop(IgnoreLog);
+  ReplaysPingPong(&loop);
+#endif
+}
+
+TEST(SocketReplayLoopTest, StoppedLoopClosesNewConnections) {
+  Socket listener;
+  int port = ListenOnFreePort(&listener);
+  Socket client;
+  Connect(&client, port);
+  Socket server;
+  ASSERT_TRUE(listener.Accept(server));
+
+  EpollReplayLoop loop(IgnoreLog);
+  loop.Stop();
+  loop.AddConnection(std::move(server),
+                     airreplay::TraceGroup({{Entry("Socket Read", "ping")}}),
+                     "connection");
+  // the peer sees the close instead of waiting for a loop that is gone
+  EXPECT_EQ(ReadAll(&client, 1), "");
+  client.Close();
+  listener.Close();
+}
@@ -2,11 +2,14 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
 #include <glog/logging.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <iostream>
@@ -16,6 +19,14 @@ Socket::Socket() : fd_(-1) {}
 
 Socket::Socket(Socket&& other) noexcept : fd_(other.Release()) {}
 
+Socket& Socket::operator=(Socket&& other) noexcept {
+  if (this != &other) {
+    Close();
+    fd_ = other.Release();
+  }
+  return *this;
+}
+
 Socket::~Socket() {
   DCHECK(fd_ == -1) << "Socket not closed before destruction";
 }
@@ -90,7 +101,12 @@ bool Socket::Accept(Socket& new_socket, sockaddr* remote) {
   }
   int new_fd = ::accept(fd_, (sockaddr*)remote, &len);
   if (new_fd == -1) {
-    std::cout << "Socket accept ERRNO" << std::to_string(errno);
+    // a non-blocking listener has no pending connection, not an error
+    int err = errno;
+    if (err != EAGAIN && err != EWOULDBLOCK) {
+      std::cout << "Socket accept ERRNO" << std::to_string(err);
+    }
+    errno = err;
     return false;
   }
 
@@ -114,9 +130,7 @@ bool Socket::Connect(const struct sockaddr_in& address) {
 int Socket::Read(uint8_t* buffer, int length) {
   if (fd_ == -1) return -1;
 
-  int n = ::read(fd_, buffer, length);
-  std::cerr << "Socket: Read " << std::to_string(n) << " bytes" << std::endl;
-  return n;
+  return ::read(fd_, buffer, length);
 }
 
 // Write data to the socket
@@ -127,6 +141,43 @@ int Socket::Write(const uint8_t* buffer, int length) {
   return n;
 }
 
+ssize_t Socket::WriteV(const struct iovec* iov, int iovcnt, bool zerocopy) {
+  if (fd_ == -1) return -1;
+
+  struct msghdr msg = {};
+  msg.msg_iov = const_cast<struct iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+  return ::sendmsg(fd_, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+}
+
+bool Socket::EnableZeroCopy() {
+  int one = 1;
+  return ::setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+int Socket::ReapZeroCopy() {
+  if (fd_ == -1) return 0;
+
+  int completed = 0;
+  while (true) {
+    char control[128];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      auto* err = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // sends ee_info to ee_data (inclusive) completed
+      completed += err->ee_data - err->ee_info + 1;
+    }
+  }
+  return completed;
+}
+
 bool Socket::Close() {
   if (fd_ == -1) return false;
 
@@ -157,8 +208,9 @@ bool Socket::SetNonBlocking(bool enabled) {
     std::cerr << "Failed to set socket nonBlocking to "
               << std::to_string(enabled) << " on fd " << std::to_string(fd_)
               << "error: " << std::to_string(err) << std::endl;
+    return false;
   }
-  return false;
+  return true;
 }
 
 bool Socket::IsNonBlocking(bool* is_nonblocking) const {
@@ -171,4 +223,17 @@ bool Socket::IsNonBlocking(bool* is_nonblocking) const {
   }
   *is_nonblocking = ((curflags & O_NONBLOCK) != 0);
   return true;
-}
\ No newline at end of file
+}
+
+bool ParseAddress(const std::string& hostport, struct sockaddr_in* address) {
+  size_t colon = hostport.find(":");
+  if (colon == std::string::npos) return false;
+  struct in_addr host;
+  if (inet_pton(AF_INET, hostport.substr(0, colon).c_str(), &host) != 1) {
+    return false;
+  }
+  address->sin_family = AF_INET;
+  address->sin_addr = host;
+  address->sin_port = htons(stoi(hostport.substr(colon + 1)));
+  return true;
+}
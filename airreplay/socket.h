@@ -4,8 +4,13 @@
 #include <netinet/in.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-// A blocking socket class that wrapps around the socket system calls
+#include <string>
+
+// A socket class that wrapps around the socket system calls. Sockets are
+// blocking unless SetNonBlocking is called, in which case Read, Write and
+// Accept fail with errno EAGAIN instead of waiting
 class Socket {
  public:
   Socket();
@@ -24,6 +29,15 @@ class Socket {
   bool Connect(const sockaddr_in& address);
   int Read(uint8_t* buffer, int length);
   int Write(const uint8_t* buffer, int length);
+  // writes the buffers of iov in order with one sendmsg. With zerocopy (see
+  // EnableZeroCopy) the kernel sends from the buffers directly, which must
+  // stay unchanged until ReapZeroCopy reports the send complete
+  ssize_t WriteV(const struct iovec* iov, int iovcnt, bool zerocopy = false);
+  // sets SO_ZEROCOPY. Returns false if the kernel does not support it
+  bool EnableZeroCopy();
+  // reads the completions of zerocopy sends from the error queue and returns
+  // how many sends completed
+  int ReapZeroCopy();
   bool Close();
   bool Reset(int fd);
 
@@ -36,4 +50,8 @@ class Socket {
 
   //  private:
   int fd_;
-};
\ No newline at end of file
+};
+
+// parses "host:port" into address. Returns false if host is not an IPv4
+// address
+bool ParseAddress(const std::string& hostport, struct sockaddr_in* address);
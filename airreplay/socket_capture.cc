@@ -0,0 +1,556 @@
+// libairreplay_capture.so: records the TCP connections of an unmodified
+// process as socket traces when preloaded with LD_PRELOAD.
+//
+// read, write, writev, recv, send, accept, accept4, connect and close are
+// interposed. accept and connect start tracking IPv4 stream sockets, and the
+// bytes the process reads from and writes to a tracked socket are appended
+// to a lock-free ring of the calling thread (see CaptureRing) together with
+// the connection, a per-connection sequence number and the time. A writer
+// thread drains the rings, puts the operations of each connection back in
+// sequence order and coalesces adjacent operations in the same direction
+// into one entry of up to 1MB, so replay does not need Trace::Coalesce.
+// Accepted connections are written to
+// socket_rec_accept_<local port>_from_<peer>, connected ones to
+// socket_rec_connect_from_<local>_from_<peer>.
+//
+// Environment:
+//   AIRREPLAY_CAPTURE_DIR           where traces go, default "."
+//   AIRREPLAY_CAPTURE_PORTS         comma separated ports. Only accepted
+//                                   connections on these local ports and
+//                                   connections to these remote ports are
+//                                   recorded. Default all
+//   AIRREPLAY_CAPTURE_BUFFER_BYTES  size of each thread's ring, default 4MB
+//
+// A thread whose ring is full waits for the writer, so nothing is dropped
+// while the process runs. Entries still being coalesced are written when the
+// connection closes or the process exits normally. Children forked by the
+// process do not record.
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "capture_ring.h"
+#include "trace.h"
+
+namespace {
+
+// sockets with larger descriptors are not recorded
+const int kMaxFds = 1 << 16;
+// a coalesced entry is written once it grows this large, so a connection
+// that only ever sends does not accumulate in memory
+const size_t kMaxEntryBytes = 1 << 20;
+
+enum RecordKind : uint8_t { kOpen, kRead, kWrite, kClose };
+
+struct RecordHeader {
+  uint64_t conn;
+  uint64_t seq;
+  uint64_t timestamp;
+  uint8_t kind;
+};
+
+struct FdSlot {
+  // the tracked connection on the descriptor, 0 if none
+  std::atomic<uint64_t> conn{0};
+  std::atomic<uint64_t> seq{0};
+};
+
+// a thread's ring. Rings outlive their threads and are handed to new threads
+// once the writer emptied them
+struct ThreadBuffer {
+  explicit ThreadBuffer(size_t capacity) : ring(capacity) {}
+  CaptureRing ring;
+  std::atomic<bool> owned{true};
+  ThreadBuffer* next = nullptr;
+};
+
+struct Config {
+  std::string dir = ".";
+  std::set<int> ports;
+  size_t buffer_bytes = 4 << 20;
+};
+
+FdSlot g_fds[kMaxFds];
+std::atomic<ThreadBuffer*> g_buffers{nullptr};
+std::atomic<uint64_t> g_next_conn{1};
+// false before the writer starts, after it stopped and in forked children.
+// Nothing is recorded then
+std::atomic<bool> g_recording{false};
+std::atomic<bool> g_stopping{false};
+std::once_flag g_start_once;
+Config* g_config = nullptr;
+std::thread* g_writer = nullptr;
+pthread_key_t g_buffer_key;
+
+thread_local ThreadBuffer* t_buffer = nullptr;
+// the pieces of the record being pushed, kept off the stack of the
+// interposed call as a writev may pass IOV_MAX of them
+thread_local std::vector<struct iovec> t_pieces;
+// the writer's own file writes are never recorded
+thread_local bool t_writer = false;
+
+template <typename F>
+F Real(const char* name) {
+  return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+ssize_t RealRead(int fd, void* buf, size_t count) {
+  static auto real = Real<ssize_t (*)(int, void*, size_t)>("read");
+  return real(fd, buf, count);
+}
+
+ssize_t RealWrite(int fd, const void* buf, size_t count) {
+  static auto real = Real<ssize_t (*)(int, const void*, size_t)>("write");
+  return real(fd, buf, count);
+}
+
+uint64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+std::string AddressString(const struct sockaddr_in& address) {
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+  return std::string(host) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+// Writes the recorded operations of every connection to its trace
+class Writer {
+ public:
+  explicit Writer(std::string dir) : dir_(std::move(dir)) {}
+
+  void Run() {
+    t_writer = true;
+    while (true) {
+      bool stopping = g_stopping.load(std::memory_order_acquire);
+      size_t records = 0;
+      for (ThreadBuffer* buffer = g_buffers.load(std::memory_order_acquire);
+           buffer != nullptr; buffer = buffer->next) {
+        records += buffer->ring.Drain(
+            [this](std::string_view record) { Process(record); });
+      }
+      // one flush per pass instead of one per entry, so the writer keeps up
+      // with the threads that record
+      FlushTraces();
+      // a final pass once no thread records any more
+      if (stopping) break;
+      if (records == 0) usleep(1000);
+    }
+    for (auto& [id, conn] : conns_) RecordPending(id, &conn);
+    conns_.clear();
+    unflushed_.clear();
+  }
+
+ private:
+  struct Conn {
+    std::unique_ptr<airreplay::Trace> trace;
+    uint64_t next_seq = 0;
+    // records that arrived before an earlier one of the connection
+    std::map<uint64_t, std::string> held;
+    // the entry being coalesced
+    int pending_kind = -1;
+    uint64_t pending_timestamp = 0;
+    std::string pending;
+  };
+
+  void Process(std::string_view record) {
+    RecordHeader header;
+    memcpy(&header, record.data(), sizeof(header));
+    auto it = conns_.find(header.conn);
+    if (it == conns_.end()) {
+      // a thread that loaded the connection before it was closed may still
+      // record after the close
+      if (Opened(header.conn)) return;
+      it = conns_.emplace(header.conn, Conn()).first;
+    }
+    Conn& conn = it->second;
+    if (header.seq != conn.next_seq) {
+      conn.held.emplace(header.seq, std::string(record));
+      return;
+    }
+    bool open = Apply(&conn, header, record.substr(sizeof(header)));
+    conn.next_seq++;
+    while (open && !conn.held.empty() &&
+           conn.held.begin()->first == conn.next_seq) {
+      std::string held = std::move(conn.held.begin()->second);
+      conn.held.erase(conn.held.begin());
+      memcpy(&header, held.data(), sizeof(header));
+      open = Apply(&conn, header,
+                   std::string_view(held).substr(sizeof(header)));
+      conn.next_seq++;
+    }
+    if (!open) {
+      unflushed_.erase(header.conn);
+      conns_.erase(header.conn);
+    }
+  }
+
+  // connection ids are handed out in order, so the ids whose open record
+  // was applied are all those below opened_below_ plus the few above it
+  // that opened out of order. A closed connection takes no memory
+  bool Opened(uint64_t id) const {
+    return id < opened_below_ || opened_above_.count(id) > 0;
+  }
+
+  void MarkOpened(uint64_t id) {
+    opened_above_.insert(id);
+    while (!opened_above_.empty() &&
+           *opened_above_.begin() == opened_below_) {
+      opened_above_.erase(opened_above_.begin());
+      opened_below_++;
+    }
+  }
+
+  // returns false once the connection closed
+  bool Apply(Conn* conn, const RecordHeader& header, std::string_view bytes) {
+    switch (header.kind) {
+      case kOpen: {
+        MarkOpened(header.conn);
+        std::string prefix =
+            (std::filesystem::path(dir_) / std::string(bytes)).string();
+        airreplay::TraceOptions options;
+        options.write_txt = false;
+        options.flush_each_entry = false;
+        conn->trace = std::make_unique<airreplay::Trace>(
+            prefix, airreplay::Mode::kRecord, true, options);
+        return true;
+      }
+      case kRead:
+      case kWrite:
+        if (conn->pending_kind != header.kind) {
+          RecordPending(header.conn, conn);
+          conn->pending_kind = header.kind;
+          conn->pending_timestamp = header.timestamp;
+        }
+        conn->pending.append(bytes);
+        if (conn->pending.size() >= kMaxEntryBytes) {
+          RecordPending(header.conn, conn);
+        }
+        return true;
+      default:
+        RecordPending(header.conn, conn);
+        return false;
+    }
+  }
+
+  // records the entry being coalesced. It reaches the file with the next
+  // FlushTraces, or when the connection closes
+  void RecordPending(uint64_t id, Conn* conn) {
+    if (conn->pending_kind == -1 || conn->trace == nullptr) return;
+    airreplay::OpequeEntry entry;
+    entry.set_rr_debug_string(conn->pending_kind == kRead ? "Socket Read"
+                                                          : "Socket Write");
+    entry.set_body_size(conn->pending.size());
+    entry.set_timestamp(conn->pending_timestamp);
+    *entry.mutable_bytes_message() = std::move(conn->pending);
+    conn->trace->Record(entry);
+    conn->pending.clear();
+    conn->pending_kind = -1;
+    unflushed_.insert(id);
+  }
+
+  void FlushTraces() {
+    for (uint64_t id : unflushed_) conns_[id].trace->Flush();
+    unflushed_.clear();
+  }
+
+  std::string dir_;
+  std::unordered_map<uint64_t, Conn> conns_;
+  // connections with entries recorded since the last FlushTraces
+  std::unordered_set<uint64_t> unflushed_;
+  uint64_t opened_below_ = 1;
+  std::set<uint64_t> opened_above_;
+};
+
+void ReleaseBuffer(void* buffer) {
+  static_cast<ThreadBuffer*>(buffer)->owned.store(false,
+                                                  std::memory_order_release);
+}
+
+ThreadBuffer* Buffer() {
+  if (t_buffer != nullptr) return t_buffer;
+  for (ThreadBuffer* buffer = g_buffers.load(std::memory_order_acquire);
+       buffer != nullptr; buffer = buffer->next) {
+    bool owned = false;
+    if (!buffer->owned.load(std::memory_order_acquire) &&
+        buffer->ring.Empty() &&
+        buffer->owned.compare_exchange_strong(owned, true)) {
+      t_buffer = buffer;
+      break;
+    }
+  }
+  if (t_buffer == nullptr) {
+    t_buffer = new ThreadBuffer(g_config->buffer_bytes);
+    ThreadBuffer* head = g_buffers.load(std::memory_order_relaxed);
+    do {
+      t_buffer->next = head;
+    } while (!g_buffers.compare_exchange_weak(head, t_buffer,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+  }
+  // handed back when the thread exits
+  pthread_setspecific(g_buffer_key, t_buffer);
+  return t_buffer;
+}
+
+// pushes pieces as one record, the first holding its RecordHeader
+void PushPieces(const struct iovec* pieces, int count) {
+  ThreadBuffer* buffer = Buffer();
+  while (!buffer->ring.TryPush(pieces, count)) {
+    if (!g_recording.load(std::memory_order_relaxed)) return;
+    sched_yield();
+  }
+}
+
+void Push(const RecordHeader& header, const void* data, size_t len) {
+  struct iovec pieces[2] = {
+      {const_cast<RecordHeader*>(&header), sizeof(header)},
+      {const_cast<void*>(data), len}};
+  PushPieces(pieces, len > 0 ? 2 : 1);
+}
+
+void Stop() {
+  if (g_writer == nullptr) return;
+  g_recording.store(false);
+  g_stopping.store(true, std::memory_order_release);
+  g_writer->join();
+  delete g_writer;
+  g_writer = nullptr;
+}
+
+void DisableInChild() {
+  // the writer thread was not forked
+  g_recording.store(false);
+  g_writer = nullptr;
+}
+
+void Start() {
+  std::call_once(g_start_once, [] {
+    g_config = new Config();
+    if (const char* dir = getenv("AIRREPLAY_CAPTURE_DIR")) g_config->dir = dir;
+    if (const char* ports = getenv("AIRREPLAY_CAPTURE_PORTS")) {
+      std::stringstream ss(ports);
+      std::string port;
+      while (std::getline(ss, port, ',')) {
+        g_config->ports.insert(atoi(port.c_str()));
+      }
+    }
+    if (const char* bytes = getenv("AIRREPLAY_CAPTURE_BUFFER_BYTES")) {
+      g_config->buffer_bytes = std::max(4096L, atol(bytes));
+    }
+    pthread_key_create(&g_buffer_key, ReleaseBuffer);
+    pthread_atfork(nullptr, nullptr, DisableInChild);
+    // the writer is never deleted so it outlives static destructors
+    Writer* writer = new Writer(g_config->dir);
+    g_recording.store(true);
+    g_writer = new std::thread([writer] { writer->Run(); });
+    atexit(Stop);
+  });
+}
+
+// records the bytes of a call, split into records that fit the ring
+void Capture(int fd, RecordKind kind, const struct iovec* iov, int iovcnt,
+             size_t len) {
+  if (t_writer || fd < 0 || fd >= kMaxFds || len == 0) return;
+  uint64_t conn = g_fds[fd].conn.load(std::memory_order_acquire);
+  if (conn == 0 || !g_recording.load(std::memory_order_relaxed)) return;
+
+  int saved_errno = errno;
+  size_t max_piece = Buffer()->ring.max_record() / 2;
+  uint64_t pieces = (len + max_piece - 1) / max_piece;
+  uint64_t seq = g_fds[fd].seq.fetch_add(pieces);
+  RecordHeader header = {conn, seq, NowNanos(), kind};
+  // a record takes at most one slice of each element of iov
+  if (t_pieces.size() < 1 + (size_t)iovcnt) t_pieces.resize(1 + iovcnt);
+  t_pieces[0] = {&header, sizeof(header)};
+  // walks iov, which holds at least len bytes
+  int index = 0;
+  size_t offset = 0;
+  while (len > 0) {
+    size_t piece = std::min(len, max_piece);
+    int count = 1;
+    for (size_t taken = 0; taken < piece; count++) {
+      size_t n = std::min(piece - taken, iov[index].iov_len - offset);
+      t_pieces[count] = {static_cast<uint8_t*>(iov[index].iov_base) + offset,
+                         n};
+      taken += n;
+      offset += n;
+      if (offset == iov[index].iov_len) {
+        index++;
+        offset = 0;
+      }
+    }
+    PushPieces(t_pieces.data(), count);
+    header.seq++;
+    len -= piece;
+  }
+  errno = saved_errno;
+}
+
+void CaptureBuffer(int fd, RecordKind kind, const void* buf, ssize_t len) {
+  if (len <= 0) return;
+  struct iovec iov = {const_cast<void*>(buf), static_cast<size_t>(len)};
+  Capture(fd, kind, &iov, 1, len);
+}
+
+void Untrack(int fd) {
+  uint64_t conn = g_fds[fd].conn.exchange(0);
+  if (conn == 0) return;
+  RecordHeader header = {conn, g_fds[fd].seq.fetch_add(1), NowNanos(), kClose};
+  Push(header, nullptr, 0);
+}
+
+// starts recording the connection on fd if it is an IPv4 stream socket that
+// passes AIRREPLAY_CAPTURE_PORTS. connected_to is the address passed to
+// connect, accepted connections look their peer up
+void Track(int fd, const struct sockaddr* connected_to, socklen_t addrlen) {
+  if (t_writer || fd < 0 || fd >= kMaxFds) return;
+  Start();
+  if (!g_recording.load(std::memory_order_relaxed)) return;
+  bool accepted = connected_to == nullptr;
+  struct sockaddr_in local;
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(local);
+  int type = 0;
+  socklen_t type_len = sizeof(type);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) != 0 ||
+      type != SOCK_STREAM ||
+      getsockname(fd, (struct sockaddr*)&local, &len) != 0 ||
+      local.sin_family != AF_INET) {
+    return;
+  }
+  if (accepted) {
+    len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr*)&peer, &len) != 0) return;
+  } else {
+    if (addrlen < sizeof(peer) || connected_to->sa_family != AF_INET) return;
+    memcpy(&peer, connected_to, sizeof(peer));
+  }
+  int port = ntohs(accepted ? local.sin_port : peer.sin_port);
+  if (!g_config->ports.empty() && g_config->ports.count(port) == 0) return;
+
+  std::string name;
+  if (accepted) {
+    name = "socket_rec_accept_" + std::to_string(port) + "_from_" +
+           AddressString(peer);
+  } else {
+    name = "socket_rec_connect_from_" + AddressString(local) + "_from_" +
+           AddressString(peer);
+  }
+  // a descriptor closed without close (e.g. by fclose) still has the
+  // connection it was reused from
+  Untrack(fd);
+  uint64_t conn = g_next_conn.fetch_add(1);
+  RecordHeader header = {conn, 0, NowNanos(), kOpen};
+  Push(header, name.data(), name.size());
+  g_fds[fd].seq.store(1, std::memory_order_relaxed);
+  g_fds[fd].conn.store(conn, std::memory_order_release);
+}
+
+}  // namespace
+
+extern "C" {
+
+ssize_t read(int fd, void* buf, size_t count) {
+  ssize_t n = RealRead(fd, buf, count);
+  CaptureBuffer(fd, kRead, buf, n);
+  return n;
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  ssize_t n = RealWrite(fd, buf, count);
+  CaptureBuffer(fd, kWrite, buf, n);
+  return n;
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+  static auto real =
+      Real<ssize_t (*)(int, const struct iovec*, int)>("writev");
+  ssize_t n = real(fd, iov, iovcnt);
+  if (n > 0) Capture(fd, kWrite, iov, iovcnt, n);
+  return n;
+}
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+  static auto real = Real<ssize_t (*)(int, void*, size_t, int)>("recv");
+  ssize_t n = real(fd, buf, len, flags);
+  // peeked bytes are read again
+  if (!(flags & MSG_PEEK)) CaptureBuffer(fd, kRead, buf, n);
+  return n;
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+  static auto real = Real<ssize_t (*)(int, const void*, size_t, int)>("send");
+  ssize_t n = real(fd, buf, len, flags);
+  CaptureBuffer(fd, kWrite, buf, n);
+  return n;
+}
+
+int accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+  static auto real =
+      Real<int (*)(int, struct sockaddr*, socklen_t*)>("accept");
+  int conn = real(fd, addr, addrlen);
+  if (conn >= 0) {
+    int saved_errno = errno;
+    Track(conn, nullptr, 0);
+    errno = saved_errno;
+  }
+  return conn;
+}
+
+int accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+  static auto real =
+      Real<int (*)(int, struct sockaddr*, socklen_t*, int)>("accept4");
+  int conn = real(fd, addr, addrlen, flags);
+  if (conn >= 0) {
+    int saved_errno = errno;
+    Track(conn, nullptr, 0);
+    errno = saved_errno;
+  }
+  return conn;
+}
+
+int connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+  static auto real =
+      Real<int (*)(int, const struct sockaddr*, socklen_t)>("connect");
+  int ret = real(fd, addr, addrlen);
+  // non-blocking connects are recorded from the start too
+  if (ret == 0 || errno == EINPROGRESS) {
+    int saved_errno = errno;
+    Track(fd, addr, addrlen);
+    errno = saved_errno;
+  }
+  return ret;
+}
+
+int close(int fd) {
+  static auto real = Real<int (*)(int)>("close");
+  if (fd >= 0 && fd < kMaxFds && !t_writer) Untrack(fd);
+  return real(fd);
+}
+
+}  // extern "C"
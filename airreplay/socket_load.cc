@@ -0,0 +1,548 @@
+#include "socket_load.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+
+#include "socket.h"
+#include "trace.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+const int kMaxEvents = 64;
+const size_t kReadBufferBytes = 1 << 16;
+
+bool IsRead(const airreplay::OpequeEntry& entry) {
+  return entry.rr_debug_string().find("Socket Read") != std::string::npos;
+}
+
+bool IsWrite(const airreplay::OpequeEntry& entry) {
+  const std::string& debug_string = entry.rr_debug_string();
+  return debug_string.find("Socket Write") != std::string::npos ||
+         debug_string.find("Socket writev of") != std::string::npos;
+}
+
+uint64_t Micros(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+// One copy of a conversation replayed against the server
+struct Session {
+  enum State { kWaiting, kConnecting, kThinking, kSending, kReceiving, kDone };
+
+  const Conversation* conversation;
+  ConversationStats* stats;
+  Socket socket;
+  State state = kWaiting;
+  uint32_t events = 0;
+  size_t step = 0;
+  // bytes of the request of step sent so far
+  size_t sent = 0;
+  // bytes that arrived since the previous response completed, and the first
+  // compare_bytes of them
+  size_t received = 0;
+  std::string head;
+  Clock::time_point request_start;
+  Clock::time_point last_byte;
+
+  // the timer fires at deadline. A queued timer that is due earlier re-arms
+  // itself when it fires, so moving the deadline later costs no queue entry
+  Clock::time_point deadline;
+  bool timer_armed = false;
+  Clock::time_point timer_at;
+  uint64_t timer_gen = 0;
+};
+
+// Replays its sessions on one epoll loop
+class LoadWorker {
+ public:
+  LoadWorker(const LoadOptions& options, const sockaddr_in& server,
+             size_t conversations)
+      : options_(options),
+        server_(server),
+        stats_(conversations),
+        buffer_(kReadBufferBytes) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+      throw std::runtime_error("epoll_create1 failed: " +
+                               std::string(strerror(errno)));
+    }
+  }
+  LoadWorker(const LoadWorker&) = delete;
+  LoadWorker& operator=(const LoadWorker&) = delete;
+  ~LoadWorker() { close(epoll_fd_); }
+
+  void Add(const Conversation* conversation, size_t index) {
+    auto session = std::make_unique<Session>();
+    session->conversation = conversation;
+    session->stats = &stats_[index];
+    sessions_.push_back(std::move(session));
+  }
+
+  void Run(Clock::time_point start) {
+    for (auto& session : sessions_) {
+      Clock::time_point at = start;
+      if (options_.pacing == LoadOptions::kRecorded) {
+        at += Scaled(session->conversation->start);
+      }
+      Arm(session.get(), at);
+    }
+    size_t remaining = sessions_.size();
+    struct epoll_event events[kMaxEvents];
+    while (remaining > 0) {
+      int n = epoll_wait(epoll_fd_, events, kMaxEvents, WaitMillis());
+      if (n == -1 && errno != EINTR) {
+        LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        Session* session = static_cast<Session*>(events[i].data.ptr);
+        if (session->state == Session::kDone) continue;
+        if (session->state == Session::kConnecting) {
+          Connected(session);
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+          Readable(session);
+        }
+        if (session->state == Session::kSending &&
+            (events[i].events & EPOLLOUT)) {
+          Send(session);
+        }
+      }
+      FireTimers();
+      remaining -= done_;
+      done_ = 0;
+    }
+  }
+
+  std::vector<ConversationStats>& stats() { return stats_; }
+
+ private:
+  struct Timer {
+    Clock::time_point at;
+    Session* session;
+    uint64_t gen;
+    bool operator>(const Timer& other) const { return at > other.at; }
+  };
+
+  Clock::duration Scaled(std::chrono::nanoseconds recorded) const {
+    return std::chrono::duration_cast<Clock::duration>(recorded /
+                                                       options_.speed);
+  }
+
+  void Arm(Session* session, Clock::time_point at) {
+    session->deadline = at;
+    if (session->timer_armed && session->timer_at <= at) return;
+    session->timer_armed = true;
+    session->timer_at = at;
+    timers_.push({at, session, ++session->timer_gen});
+  }
+
+  void Disarm(Session* session) {
+    session->timer_armed = false;
+    session->timer_gen++;
+  }
+
+  int WaitMillis() const {
+    if (timers_.empty()) return -1;
+    auto wait = timers_.top().at - Clock::now();
+    if (wait <= Clock::duration::zero()) return 0;
+    return std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+  }
+
+  void FireTimers() {
+    Clock::time_point now = Clock::now();
+    while (!timers_.empty() && timers_.top().at <= now) {
+      Timer timer = timers_.top();
+      timers_.pop();
+      Session* session = timer.session;
+      if (timer.gen != session->timer_gen) continue;
+      session->timer_armed = false;
+      if (session->deadline > now) {
+        Arm(session, session->deadline);
+      } else {
+        Expired(session);
+      }
+    }
+  }
+
+  void Expired(Session* session) {
+    switch (session->state) {
+      case Session::kWaiting:
+        Connect(session);
+        break;
+      case Session::kConnecting:
+        Finish(session, /*error=*/true);
+        break;
+      case Session::kThinking:
+        StartRequest(session);
+        break;
+      case Session::kReceiving:
+        if (session->received > 0) {
+          // a shorter response than recorded, followed by silence
+          CompleteResponse(session);
+        } else {
+          session->stats->timeouts++;
+          session->step++;
+          NextStep(session);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  void Watch(Session* session, uint32_t events) {
+    if (session->events == events) return;
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.ptr = session;
+    int op = session->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd_, op, session->socket.fd_, &event) == -1) {
+      LOG(ERROR) << "epoll_ctl failed: " << strerror(errno);
+    }
+    session->events = events;
+  }
+
+  void Connect(Session* session) {
+    if (!session->socket.Create() || !session->socket.SetNonBlocking(true)) {
+      Finish(session, /*error=*/true);
+      return;
+    }
+    if (session->stats->first_start == Clock::time_point()) {
+      session->stats->first_start = Clock::now();
+    }
+    if (::connect(session->socket.fd_, (const sockaddr*)&server_,
+                  sizeof(server_)) == -1 &&
+        errno != EINPROGRESS) {
+      Finish(session, /*error=*/true);
+      return;
+    }
+    session->state = Session::kConnecting;
+    Watch(session, EPOLLOUT);
+    Arm(session, Clock::now() + options_.response_timeout);
+  }
+
+  void Connected(Session* session) {
+    int error = 0;
+    if (!session->socket.GetSockOpt(SOL_SOCKET, SO_ERROR, &error) ||
+        error != 0) {
+      Finish(session, /*error=*/true);
+      return;
+    }
+    Disarm(session);
+    session->socket.SetTCPNoDelay(true);
+    Watch(session, EPOLLIN);
+    NextStep(session);
+  }
+
+  void NextStep(Session* session) {
+    const auto& steps = session->conversation->steps;
+    if (session->step == steps.size()) {
+      Finish(session, /*error=*/false);
+      return;
+    }
+    Clock::duration think = Clock::duration::zero();
+    if (options_.pacing == LoadOptions::kRecorded) {
+      think = Scaled(steps[session->step].think);
+    }
+    if (think > Clock::duration::zero()) {
+      session->state = Session::kThinking;
+      Arm(session, Clock::now() + think);
+      return;
+    }
+    StartRequest(session);
+  }
+
+  void StartRequest(Session* session) {
+    Disarm(session);
+    session->state = Session::kSending;
+    session->sent = 0;
+    session->request_start = Clock::now();
+    Send(session);
+  }
+
+  void Send(Session* session) {
+    const std::string& request =
+        session->conversation->steps[session->step].request;
+    while (session->sent < request.size()) {
+      ssize_t n = send(session->socket.fd_, request.data() + session->sent,
+                       request.size() - session->sent, MSG_NOSIGNAL);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          Watch(session, EPOLLIN | EPOLLOUT);
+          return;
+        }
+        Finish(session, /*error=*/true);
+        return;
+      }
+      session->sent += n;
+      session->stats->bytes_sent += n;
+    }
+    Watch(session, EPOLLIN);
+    session->state = Session::kReceiving;
+    AwaitResponse(session);
+  }
+
+  // completes the response if enough of it arrived, or waits for the rest
+  void AwaitResponse(Session* session) {
+    const std::string& response =
+        session->conversation->steps[session->step].response;
+    if (session->received >= response.size()) {
+      CompleteResponse(session);
+    } else if (session->received > 0) {
+      Arm(session, session->last_byte + options_.response_idle);
+    } else {
+      Arm(session, Clock::now() + options_.response_timeout);
+    }
+  }
+
+  void CompleteResponse(Session* session) {
+    const std::string& response =
+        session->conversation->steps[session->step].response;
+    ConversationStats* stats = session->stats;
+    if (!response.empty()) {
+      Clock::time_point end = session->received > 0 ? session->last_byte
+                                                    : session->request_start;
+      stats->latency.Record(Micros(end - session->request_start));
+      stats->responses++;
+      size_t n = std::min(session->head.size(), response.size());
+      if (session->head.compare(0, n, response, 0, n) != 0) {
+        stats->mismatches++;
+      }
+    }
+    session->received = 0;
+    session->head.clear();
+    session->step++;
+    NextStep(session);
+  }
+
+  void Readable(Session* session) {
+    while (session->state != Session::kDone) {
+      ssize_t n = read(session->socket.fd_, buffer_.data(), buffer_.size());
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        Finish(session, /*error=*/true);
+        return;
+      }
+      if (n == 0) {
+        Closed(session);
+        return;
+      }
+      session->stats->bytes_received += n;
+      session->last_byte = Clock::now();
+      Received(session, buffer_.data(), n);
+    }
+  }
+
+  // counts data toward the response being waited for. Bytes beyond it are
+  // the start of the next one
+  void Received(Session* session, const uint8_t* data, size_t len) {
+    const auto& steps = session->conversation->steps;
+    while (len > 0 && session->state != Session::kDone) {
+      size_t take = len;
+      if (session->state == Session::kReceiving) {
+        take = std::min(len, steps[session->step].response.size() -
+                                 session->received);
+      }
+      if (session->head.size() < options_.compare_bytes) {
+        size_t keep =
+            std::min(take, options_.compare_bytes - session->head.size());
+        session->head.append(reinterpret_cast<const char*>(data), keep);
+      }
+      session->received += take;
+      data += take;
+      len -= take;
+      if (session->state == Session::kReceiving) AwaitResponse(session);
+    }
+  }
+
+  void Closed(Session* session) {
+    if (session->state == Session::kReceiving && session->received > 0) {
+      CompleteResponse(session);
+    }
+    if (session->state == Session::kDone) return;
+    // the server closed before the conversation ended
+    Finish(session,
+           /*error=*/session->step < session->conversation->steps.size());
+  }
+
+  void Finish(Session* session, bool error) {
+    Disarm(session);
+    session->socket.Close();
+    session->state = Session::kDone;
+    ConversationStats* stats = session->stats;
+    if (error) {
+      stats->errors++;
+    } else {
+      stats->copies_done++;
+    }
+    stats->last_end = Clock::now();
+    if (stats->first_start == Clock::time_point()) {
+      stats->first_start = stats->last_end;
+    }
+    done_++;
+  }
+
+  const LoadOptions& options_;
+  const sockaddr_in server_;
+  int epoll_fd_ = -1;
+  std::vector<std::unique_ptr<Session>> sessions_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  std::vector<ConversationStats> stats_;
+  std::vector<uint8_t> buffer_;
+  // sessions finished since the loop last counted them
+  size_t done_ = 0;
+};
+}  // namespace
+
+Conversation ClientConversation(
+    const std::string& name, const std::deque<airreplay::OpequeEntry>& entries,
+    bool recorded_by_client) {
+  Conversation conversation;
+  conversation.name = name;
+  bool first = true;
+  uint64_t previous = 0;
+  // the last entry was a request, later request entries continue it
+  bool requesting = false;
+  for (const airreplay::OpequeEntry& entry : entries) {
+    bool read = IsRead(entry);
+    if (!read && !IsWrite(entry)) continue;
+    uint64_t timestamp = entry.timestamp();
+    if (first) {
+      conversation.start = std::chrono::nanoseconds(timestamp);
+      previous = timestamp;
+      first = false;
+    }
+    const std::string& bytes = entry.bytes_message();
+    if (read != recorded_by_client) {
+      if (!requesting) {
+        Conversation::Step step;
+        if (timestamp > previous) {
+          step.think = std::chrono::nanoseconds(timestamp - previous);
+        }
+        conversation.steps.push_back(std::move(step));
+        requesting = true;
+      }
+      conversation.steps.back().request.append(bytes);
+      conversation.request_bytes += bytes.size();
+    } else {
+      if (conversation.steps.empty()) conversation.steps.emplace_back();
+      conversation.steps.back().response.append(bytes);
+      conversation.response_bytes += bytes.size();
+      requesting = false;
+    }
+    previous = std::max(previous, timestamp);
+  }
+  return conversation;
+}
+
+std::vector<Conversation> LoadConversations(const std::string& dir,
+                                            const std::string& filter) {
+  std::vector<std::string> prefixes;
+  for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+    std::string filename = entry.path().filename();
+    if (filename.rfind("socket_rec_", 0) != 0) continue;
+    size_t suffix_loc = filename.rfind(".bin");
+    if (suffix_loc == std::string::npos ||
+        suffix_loc + 4 != filename.size()) {
+      continue;
+    }
+    if (filename.find(filter) == std::string::npos) continue;
+    prefixes.push_back(filename.substr(0, suffix_loc));
+  }
+  std::sort(prefixes.begin(), prefixes.end());
+
+  std::vector<Conversation> conversations;
+  for (const std::string& prefix : prefixes) {
+    std::string traceprefix = (std::filesystem::path(dir) / prefix).string();
+    // a replay Trace per file would start and join a debug thread
+    std::deque<airreplay::OpequeEntry> entries =
+        airreplay::ReadTraceEntries(traceprefix);
+    bool recorded_by_client = prefix.find("connect_from") != std::string::npos;
+    conversations.push_back(
+        ClientConversation(prefix, entries, recorded_by_client));
+  }
+
+  // ClientConversation leaves the timestamp of the first entry in start
+  std::chrono::nanoseconds earliest = std::chrono::nanoseconds::max();
+  for (const Conversation& conversation : conversations) {
+    earliest = std::min(earliest, conversation.start);
+  }
+  for (Conversation& conversation : conversations) {
+    conversation.start -= earliest;
+  }
+  return conversations;
+}
+
+double ConversationStats::seconds() const {
+  return std::chrono::duration<double>(last_end - first_start).count();
+}
+
+void ConversationStats::Merge(const ConversationStats& other) {
+  if (other.first_start == std::chrono::steady_clock::time_point()) return;
+  if (first_start == std::chrono::steady_clock::time_point() ||
+      other.first_start < first_start) {
+    first_start = other.first_start;
+  }
+  last_end = std::max(last_end, other.last_end);
+  copies_done += other.copies_done;
+  responses += other.responses;
+  timeouts += other.timeouts;
+  mismatches += other.mismatches;
+  errors += other.errors;
+  bytes_sent += other.bytes_sent;
+  bytes_received += other.bytes_received;
+  latency.Merge(other.latency);
+}
+
+std::vector<ConversationStats> RunLoad(
+    const std::vector<Conversation>& conversations,
+    const LoadOptions& options) {
+  struct sockaddr_in server;
+  if (!ParseAddress(options.server, &server)) {
+    throw std::runtime_error("invalid server address " + options.server);
+  }
+  std::vector<std::unique_ptr<LoadWorker>> workers;
+  for (int i = 0; i < std::max(1, options.threads); i++) {
+    workers.push_back(
+        std::make_unique<LoadWorker>(options, server, conversations.size()));
+  }
+  // copies of a conversation go to different threads
+  size_t next = 0;
+  for (size_t i = 0; i < conversations.size(); i++) {
+    for (int copy = 0; copy < options.copies; copy++) {
+      workers[next++ % workers.size()]->Add(&conversations[i], i);
+    }
+  }
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> threads;
+  for (auto& worker : workers) {
+    threads.emplace_back([&worker, start] { worker->Run(start); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<ConversationStats> stats(conversations.size());
+  for (auto& worker : workers) {
+    for (size_t i = 0; i < stats.size(); i++) {
+      stats[i].Merge(worker->stats()[i]);
+    }
+  }
+  return stats;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "airreplay.pb.h"
+#include "histogram.h"
+
+// The client side of one recorded connection: what the client sent, each
+// time followed by what the server answered
+struct Conversation {
+  struct Step {
+    // empty when the server spoke first
+    std::string request;
+    std::string response;
+    // recorded time between the previous response (or the connection
+    // start) and the request
+    std::chrono::nanoseconds think{0};
+  };
+
+  std::string name;
+  // when the connection started, relative to the earliest loaded one
+  std::chrono::nanoseconds start{0};
+  std::vector<Step> steps;
+  size_t request_bytes = 0;
+  size_t response_bytes = 0;
+};
+
+// the conversation of a coalesced socket trace. Traces recorded by the
+// server (accepted connections) send their reads and expect their writes,
+// traces recorded by the client (socket_rec_connect_from_*) the reverse.
+// Timestamps are the OpequeEntry timestamps in nanoseconds, traces without
+// them have no think time
+Conversation ClientConversation(
+    const std::string& name, const std::deque<airreplay::OpequeEntry>& entries,
+    bool recorded_by_client);
+
+// the conversations of the socket_rec_*.bin traces in dir whose file name
+// contains filter, sorted by name, with their start offsets filled in
+std::vector<Conversation> LoadConversations(const std::string& dir,
+                                            const std::string& filter);
+
+struct LoadOptions {
+  enum Pacing {
+    // connections start and requests follow responses after the recorded
+    // delays, divided by speed
+    kRecorded,
+    // every connection starts at once and sends each request as soon as the
+    // previous response arrived
+    kFlood
+  };
+
+  // host:port of the server under test
+  std::string server;
+  // concurrent replays of every conversation
+  int copies = 1;
+  Pacing pacing = kRecorded;
+  double speed = 1;
+  int threads = 1;
+  // relaxed matching: a response is complete once as many bytes as recorded
+  // arrived, or once a shorter one was followed by response_idle of silence
+  std::chrono::milliseconds response_idle{100};
+  // a response nothing arrived for within response_timeout counts as timed
+  // out and the copy moves on to its next request
+  std::chrono::milliseconds response_timeout{10000};
+  // the leading bytes of each response compared with the recorded ones. A
+  // difference is counted, not fatal
+  size_t compare_bytes = 0;
+};
+
+// what the copies of one conversation did together
+struct ConversationStats {
+  uint64_t copies_done = 0;
+  uint64_t responses = 0;
+  uint64_t timeouts = 0;
+  uint64_t mismatches = 0;
+  // failed connects and connections the server closed or reset early
+  uint64_t errors = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  // from the first copy connecting to the last one finishing
+  std::chrono::steady_clock::time_point first_start;
+  std::chrono::steady_clock::time_point last_end;
+  // from the request to the last byte of its response, in microseconds
+  Histogram latency;
+
+  double seconds() const;
+  void Merge(const ConversationStats& other);
+};
+
+// Drives a live server with recorded conversations: every conversation is
+// replayed by options.copies concurrent connections, spread over
+// options.threads threads that each run an epoll loop over their share.
+// Returns the stats of every conversation, in the order given
+std::vector<ConversationStats> RunLoad(
+    const std::vector<Conversation>& conversations, const LoadOptions& options);
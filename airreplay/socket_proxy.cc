@@ -0,0 +1,315 @@
+#include "socket_proxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <stdexcept>
+
+namespace {
+const int kMaxEvents = 64;
+
+std::string AddressString(const struct sockaddr_in& address) {
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+  return std::string(host) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void ClosePipe(int fds[2]) {
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] != -1) close(fds[i]);
+    fds[i] = -1;
+  }
+}
+}  // namespace
+
+RecordingProxy::RecordingProxy(RecordingProxyOptions options)
+    : options_(std::move(options)) {
+  struct sockaddr_in listen_address;
+  if (!ParseAddress(options_.listen, &listen_address)) {
+    throw std::runtime_error("invalid listen address " + options_.listen);
+  }
+  if (!ParseAddress(options_.server, &server_address_)) {
+    throw std::runtime_error("invalid server address " + options_.server);
+  }
+  if (!listener_.Create()) {
+    throw std::runtime_error("failed to create the listening socket");
+  }
+  listener_.SetSockOpt(SOL_SOCKET, SO_REUSEADDR, 1);
+  if (!listener_.Bind(listen_address) || !listener_.Listen(1024) ||
+      !listener_.SetNonBlocking(true)) {
+    listener_.Close();
+    throw std::runtime_error("failed to listen on " + options_.listen);
+  }
+  socklen_t len = sizeof(listen_address);
+  getsockname(listener_.fd_, (struct sockaddr*)&listen_address, &len);
+  port_ = ntohs(listen_address.sin_port);
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ == -1 || wake_fd_ == -1) {
+    listener_.Close();
+    throw std::runtime_error("failed to set up epoll: " +
+                             std::string(strerror(errno)));
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = &wake_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+  event.data.ptr = &listener_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listener_.fd_, &event);
+
+  tap_buffer_.resize(options_.pipe_bytes);
+  thread_ = std::thread(&RecordingProxy::Loop, this);
+}
+
+RecordingProxy::~RecordingProxy() {
+  Stop();
+  listener_.Close();
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void RecordingProxy::Stop() {
+  if (!thread_.joinable()) return;
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    LOG(ERROR) << "failed to wake the proxy: " << strerror(errno);
+  }
+  thread_.join();
+}
+
+void RecordingProxy::Loop() {
+  struct epoll_event events[kMaxEvents];
+  while (true) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+      break;
+    }
+    bool stopping = false;
+    for (int i = 0; i < n; i++) {
+      void* ptr = events[i].data.ptr;
+      if (ptr == &wake_fd_) {
+        stopping = true;
+      } else if (ptr == &listener_) {
+        Accept();
+      } else {
+        Endpoint* endpoint = static_cast<Endpoint*>(ptr);
+        // closed by an earlier event of this batch
+        if (connections_.count(endpoint->conn) == 0) continue;
+        Event(endpoint, events[i].events);
+      }
+    }
+    if (stopping) break;
+  }
+  while (!connections_.empty()) {
+    Close(connections_.begin()->first);
+  }
+}
+
+std::string RecordingProxy::TraceName(const std::string& client) const {
+  std::string name;
+  if (options_.perspective == RecordingProxyOptions::kClient) {
+    name = "socket_rec_connect_from_" + client + "_from_" + options_.server;
+  } else {
+    name = "socket_rec_accept_" +
+           std::to_string(ntohs(server_address_.sin_port)) + "_from_" + client;
+  }
+  return (std::filesystem::path(options_.out_dir) / name).string();
+}
+
+bool RecordingProxy::OpenPipes(Flow* flow) {
+  if (pipe2(flow->pipe, O_NONBLOCK | O_CLOEXEC) == -1 ||
+      pipe2(flow->tap, O_NONBLOCK | O_CLOEXEC) == -1) {
+    return false;
+  }
+  // fails beyond /proc/sys/fs/pipe-max-size, the default size is used then
+  fcntl(flow->pipe[1], F_SETPIPE_SZ, (int)options_.pipe_bytes);
+  fcntl(flow->tap[1], F_SETPIPE_SZ, (int)options_.pipe_bytes);
+  int pipe_size = fcntl(flow->pipe[1], F_GETPIPE_SZ);
+  int tap_size = fcntl(flow->tap[1], F_GETPIPE_SZ);
+  if (pipe_size <= 0 || tap_size <= 0) return false;
+  flow->chunk = std::min(pipe_size, tap_size);
+  return true;
+}
+
+void RecordingProxy::Accept() {
+  while (true) {
+    auto conn = std::make_unique<Connection>();
+    struct sockaddr_in remote;
+    if (!listener_.Accept(conn->client, (struct sockaddr*)&remote)) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(ERROR) << "accept failed: " << strerror(errno);
+      }
+      return;
+    }
+    std::string client = AddressString(remote);
+    if (!conn->client.SetNonBlocking(true) || !conn->server.Create() ||
+        !conn->server.SetNonBlocking(true) || !OpenPipes(&conn->up) ||
+        !OpenPipes(&conn->down)) {
+      LOG(ERROR) << "failed to set up the connection of " << client;
+      Connection* raw = conn.get();
+      connections_.emplace(raw, std::move(conn));
+      Close(raw);
+      continue;
+    }
+    if (::connect(conn->server.fd_, (const struct sockaddr*)&server_address_,
+                  sizeof(server_address_)) == -1 &&
+        errno != EINPROGRESS) {
+      LOG(ERROR) << "failed to connect " << client << " to "
+                 << options_.server << ": " << strerror(errno);
+      Connection* raw = conn.get();
+      connections_.emplace(raw, std::move(conn));
+      Close(raw);
+      continue;
+    }
+
+    bool client_side = options_.perspective == RecordingProxyOptions::kClient;
+    conn->up.from = conn->client.fd_;
+    conn->up.to = conn->server.fd_;
+    conn->up.debug_string = client_side ? "Socket Write" : "Socket Read";
+    conn->down.from = conn->server.fd_;
+    conn->down.to = conn->client.fd_;
+    conn->down.debug_string = client_side ? "Socket Read" : "Socket Write";
+    std::string trace_prefix = TraceName(client);
+    airreplay::TraceOptions trace_options;
+    trace_options.write_txt = false;
+    conn->trace = std::make_unique<airreplay::Trace>(
+        trace_prefix, airreplay::Mode::kRecord, true, trace_options);
+
+    Connection* raw = conn.get();
+    conn->client_endpoint = {raw, false};
+    conn->server_endpoint = {raw, true};
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &conn->client_endpoint;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn->client.fd_, &event);
+    event.data.ptr = &conn->server_endpoint;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn->server.fd_, &event);
+    connections_.emplace(raw, std::move(conn));
+  }
+}
+
+void RecordingProxy::Event(Endpoint* endpoint, uint32_t events) {
+  Connection* conn = endpoint->conn;
+  if (!conn->connected) {
+    // the client is not read before the server accepted the connection
+    if (!endpoint->server) return;
+    int error = 0;
+    if (!conn->server.GetSockOpt(SOL_SOCKET, SO_ERROR, &error) || error != 0) {
+      LOG(ERROR) << "failed to connect to " << options_.server << ": "
+                 << strerror(error);
+      Close(conn);
+      return;
+    }
+    if (!(events & EPOLLOUT)) return;
+    conn->connected = true;
+    conn->server.SetTCPNoDelay(true);
+  }
+  if (!Pump(conn, &conn->up) || !Pump(conn, &conn->down)) {
+    Close(conn);
+    return;
+  }
+  if (conn->up.shut && conn->down.shut) Close(conn);
+}
+
+bool RecordingProxy::Pump(Connection* conn, Flow* flow) {
+  while (true) {
+    if (flow->in_pipe > 0) {
+      ssize_t n = splice(flow->pipe[0], nullptr, flow->to, nullptr,
+                         flow->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        // resumed once the destination is writable
+        return errno == EAGAIN;
+      }
+      flow->in_pipe -= n;
+      continue;
+    }
+    if (flow->eof) {
+      if (!flow->shut) {
+        shutdown(flow->to, SHUT_WR);
+        flow->shut = true;
+      }
+      return true;
+    }
+
+    // the pipe is empty, so tee duplicates exactly the chunk spliced in
+    ssize_t n = splice(flow->from, nullptr, flow->pipe[1], nullptr,
+                       flow->chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN;
+    }
+    if (n == 0) {
+      flow->eof = true;
+      continue;
+    }
+    uint64_t timestamp = NowNanos();
+    ssize_t teed = tee(flow->pipe[0], flow->tap[1], n, SPLICE_F_NONBLOCK);
+    if (teed != n) {
+      LOG(ERROR) << "tee duplicated " << teed << " of " << n << " bytes";
+      return false;
+    }
+    flow->in_pipe = n;
+    // forward before recording
+    ssize_t sent = splice(flow->pipe[0], nullptr, flow->to, nullptr, n,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (sent > 0) {
+      flow->in_pipe -= sent;
+    } else if (sent == -1 && errno != EAGAIN && errno != EINTR) {
+      return false;
+    }
+    if (!Record(conn, flow, n, timestamp)) return false;
+  }
+}
+
+bool RecordingProxy::Record(Connection* conn, Flow* flow, size_t len,
+                            uint64_t timestamp) {
+  std::string bytes;
+  bytes.reserve(len);
+  while (bytes.size() < len) {
+    ssize_t n = read(flow->tap[0], tap_buffer_.data(),
+                     std::min(tap_buffer_.size(), len - bytes.size()));
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      LOG(ERROR) << "failed to read the teed bytes: " << strerror(errno);
+      return false;
+    }
+    bytes.append(tap_buffer_.data(), n);
+  }
+  airreplay::OpequeEntry entry;
+  entry.set_rr_debug_string(flow->debug_string);
+  entry.set_body_size(bytes.size());
+  entry.set_timestamp(timestamp);
+  *entry.mutable_bytes_message() = std::move(bytes);
+  conn->trace->Record(entry);
+  return true;
+}
+
+void RecordingProxy::Close(Connection* conn) {
+  auto it = connections_.find(conn);
+  if (it == connections_.end()) return;
+  // closing the sockets removes them from epoll
+  conn->client.Close();
+  conn->server.Close();
+  for (Flow* flow : {&conn->up, &conn->down}) {
+    ClosePipe(flow->pipe);
+    ClosePipe(flow->tap);
+  }
+  connections_.erase(it);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "socket.h"
+#include "trace.h"
+
+struct RecordingProxyOptions {
+  enum Perspective {
+    // socket_rec_connect_from_<client>_from_<server> traces, as the client
+    // recorded them: what it sent is a Socket Write
+    kClient,
+    // socket_rec_accept_<server port>_from_<client> traces, as the server
+    // recorded them: what it received is a Socket Read
+    kServer
+  };
+
+  // host:port to accept clients on, port 0 picks a free one
+  std::string listen;
+  // host:port every accepted connection is forwarded to
+  std::string server;
+  // where the traces are written
+  std::string out_dir = ".";
+  Perspective perspective = kClient;
+  // capacity requested for the forwarding pipes. Bounds how much of one
+  // direction is in flight inside the proxy
+  size_t pipe_bytes = 1 << 20;
+};
+
+// A TCP proxy that records the connections it forwards as socket traces.
+// Every connection accepted on options.listen is connected to
+// options.server and both directions are recorded into one trace, one entry
+// per chunk, stamped with the time (nanoseconds since the epoch) the proxy
+// received it.
+//
+// Bytes are forwarded without passing through user space: splice moves them
+// from the source socket into a pipe and from the pipe into the destination
+// socket, and tee duplicates the pipe into a second one that is read for the
+// trace. A chunk is recorded after it was forwarded. All connections are
+// driven by one edge-triggered epoll thread; Stop (or the destructor) wakes
+// and joins it and closes the remaining connections and their traces.
+class RecordingProxy {
+ public:
+  // throws std::runtime_error if it cannot listen on options.listen
+  explicit RecordingProxy(RecordingProxyOptions options);
+  RecordingProxy(const RecordingProxy&) = delete;
+  RecordingProxy& operator=(const RecordingProxy&) = delete;
+  ~RecordingProxy();
+
+  // the port clients connect to
+  int port() const { return port_; }
+  void Stop();
+
+ private:
+  // one direction of a connection
+  struct Flow {
+    int from = -1;
+    int to = -1;
+    int pipe[2] = {-1, -1};
+    int tap[2] = {-1, -1};
+    // bytes moved by one splice, no more than either pipe holds, so tee
+    // always duplicates a whole chunk
+    size_t chunk = 0;
+    // bytes in pipe not yet spliced to the destination
+    size_t in_pipe = 0;
+    // the source reached end of file
+    bool eof = false;
+    bool shut = false;
+    const char* debug_string;
+  };
+
+  struct Connection;
+  // what an epoll event refers to
+  struct Endpoint {
+    Connection* conn;
+    bool server;
+  };
+
+  struct Connection {
+    Socket client;
+    Socket server;
+    Endpoint client_endpoint;
+    Endpoint server_endpoint;
+    bool connected = false;
+    // client to server and back
+    Flow up;
+    Flow down;
+    std::unique_ptr<airreplay::Trace> trace;
+  };
+
+  void Loop();
+  void Accept();
+  void Event(Endpoint* endpoint, uint32_t events);
+  // forwards and records as far as both sockets allow. Returns false on
+  // errors
+  bool Pump(Connection* conn, Flow* flow);
+  bool Record(Connection* conn, Flow* flow, size_t len, uint64_t timestamp);
+  bool OpenPipes(Flow* flow);
+  void Close(Connection* conn);
+  std::string TraceName(const std::string& client) const;
+
+  RecordingProxyOptions options_;
+  struct sockaddr_in server_address_;
+  Socket listener_;
+  int port_ = 0;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::vector<char> tap_buffer_;
+  std::map<Connection*, std::unique_ptr<Connection>> connections_;
+  std::thread thread_;
+};
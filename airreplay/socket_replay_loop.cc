@@ -0,0 +1,410 @@
+#include "socket_replay_loop.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#ifndef AIRREPLAY_NO_IO_URING
+#include "socket_uring_loop.h"
+#endif
+
+namespace {
+const int kMaxEvents = 64;
+// recorded writes passed to one sendmsg
+const int kMaxIovecs = 64;
+}  // namespace
+
+ReplayConnection::ReplayConnection(airreplay::TraceGroup traces,
+                                   std::string log_prefix,
+                                   const airreplay::OpequeEntry* replay_until)
+    : traces_(std::move(traces)), log_prefix_(std::move(log_prefix)) {
+  if (replay_until != nullptr) {
+    has_replay_until_ = true;
+    replay_until_ = *replay_until;
+  }
+}
+
+ReplayConnection::Next ReplayConnection::Step(const ReplayLogger& log) {
+  if (!pending_writes_.empty()) return kWrite;
+
+  if (has_replay_until_ && !traces_.StillBefore(replay_until_)) {
+    if (!paused_) log(log_prefix_, "Reached replay_until");
+    paused_ = true;
+    return kPaused;
+  }
+
+  if (traces_.AllEmpty()) {
+    log(log_prefix_, "All traces are empty, socket replay done");
+    return kDone;
+  }
+
+  if (traces_.NextIsReadOrEmpty()) return kRead;
+
+  if (traces_.NextIsWrite()) {
+    size_t bytes = 0;
+    int writes = 0;
+    try {
+      // consecutive writes go out together unless replay_until falls
+      // between them
+      do {
+        std::string_view write = traces_.NextCommonWriteView();
+        if (!write.empty()) pending_writes_.push_back(write);
+        bytes += write.size();
+        writes++;
+      } while (!traces_.AllEmpty() && traces_.NextIsWrite() &&
+               (!has_replay_until_ || traces_.StillBefore(replay_until_)));
+    } catch (const std::runtime_error& e) {
+      log(log_prefix_, e.what());
+      return kDone;
+    }
+    write_offset_ = 0;
+    log(log_prefix_, "should write " + std::to_string(bytes) + " bytes in " +
+                         std::to_string(writes) + " writes");
+    // all of them may have been empty
+    return pending_writes_.empty() ? Step(log) : kWrite;
+  }
+
+  log(log_prefix_,
+      "The set of traces associated with socket cannot agree on the next "
+      "action");
+  return kDone;
+}
+
+bool ReplayConnection::Consume(const uint8_t* data, int len,
+                               const ReplayLogger& log) {
+  try {
+    traces_.ConsumeRead(const_cast<uint8_t*>(data), len);
+  } catch (const std::runtime_error& e) {
+    log(log_prefix_, e.what());
+    return false;
+  }
+  log(log_prefix_, "Read " + std::to_string(len) + " bytes");
+  return true;
+}
+
+int ReplayConnection::PendingWrites(struct iovec* iov, int max,
+                                    size_t* total) const {
+  int count = 0;
+  *total = 0;
+  for (std::string_view write : pending_writes_) {
+    if (count == max) break;
+    size_t skip = count == 0 ? write_offset_ : 0;
+    iov[count].iov_base = const_cast<char*>(write.data() + skip);
+    iov[count].iov_len = write.size() - skip;
+    *total += iov[count].iov_len;
+    count++;
+  }
+  return count;
+}
+
+void ReplayConnection::Sent(size_t bytes) {
+  write_offset_ += bytes;
+  while (!pending_writes_.empty() &&
+         write_offset_ >= pending_writes_.front().size()) {
+    write_offset_ -= pending_writes_.front().size();
+    pending_writes_.pop_front();
+  }
+}
+
+std::unique_ptr<SocketReplayLoop> SocketReplayLoop::Create(
+    Logger log, SocketReplayOptions options) {
+  if (options.backend == SocketReplayOptions::kIoUring) {
+    std::string reason = "airreplay was built without io_uring";
+#ifndef AIRREPLAY_NO_IO_URING
+    if (UringReplayLoop::Supported(&reason)) {
+      try {
+        return std::make_unique<UringReplayLoop>(log, options);
+      } catch (const std::runtime_error& e) {
+        reason = e.what();
+      }
+    }
+#endif
+    log("SocketReplayLoop",
+        "io_uring is not available (" + reason + "), replaying on epoll");
+  }
+  return std::make_unique<EpollReplayLoop>(log, options);
+}
+
+EpollReplayLoop::EpollReplayLoop(Logger log, SocketReplayOptions options)
+    : Log(std::move(log)),
+      read_buffer_(options.read_buffer_bytes),
+      zerocopy_min_bytes_(options.zerocopy_min_bytes) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ == -1 || wake_fd_ == -1) {
+    throw std::runtime_error("EpollReplayLoop: " +
+                             std::string(strerror(errno)));
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = wake_fd_;
+  CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == 0);
+  thread_ = std::thread(&EpollReplayLoop::Loop, this);
+}
+
+EpollReplayLoop::~EpollReplayLoop() {
+  Stop();
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void EpollReplayLoop::AddListener(Socket listener,
+                                   airreplay::TraceGroup traces,
+                                   const std::string& log_prefix) {
+  auto endpoint = std::make_unique<Endpoint>();
+  endpoint->socket = std::move(listener);
+  endpoint->replay = ReplayConnection(std::move(traces), log_prefix);
+  endpoint->listener = true;
+  Register(std::move(endpoint));
+}
+
+void EpollReplayLoop::AddConnection(
+    Socket socket, airreplay::TraceGroup traces, const std::string& log_prefix,
+    const airreplay::OpequeEntry* replay_until) {
+  auto endpoint = std::make_unique<Endpoint>();
+  endpoint->socket = std::move(socket);
+  endpoint->replay =
+      ReplayConnection(std::move(traces), log_prefix, replay_until);
+  Register(std::move(endpoint));
+}
+
+void EpollReplayLoop::Stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  Wake();
+  if (thread_.joinable()) thread_.join();
+}
+
+void EpollReplayLoop::Wake() {
+  uint64_t one = 1;
+  // only fails if the counter would overflow, the loop is woken up anyway
+  ssize_t unused = write(wake_fd_, &one, sizeof(one));
+  (void)unused;
+}
+
+// called from any thread. The endpoint is registered with epoll by the loop
+void EpollReplayLoop::Register(std::unique_ptr<Endpoint> endpoint) {
+  endpoint->socket.SetNonBlocking(true);
+  if (zerocopy_min_bytes_ > 0 && !endpoint->listener) {
+    endpoint->zerocopy = endpoint->socket.EnableZeroCopy();
+  }
+  {
+    std::lock_guard lock(mutex_);
+    if (stopping_) {
+      Log(endpoint->replay.log_prefix(), "replay loop stopped, closing");
+      endpoint->socket.Close();
+      return;
+    }
+    incoming_.push_back(std::move(endpoint));
+  }
+  Wake();
+}
+
+void EpollReplayLoop::Loop() {
+  struct epoll_event events[kMaxEvents];
+  bool running = true;
+  while (running) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      Log("EpollReplayLoop", "epoll_wait failed: " + std::to_string(errno));
+      break;
+    }
+    for (int i = 0; i < n && running; i++) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t count;
+        while (read(wake_fd_, &count, sizeof(count)) > 0) {
+        }
+        std::deque<std::unique_ptr<Endpoint>> incoming;
+        {
+          std::lock_guard lock(mutex_);
+          running = !stopping_;
+          incoming.swap(incoming_);
+        }
+        for (auto& endpoint : incoming) {
+          int new_fd = endpoint->socket.fd_;
+          Endpoint* added = endpoint.get();
+          endpoints_.emplace(new_fd, std::move(endpoint));
+          struct epoll_event event = {};
+          event.data.fd = new_fd;
+          CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, new_fd, &event) == 0);
+          if (added->listener) {
+            Watch(added, EPOLLIN);
+          } else if (!Advance(added)) {
+            Finish(added);
+          }
+        }
+        continue;
+      }
+
+      // may have been closed by an earlier event of this batch
+      auto it = endpoints_.find(fd);
+      if (it == endpoints_.end()) continue;
+      Endpoint* endpoint = it->second.get();
+      if (endpoint->listener) {
+        Accept(endpoint);
+        continue;
+      }
+      if (endpoint->zerocopy_inflight > 0 && (events[i].events & EPOLLERR)) {
+        int completed = endpoint->socket.ReapZeroCopy();
+        endpoint->zerocopy_inflight -= completed;
+        // with no completion queued the error is the connection's own
+        if (endpoint->done && (endpoint->zerocopy_inflight <= 0 ||
+                               completed == 0)) {
+          Close(fd);
+          continue;
+        }
+      }
+      if (endpoint->done) {
+        // EPOLLHUP is reported whatever is watched, so wait no longer
+        if (events[i].events & EPOLLHUP) Close(fd);
+        continue;
+      }
+      if (endpoint->replay.paused()) {
+        // a paused connection watches nothing, so this is EPOLLERR or
+        // EPOLLHUP. They stay pending and would wake the loop forever
+        Finish(endpoint);
+        continue;
+      }
+      if (!Advance(endpoint)) Finish(endpoint);
+    }
+  }
+
+  while (!endpoints_.empty()) {
+    Close(endpoints_.begin()->first);
+  }
+  // also after epoll_wait failed, so Register closes later endpoints
+  std::lock_guard lock(mutex_);
+  stopping_ = true;
+  for (auto& endpoint : incoming_) {
+    endpoint->socket.Close();
+  }
+  incoming_.clear();
+}
+
+void EpollReplayLoop::Accept(Endpoint* listener) {
+  while (true) {
+    Socket socket;
+    if (!listener->socket.Accept(socket)) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        Log(listener->replay.log_prefix(),
+            "Failed to accept connection: " + std::to_string(errno));
+      }
+      return;
+    }
+    Log(listener->replay.log_prefix(),
+        "Accepted connection to fd" + std::to_string(socket.fd_));
+    socket.SetNonBlocking(true);
+
+    auto endpoint = std::make_unique<Endpoint>();
+    if (zerocopy_min_bytes_ > 0) endpoint->zerocopy = socket.EnableZeroCopy();
+    int fd = socket.fd_;
+    endpoint->socket = std::move(socket);
+    endpoint->replay = ReplayConnection(listener->replay.traces(),
+                                        listener->replay.log_prefix());
+    Endpoint* conn = endpoint.get();
+    endpoints_.emplace(fd, std::move(endpoint));
+    struct epoll_event event = {};
+    event.data.fd = fd;
+    CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0);
+    if (!Advance(conn)) Finish(conn);
+  }
+}
+
+bool EpollReplayLoop::Advance(Endpoint* conn) {
+  ReplayConnection& replay = conn->replay;
+  while (true) {
+    switch (replay.Step(Log)) {
+      case ReplayConnection::kWrite: {
+        ssize_t sent = Send(conn);
+        if (sent < 0) return false;
+        if (sent == 0) {
+          Watch(conn, EPOLLOUT);
+          return true;
+        }
+        break;
+      }
+      case ReplayConnection::kRead: {
+        int length =
+            conn->socket.Read(read_buffer_.data(), read_buffer_.size());
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          Watch(conn, EPOLLIN);
+          return true;
+        }
+        if (length <= 0) {
+          Log(replay.log_prefix(),
+              "connection closed before the end of its trace");
+          return false;
+        }
+        if (!replay.Consume(read_buffer_.data(), length, Log)) return false;
+        break;
+      }
+      case ReplayConnection::kPaused:
+        // the connection stays open but replays nothing more
+        Watch(conn, 0);
+        return true;
+      case ReplayConnection::kDone:
+        return false;
+    }
+  }
+}
+
+// sends pending writes with one syscall. Returns the bytes sent, 0 if the
+// socket is full or -1 if the connection failed
+ssize_t EpollReplayLoop::Send(Endpoint* conn) {
+  struct iovec iov[kMaxIovecs];
+  size_t total = 0;
+  int count = conn->replay.PendingWrites(iov, kMaxIovecs, &total);
+  bool zerocopy = conn->zerocopy && total >= zerocopy_min_bytes_;
+  ssize_t written = conn->socket.WriteV(iov, count, zerocopy);
+  if (written < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    if (zerocopy && errno == ENOBUFS) {
+      // out of pinned memory for zerocopy, copy from now on
+      conn->zerocopy = false;
+      return Send(conn);
+    }
+    Log(conn->replay.log_prefix(), "write failed: " + std::to_string(errno));
+    return -1;
+  }
+  if (zerocopy) conn->zerocopy_inflight++;
+  conn->replay.Sent(written);
+  return written;
+}
+
+void EpollReplayLoop::Finish(Endpoint* conn) {
+  if (conn->zerocopy_inflight <= 0) {
+    Close(conn->socket.fd_);
+    return;
+  }
+  // epoll reports EPOLLERR once the completions are queued
+  conn->done = true;
+  Watch(conn, 0);
+}
+
+void EpollReplayLoop::Watch(Endpoint* endpoint, uint32_t events) {
+  if (endpoint->events == events) return;
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.fd = endpoint->socket.fd_;
+  CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, endpoint->socket.fd_, &event) ==
+        0);
+  endpoint->events = events;
+}
+
+void EpollReplayLoop::Close(int fd) {
+  auto it = endpoints_.find(fd);
+  if (it == endpoints_.end()) return;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  it->second->socket.Close();
+  endpoints_.erase(it);
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "socket.h"
+#include "trace.h"
+
+using ReplayLogger =
+    std::function<void(const std::string&, const std::string&)>;
+
+struct SocketReplayOptions {
+  enum Backend { kEpoll, kIoUring };
+  // kIoUring falls back to kEpoll when the kernel cannot run it
+  Backend backend = kEpoll;
+  // reads take up to read_buffer_bytes at once, however the recorded reads
+  // were split
+  size_t read_buffer_bytes = 1 << 20;
+  // writes of at least zerocopy_min_bytes are sent with MSG_ZEROCOPY where
+  // the kernel supports it, 0 disables it. epoll only
+  size_t zerocopy_min_bytes = 0;
+};
+
+// The replay of one connection, whatever drives its socket: checks what the
+// peer sends against the TraceGroup and queues the recorded writes that
+// follow, pointing into the shared traces.
+class ReplayConnection {
+ public:
+  enum Next { kRead, kWrite, kPaused, kDone };
+
+  ReplayConnection() = default;
+  // when replay_until is given the connection pauses once replay_until is no
+  // longer ahead in its traces
+  ReplayConnection(airreplay::TraceGroup traces, std::string log_prefix,
+                   const airreplay::OpequeEntry* replay_until = nullptr);
+
+  // what the connection waits for. Queues the recorded writes that are due
+  Next Step(const ReplayLogger& log);
+  // matches bytes the peer sent. Returns false if no trace continues with them
+  bool Consume(const uint8_t* data, int len, const ReplayLogger& log);
+  // fills iov with at most max queued writes, returns how many
+  int PendingWrites(struct iovec* iov, int max, size_t* total) const;
+  void Sent(size_t bytes);
+  bool HasPendingWrites() const { return !pending_writes_.empty(); }
+  // replay_until was reached, nothing more is replayed
+  bool paused() const { return paused_; }
+
+  const airreplay::TraceGroup& traces() const { return traces_; }
+  const std::string& log_prefix() const { return log_prefix_; }
+
+ private:
+  airreplay::TraceGroup traces_;
+  std::string log_prefix_;
+  bool has_replay_until_ = false;
+  airreplay::OpequeEntry replay_until_;
+  bool paused_ = false;
+  // recorded writes not sent yet. The first write_offset_ bytes of the front
+  // one were sent already
+  std::deque<std::string_view> pending_writes_;
+  size_t write_offset_ = 0;
+};
+
+// Replays the recorded traffic of mocked sockets on a single thread. Sockets
+// are handed over to the loop and closed by it. Stop (or the destructor)
+// wakes the loop and joins it.
+class SocketReplayLoop {
+ public:
+  using Logger = ReplayLogger;
+
+  // the backend of options, or epoll if that is not available
+  static std::unique_ptr<SocketReplayLoop> Create(
+      Logger log, SocketReplayOptions options = SocketReplayOptions());
+  virtual ~SocketReplayLoop() = default;
+
+  // accepts connections on listener, which must be listening already. Each
+  // accepted connection replays a copy of traces
+  virtual void AddListener(Socket listener, airreplay::TraceGroup traces,
+                           const std::string& log_prefix) = 0;
+  // replays traces on a connected socket. When replay_until is given the
+  // connection stops once replay_until is no longer ahead in its traces
+  virtual void AddConnection(
+      Socket socket, airreplay::TraceGroup traces,
+      const std::string& log_prefix,
+      const airreplay::OpequeEntry* replay_until = nullptr) = 0;
+  virtual void Stop() = 0;
+};
+
+// Each connection is driven without blocking: sockets are non-blocking,
+// partial writes are resumed once the socket is writable again, and a
+// connection waiting for input costs no thread. Listening sockets are
+// accepted on the same loop, and an eventfd wakes it for new sockets.
+class EpollReplayLoop : public SocketReplayLoop {
+ public:
+  explicit EpollReplayLoop(Logger log,
+                           SocketReplayOptions options = SocketReplayOptions());
+  EpollReplayLoop(const EpollReplayLoop&) = delete;
+  EpollReplayLoop& operator=(const EpollReplayLoop&) = delete;
+  ~EpollReplayLoop() override;
+
+  void AddListener(Socket listener, airreplay::TraceGroup traces,
+                   const std::string& log_prefix) override;
+  void AddConnection(
+      Socket socket, airreplay::TraceGroup traces,
+      const std::string& log_prefix,
+      const airreplay::OpequeEntry* replay_until = nullptr) override;
+  void Stop() override;
+
+ private:
+  struct Endpoint {
+    Socket socket;
+    bool listener = false;
+    // for listeners, the traces copied into accepted connections
+    ReplayConnection replay;
+    uint32_t events = 0;
+    bool zerocopy = false;
+    // zerocopy sends the kernel has not reported complete. The connection is
+    // only closed once there are none, so the traces outlive the sends
+    int zerocopy_inflight = 0;
+    bool done = false;
+  };
+
+  void Loop();
+  void Register(std::unique_ptr<Endpoint> endpoint);
+  void Wake();
+  void Accept(Endpoint* listener);
+  // replays as far as the socket allows without blocking. Returns false once
+  // the connection is done and should be closed
+  bool Advance(Endpoint* conn);
+  ssize_t Send(Endpoint* conn);
+  // closes conn once its zerocopy sends completed
+  void Finish(Endpoint* conn);
+  void Watch(Endpoint* endpoint, uint32_t events);
+  void Close(int fd);
+
+  Logger Log;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::thread thread_;
+  // shared by all connections, only used by the loop thread
+  std::vector<uint8_t> read_buffer_;
+  size_t zerocopy_min_bytes_;
+
+  std::mutex mutex_;
+  // endpoints added by other threads, registered by the loop
+  std::deque<std::unique_ptr<Endpoint>> incoming_;
+  bool stopping_ = false;
+
+  // only accessed by the loop thread, by fd
+  std::map<int, std::unique_ptr<Endpoint>> endpoints_;
+};
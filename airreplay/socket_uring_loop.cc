@@ -0,0 +1,465 @@
+#include "socket_uring_loop.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+const unsigned kRingEntries = 4096;
+// provided receive buffers
+const uint16_t kBuffers = 64;
+const size_t kMinBufferBytes = 4096;
+const uint16_t kBufferGroup = 0;
+
+std::runtime_error SystemError(const std::string& call, int err) {
+  return std::runtime_error(call + ": " + std::string(strerror(err)));
+}
+}  // namespace
+
+IoUring::IoUring(unsigned entries) {
+  struct io_uring_params params = {};
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) throw SystemError("io_uring_setup", errno);
+
+  sq_ring_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_bytes_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+  }
+  sqes_bytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring_ = mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  cq_ring_ = single_mmap ? sq_ring_
+                         : mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd_,
+                                IORING_OFF_CQ_RING);
+  void* sqes = mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+    int err = errno;
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_bytes_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_bytes_);
+    }
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_bytes_);
+    close(fd_);
+    throw SystemError("mmap io_uring", err);
+  }
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  char* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+  munmap(sqes_, sqes_bytes_);
+  if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_bytes_);
+  munmap(sq_ring_, sq_ring_bytes_);
+  close(fd_);
+}
+
+struct io_uring_sqe* IoUring::NextSqe() {
+  unsigned tail = *sq_tail_ + sq_pending_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    Submit(0);
+    tail = *sq_tail_;
+  }
+  CHECK(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_)
+      << "io_uring submission queue is full";
+  unsigned index = tail & *sq_mask_;
+  sq_array_[index] = index;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_pending_++;
+  return sqe;
+}
+
+int IoUring::Submit(unsigned wait_for) {
+  unsigned tail = *sq_tail_ + sq_pending_;
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  sq_pending_ = 0;
+  // includes entries an earlier, failed Submit left behind
+  unsigned to_submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  int ret = syscall(__NR_io_uring_enter, fd_, to_submit, wait_for,
+                    wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  return ret < 0 ? -errno : ret;
+}
+
+int IoUring::Register(unsigned opcode, void* arg, unsigned nr_args) {
+  int ret = syscall(__NR_io_uring_register, fd_, opcode, arg, nr_args);
+  return ret < 0 ? -errno : ret;
+}
+
+bool UringReplayLoop::Supported(std::string* reason) {
+  try {
+    IoUring ring(8);
+    std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                             IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    auto* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+    if (ring.Register(IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+      *reason = "cannot probe io_uring operations";
+      return false;
+    }
+    // multishot receive has no probe of its own. It came with
+    // IORING_OP_SEND_ZC in Linux 6.0, after multishot accept
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+                   IORING_OP_READ, IORING_OP_ASYNC_CANCEL,
+                   IORING_OP_PROVIDE_BUFFERS, IORING_OP_SEND_ZC}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        *reason = "io_uring operation " + std::to_string(op) +
+                  " is not supported, Linux 6.0 or newer is needed";
+        return false;
+      }
+    }
+  } catch (const std::runtime_error& e) {
+    *reason = e.what();
+    return false;
+  }
+  return true;
+}
+
+UringReplayLoop::UringReplayLoop(Logger log, SocketReplayOptions options)
+    : Log(std::move(log)),
+      buffer_bytes_(
+          std::max(options.read_buffer_bytes / kBuffers, kMinBufferBytes)) {
+  ring_ = std::make_unique<IoUring>(kRingEntries);
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd_ == -1) throw SystemError("eventfd", errno);
+
+  buffers_.resize(buffer_bytes_ * kBuffers);
+  // submitted along with the first wait of the loop
+  struct io_uring_sqe* sqe = ring_->NextSqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = kBuffers;
+  sqe->addr = reinterpret_cast<uintptr_t>(buffers_.data());
+  sqe->len = buffer_bytes_;
+  sqe->buf_group = kBufferGroup;
+  sqe->off = 0;
+  sqe->user_data = kProvide;
+  thread_ = std::thread(&UringReplayLoop::Loop, this);
+}
+
+UringReplayLoop::~UringReplayLoop() {
+  Stop();
+  // the kernel drops the requests still pointing into endpoints and buffers
+  ring_.reset();
+  close(wake_fd_);
+  for (auto& kv : endpoints_) {
+    kv.second->socket.Close();
+  }
+}
+
+void UringReplayLoop::AddListener(Socket listener,
+                                  airreplay::TraceGroup traces,
+                                  const std::string& log_prefix) {
+  auto endpoint = std::make_unique<Endpoint>();
+  endpoint->socket = std::move(listener);
+  endpoint->replay = ReplayConnection(std::move(traces), log_prefix);
+  endpoint->listener = true;
+  Register(std::move(endpoint));
+}
+
+void UringReplayLoop::AddConnection(
+    Socket socket, airreplay::TraceGroup traces, const std::string& log_prefix,
+    const airreplay::OpequeEntry* replay_until) {
+  auto endpoint = std::make_unique<Endpoint>();
+  endpoint->socket = std::move(socket);
+  endpoint->replay =
+      ReplayConnection(std::move(traces), log_prefix, replay_until);
+  Register(std::move(endpoint));
+}
+
+void UringReplayLoop::Stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  Wake();
+  if (thread_.joinable()) thread_.join();
+}
+
+void UringReplayLoop::Wake() {
+  uint64_t one = 1;
+  // only fails if the counter would overflow, the loop is woken up anyway
+  ssize_t unused = write(wake_fd_, &one, sizeof(one));
+  (void)unused;
+}
+
+// called from any thread. The endpoint is started by the loop
+void UringReplayLoop::Register(std::unique_ptr<Endpoint> endpoint) {
+  endpoint->socket.SetNonBlocking(false);
+  {
+    std::lock_guard lock(mutex_);
+    if (stopping_) {
+      Log(endpoint->replay.log_prefix(), "replay loop stopped, closing");
+      endpoint->socket.Close();
+      return;
+    }
+    incoming_.push_back(std::move(endpoint));
+  }
+  Wake();
+}
+
+void UringReplayLoop::Loop() {
+  ArmWake();
+  while (running_) {
+    int ret = ring_->Submit(1);
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+      Log("UringReplayLoop", "io_uring_enter failed: " + std::to_string(-ret));
+      running_ = false;
+      break;
+    }
+    ring_->ForEachCompletion(
+        [this](const struct io_uring_cqe& cqe) { Complete(cqe); });
+  }
+
+  // the remaining endpoints are closed once the ring is gone. The loop may
+  // also have stopped on a failure, so later registrations are closed by
+  // Register instead of waiting for a loop that is gone
+  std::lock_guard lock(mutex_);
+  stopping_ = true;
+  for (auto& endpoint : incoming_) {
+    endpoint->socket.Close();
+  }
+  incoming_.clear();
+}
+
+void UringReplayLoop::ArmWake() {
+  struct io_uring_sqe* sqe = ring_->NextSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd_;
+  sqe->addr = reinterpret_cast<uintptr_t>(&wake_value_);
+  sqe->len = sizeof(wake_value_);
+  sqe->off = -1;
+  sqe->user_data = kWake;
+}
+
+void UringReplayLoop::Start(std::unique_ptr<Endpoint> endpoint) {
+  Endpoint* started = endpoint.get();
+  started->id = next_id_++;
+  endpoints_.emplace(started->id, std::move(endpoint));
+  Arm(started);
+  if (!started->listener) Drive(started);
+}
+
+void UringReplayLoop::Arm(Endpoint* endpoint) {
+  struct io_uring_sqe* sqe = ring_->NextSqe();
+  sqe->fd = endpoint->socket.fd_;
+  if (endpoint->listener) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    Submit(endpoint, kAccept, sqe);
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    Submit(endpoint, kRecv, sqe);
+  }
+  endpoint->armed = true;
+}
+
+void UringReplayLoop::Submit(Endpoint* endpoint, Op op,
+                             struct io_uring_sqe* sqe) {
+  sqe->user_data = endpoint->id << 8 | op;
+  // the completion of a cancel is not waited for
+  if (op != kCancel) endpoint->inflight++;
+}
+
+void UringReplayLoop::Accepted(Endpoint* listener, int fd) {
+  Socket socket;
+  socket.Reset(fd);
+  socket.SetTCPNoDelay(true);
+  Log(listener->replay.log_prefix(),
+      "Accepted connection to fd" + std::to_string(fd));
+  auto endpoint = std::make_unique<Endpoint>();
+  endpoint->socket = std::move(socket);
+  endpoint->replay = ReplayConnection(listener->replay.traces(),
+                                      listener->replay.log_prefix());
+  Start(std::move(endpoint));
+}
+
+void UringReplayLoop::Complete(const struct io_uring_cqe& cqe) {
+  Op op = static_cast<Op>(cqe.user_data & 0xff);
+  uint64_t id = cqe.user_data >> 8;
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (op == kProvide) {
+    // only failures complete, see RecycleBuffer
+    if (cqe.res < 0) {
+      Log("UringReplayLoop",
+          "providing receive buffers failed: " + std::to_string(-cqe.res));
+    }
+    return;
+  }
+  if (op == kWake) {
+    std::deque<std::unique_ptr<Endpoint>> incoming;
+    {
+      std::lock_guard lock(mutex_);
+      running_ = !stopping_;
+      incoming.swap(incoming_);
+    }
+    for (auto& endpoint : incoming) {
+      Start(std::move(endpoint));
+    }
+    if (running_) ArmWake();
+    return;
+  }
+
+  // received bytes go back to the kernel once they are matched
+  int bid = -1;
+  const uint8_t* data = nullptr;
+  if (op == kRecv && (cqe.flags & IORING_CQE_F_BUFFER)) {
+    bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    data = buffers_.data() + bid * buffer_bytes_;
+  }
+  auto it = endpoints_.find(id);
+  if (op == kCancel || it == endpoints_.end()) {
+    if (bid != -1) RecycleBuffer(bid);
+    return;
+  }
+  Endpoint* endpoint = it->second.get();
+  if (!more) endpoint->inflight--;
+
+  switch (op) {
+    case kAccept:
+      if (!more) endpoint->armed = false;
+      if (cqe.res >= 0) {
+        Accepted(endpoint, cqe.res);
+      } else if (cqe.res != -ECANCELED) {
+        Log(endpoint->replay.log_prefix(),
+            "Failed to accept connection: " + std::to_string(-cqe.res));
+      }
+      if (!endpoint->armed && !endpoint->closing) Arm(endpoint);
+      break;
+    case kRecv:
+      if (!more) endpoint->armed = false;
+      if (cqe.res > 0) {
+        // after replay_until the peer's bytes are not matched any more
+        if (!endpoint->closing && !endpoint->replay.paused()) {
+          if (endpoint->replay.Consume(data, cqe.res, Log)) {
+            Drive(endpoint);
+          } else {
+            Finish(endpoint);
+          }
+        }
+      } else if (cqe.res == 0) {
+        if (!endpoint->closing) {
+          Log(endpoint->replay.log_prefix(),
+              "connection closed before the end of its trace");
+          Finish(endpoint);
+        }
+      } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        // out of buffers only ends the multishot receive, it is rearmed
+        Log(endpoint->replay.log_prefix(),
+            "read failed: " + std::to_string(-cqe.res));
+        Finish(endpoint);
+      }
+      if (bid != -1) RecycleBuffer(bid);
+      if (!endpoint->armed && !endpoint->closing) Arm(endpoint);
+      break;
+    case kSend:
+      endpoint->sending = false;
+      if (cqe.res < 0) {
+        if (cqe.res != -ECANCELED) {
+          Log(endpoint->replay.log_prefix(),
+              "write failed: " + std::to_string(-cqe.res));
+        }
+        Finish(endpoint);
+      } else {
+        endpoint->replay.Sent(cqe.res);
+        Drive(endpoint);
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (endpoint->closing && endpoint->inflight == 0) {
+    endpoint->socket.Close();
+    endpoints_.erase(id);
+  }
+}
+
+void UringReplayLoop::Drive(Endpoint* conn) {
+  if (conn->closing) return;
+  switch (conn->replay.Step(Log)) {
+    case ReplayConnection::kWrite:
+      if (!conn->sending) Send(conn);
+      return;
+    case ReplayConnection::kRead:
+    case ReplayConnection::kPaused:
+      // the multishot receive delivers what the peer sends
+      return;
+    case ReplayConnection::kDone:
+      Finish(conn);
+      return;
+  }
+}
+
+void UringReplayLoop::Send(Endpoint* conn) {
+  size_t total = 0;
+  int count = conn->replay.PendingWrites(conn->iov, kMaxIovecs, &total);
+  conn->msg = {};
+  conn->msg.msg_iov = conn->iov;
+  conn->msg.msg_iovlen = count;
+  struct io_uring_sqe* sqe = ring_->NextSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->socket.fd_;
+  sqe->addr = reinterpret_cast<uintptr_t>(&conn->msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  Submit(conn, kSend, sqe);
+  conn->sending = true;
+}
+
+// the endpoint is released once the completions of its running requests
+// arrived, see Complete
+void UringReplayLoop::Finish(Endpoint* conn) {
+  if (conn->closing) return;
+  conn->closing = true;
+  std::vector<Op> running;
+  if (conn->armed) running.push_back(conn->listener ? kAccept : kRecv);
+  if (conn->sending) running.push_back(kSend);
+  for (Op op : running) {
+    struct io_uring_sqe* sqe = ring_->NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = conn->id << 8 | op;
+    Submit(conn, kCancel, sqe);
+  }
+}
+
+void UringReplayLoop::RecycleBuffer(uint16_t bid) {
+  struct io_uring_sqe* sqe = ring_->NextSqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr =
+      reinterpret_cast<uintptr_t>(buffers_.data() + bid * buffer_bytes_);
+  sqe->len = buffer_bytes_;
+  sqe->buf_group = kBufferGroup;
+  sqe->off = bid;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = kProvide;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "socket.h"
+#include "socket_replay_loop.h"
+
+// The submission and completion queues of an io_uring instance, mapped from
+// the kernel through the raw system calls. Only used by one thread.
+class IoUring {
+ public:
+  // throws std::runtime_error if the ring cannot be set up
+  explicit IoUring(unsigned entries);
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  // a zeroed submission queue entry. Submits the queued entries first if the
+  // queue is full
+  struct io_uring_sqe* NextSqe();
+  // submits the queued entries and waits for at least wait_for completions.
+  // Returns -errno on failure
+  int Submit(unsigned wait_for);
+  // calls f with each completion that arrived, then frees their slots
+  template <typename F>
+  void ForEachCompletion(F f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      f(cqes_[head & *cq_mask_]);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  int Register(unsigned opcode, void* arg, unsigned nr_args);
+
+ private:
+  int fd_ = -1;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_bytes_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_bytes_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_bytes_ = 0;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  // entries queued since the last Submit
+  unsigned sq_pending_ = 0;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+};
+
+// Replays mocked sockets on a single thread driven by io_uring, so a batch
+// of reads and writes costs one io_uring_enter instead of a system call
+// each. Listeners use multishot accept and connections a multishot receive
+// into a pool of buffers provided to the kernel up front, which picks one
+// per received chunk, so no read is issued per connection. The submissions
+// made while handling a batch of completions go out together with the wait
+// for the next batch.
+//
+// Sockets are used in blocking mode, the ring waits for them.
+class UringReplayLoop : public SocketReplayLoop {
+ public:
+  // false, with the reason, if the kernel lacks what the loop uses
+  static bool Supported(std::string* reason);
+
+  // throws std::runtime_error if the ring cannot be set up
+  explicit UringReplayLoop(Logger log,
+                           SocketReplayOptions options = SocketReplayOptions());
+  UringReplayLoop(const UringReplayLoop&) = delete;
+  UringReplayLoop& operator=(const UringReplayLoop&) = delete;
+  ~UringReplayLoop() override;
+
+  void AddListener(Socket listener, airreplay::TraceGroup traces,
+                   const std::string& log_prefix) override;
+  void AddConnection(
+      Socket socket, airreplay::TraceGroup traces,
+      const std::string& log_prefix,
+      const airreplay::OpequeEntry* replay_until = nullptr) override;
+  void Stop() override;
+
+ private:
+  static const int kMaxIovecs = 64;
+  // what a completion belongs to, in the low byte of its user_data. The
+  // rest is the endpoint id
+  enum Op : uint8_t { kWake, kProvide, kAccept, kRecv, kSend, kCancel };
+
+  struct Endpoint {
+    uint64_t id = 0;
+    Socket socket;
+    bool listener = false;
+    // for listeners, the traces copied into accepted connections
+    ReplayConnection replay;
+    // the multishot accept or receive is running
+    bool armed = false;
+    bool sending = false;
+    // read by the kernel while a send is in flight
+    struct iovec iov[kMaxIovecs];
+    struct msghdr msg;
+    // submissions whose last completion has not arrived. The endpoint is
+    // released once it is closing and there are none
+    int inflight = 0;
+    bool closing = false;
+  };
+
+  void Loop();
+  void Register(std::unique_ptr<Endpoint> endpoint);
+  void Wake();
+  void ArmWake();
+  // adds the endpoint to endpoints_ and starts replaying it
+  void Start(std::unique_ptr<Endpoint> endpoint);
+  void Arm(Endpoint* endpoint);
+  void Accepted(Endpoint* listener, int fd);
+  void Complete(const struct io_uring_cqe& cqe);
+  // replays until the connection waits for the peer or a send
+  void Drive(Endpoint* conn);
+  void Send(Endpoint* conn);
+  void Finish(Endpoint* conn);
+  void Submit(Endpoint* endpoint, Op op, struct io_uring_sqe* sqe);
+  void RecycleBuffer(uint16_t bid);
+
+  Logger Log;
+  std::thread thread_;
+  int wake_fd_ = -1;
+  uint64_t wake_value_ = 0;
+  uint64_t next_id_ = 1;
+  bool running_ = true;
+
+  // receive buffers provided to the kernel, read_buffer_bytes split into
+  // kBuffers. Provided again as soon as their bytes are matched
+  std::vector<uint8_t> buffers_;
+  size_t buffer_bytes_;
+
+  std::mutex mutex_;
+  // endpoints added by other threads, started by the loop
+  std::deque<std::unique_ptr<Endpoint>> incoming_;
+  bool stopping_ = false;
+
+  // only accessed by the loop thread, by id
+  std::map<uint64_t, std::unique_ptr<Endpoint>> endpoints_;
+  std::unique_ptr<IoUring> ring_;
+};
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "airreplay/trace_format.h"
+
+using airreplay::format::AppendRecord;
+using airreplay::format::Crc32c;
+using airreplay::format::FrameRecord;
+using airreplay::format::kMaxRecordSize;
+using airreplay::format::RecordReader;
+
+std::vector<std::string> ReadAll(RecordReader *reader) {
+  std::vector<std::string> records;
+  std::string_view payload;
+  while (reader->Next(&payload)) {
+    records.emplace_back(payload);
+  }
+  return records;
+}
+
+TEST(TraceFormatTest, Crc32cKnownValue) {
+  const std::string check = "123456789";
+  EXPECT_EQ(Crc32c(check.data(), check.size()), 0xe3069283u);
+  // incremental computation must match the one-shot one
+  uint32_t crc = Crc32c(check.data(), 4);
+  EXPECT_EQ(Crc32c(check.data() + 4, check.size() - 4, crc), 0xe3069283u);
+}
+
+TEST(TraceFormatTest, RoundTrip) {
+  std::string buf;
+  AppendRecord("first", &buf);
+  AppendRecord(std::string(300, 'x'), &buf);
+  AppendRecord("", &buf);
+
+  RecordReader reader(buf);
+  auto records = ReadAll(&reader);
+  ASSERT_EQ(records.size(), 3);
+  EXPECT_EQ(records[0], "first");
+  EXPECT_EQ(records[1], std::string(300, 'x'));
+  EXPECT_EQ(records[2], "");
+  EXPECT_EQ(reader.corrupted(), 0);
+}
+
+TEST(TraceFormatTest, SkipsBitFlip) {
+  std::string buf;
+  AppendRecord("first", &buf);
+  size_t second_start = buf.size();
+  AppendRecord("second", &buf);
+  AppendRecord("third", &buf);
+  // flip a payload bit of the second record
+  buf[second_start + 6] ^= 0x10;
+
+  RecordReader reader(buf);
+  auto records = ReadAll(&reader);
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0], "first");
+  EXPECT_EQ(records[1], "third");
+  EXPECT_EQ(reader.corrupted(), 1);
+}
+
+TEST(TraceFormatTest, SkipsTornWrite) {
+  std::string buf;
+  AppendRecord("first", &buf);
+  std::string torn;
+  AppendRecord("this record was only partially written", &torn);
+  buf += torn.substr(0, torn.size() / 2);
+  AppendRecord("after crash", &buf);
+
+  RecordReader reader(buf);
+  auto records = ReadAll(&reader);
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0], "first");
+  EXPECT_EQ(records[1], "after crash");
+  EXPECT_GT(reader.skipped_bytes(), 0);
+}
+
+TEST(TraceFormatTest, RejectsOversizedRecord) {
+  std::string buf;
+  AppendRecord("first", &buf);
+  std::string oversized(kMaxRecordSize + 1, 'x');
+  EXPECT_THROW(FrameRecord(oversized), std::runtime_error);
+  EXPECT_THROW(AppendRecord(oversized, &buf), std::runtime_error);
+
+  // nothing of the oversized record was appended
+  RecordReader reader(buf);
+  auto records = ReadAll(&reader);
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_EQ(records[0], "first");
+  EXPECT_EQ(reader.skipped_bytes(), 0);
+}
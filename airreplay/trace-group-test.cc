@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "airreplay/trace.h"
+
+using airreplay::OpequeEntry;
+using airreplay::TraceGroup;
+using airreplay::TraceStore;
+
+namespace {
+OpequeEntry Entry(const std::string &debug_string, const std::string &bytes) {
+  OpequeEntry entry;
+  entry.set_rr_debug_string(debug_string);
+  entry.set_bytes_message(bytes);
+  entry.set_body_size(bytes.size());
+  return entry;
+}
+
+OpequeEntry Read(const std::string &bytes) {
+  return Entry("Socket Read", bytes);
+}
+
+OpequeEntry Write(const std::string &bytes) {
+  return Entry("Socket Write", bytes);
+}
+
+void ConsumeRead(TraceGroup *group, std::string bytes) {
+  group->ConsumeRead(reinterpret_cast<uint8_t *>(bytes.data()), bytes.size());
+}
+}  // namespace
+
+TEST(TraceGroupTest, ReadsNarrowToTheMatchingTrace) {
+  TraceGroup group({{Read("GET /a"), Write("A")},
+                    {Read("GET /b"), Write("B")},
+                    {Read("GET /a"), Write("A"), Read("bye")}});
+  EXPECT_TRUE(group.NextIsReadOrEmpty());
+  // reads may split the recorded ones anywhere
+  ConsumeRead(&group, "GE");
+  ConsumeRead(&group, "T /a");
+  ASSERT_TRUE(group.NextIsWrite());
+  EXPECT_EQ(group.NextCommonWrite(), "A");
+  // the first trace ended, the third continues
+  EXPECT_FALSE(group.AllEmpty());
+  EXPECT_TRUE(group.NextIsReadOrEmpty());
+  ConsumeRead(&group, "bye");
+  EXPECT_TRUE(group.AllEmpty());
+}
+
+TEST(TraceGroupTest, MismatchDropsAllTraces) {
+  TraceGroup group({{Read("ping"), Write("pong")}});
+  ConsumeRead(&group, "pang");
+  EXPECT_TRUE(group.AllEmpty());
+  EXPECT_THROW(group.NextCommonWrite(), std::runtime_error);
+}
+
+TEST(TraceGroupTest, DisagreeingWritesThrow) {
+  TraceGroup group({{Read("q"), Write("x")}, {Read("q"), Write("y")}});
+  ConsumeRead(&group, "q");
+  EXPECT_TRUE(group.NextIsWrite());
+  EXPECT_THROW(group.NextCommonWrite(), std::runtime_error);
+}
+
+TEST(TraceGroupTest, CopiesKeepIndependentCursors) {
+  TraceGroup group({{Read("a"), Write("1")}, {Read("b"), Write("2")}});
+  TraceGroup other = group;
+  ConsumeRead(&group, "a");
+  ConsumeRead(&other, "b");
+  EXPECT_EQ(group.NextCommonWrite(), "1");
+  EXPECT_EQ(other.NextCommonWrite(), "2");
+}
+
+TEST(TraceGroupTest, StillBeforeUntilTheMessageIsReplayed) {
+  // StillBefore matches the payload without its 10 byte header and 2 byte
+  // trailer
+  OpequeEntry until = Write("0123456789HELLO!!");
+  TraceGroup group({{Read("ping"), Write("..HELLO.."), Read("bye")}});
+  EXPECT_TRUE(group.StillBefore(until));
+  ConsumeRead(&group, "ping");
+  EXPECT_TRUE(group.StillBefore(until));
+  EXPECT_EQ(group.NextCommonWrite(), "..HELLO..");
+  EXPECT_FALSE(group.StillBefore(until));
+}
+
+TEST(TraceGroupTest, StillBeforeMatchesShortPayloadsWhole) {
+  TraceGroup group({{Read("ping"), Write("ok"), Read("bye")}});
+  EXPECT_TRUE(group.StillBefore(Write("ok")));
+  ConsumeRead(&group, "ping");
+  EXPECT_EQ(group.NextCommonWrite(), "ok");
+  EXPECT_FALSE(group.StillBefore(Write("ok")));
+}
+
+TEST(TraceGroupTest, ReadsFollowEveryWayTheyEndEntries) {
+  // "abcd" ends an entry of the first trace after "ab" and of the second
+  // after "abc". Both stay candidates until a read tells them apart
+  TraceGroup group({{Read("ab"), Read("cd"), Write("1"), Read("e"), Write("2")},
+                    {Read("abc"), Read("d"), Write("1"), Read("f"),
+                     Write("3")}});
+  ConsumeRead(&group, "abcd");
+  ASSERT_TRUE(group.NextIsWrite());
+  EXPECT_EQ(group.NextCommonWrite(), "1");
+  ConsumeRead(&group, "e");
+  ASSERT_TRUE(group.NextIsWrite());
+  EXPECT_EQ(group.NextCommonWrite(), "2");
+  EXPECT_TRUE(group.AllEmpty());
+}
+
+TEST(TraceGroupTest, ReadEndingAnEntryKeepsLongerOnes) {
+  TraceGroup group({{Read("ab"), Read("c"), Write("1")},
+                    {Read("abc"), Write("1"), Read("x"), Write("2")}});
+  // "ab" ends the first trace's entry but may go on as the second's
+  ConsumeRead(&group, "ab");
+  ConsumeRead(&group, "c");
+  EXPECT_EQ(group.NextCommonWrite(), "1");
+  ConsumeRead(&group, "x");
+  EXPECT_EQ(group.NextCommonWrite(), "2");
+}
+
+TEST(TraceStoreTest, LastContainingLooksInsideSingleEntries) {
+  std::vector<OpequeEntry> trace;
+  for (int i = 0; i < 500; i++) {
+    trace.push_back(Write(i % 7 == 0 ? "xxHELLOxx" : "abab"));
+  }
+  trace.push_back(Write("HEL"));
+  trace.push_back(Write("LO"));
+  TraceStore store({trace, {Read("")}});
+  EXPECT_EQ(store.LastContaining(0, "HELLO"), 497);
+  EXPECT_EQ(store.LastContaining(0, "bab"), 499);
+  EXPECT_EQ(store.LastContaining(0, "LO"), 501);
+  // matches do not run from one entry into the next
+  EXPECT_EQ(store.LastContaining(0, "abab" "abab"), -1);
+  EXPECT_EQ(store.LastContaining(0, "HELLO!"), -1);
+  EXPECT_EQ(store.LastContaining(1, "HELLO"), -1);
+  EXPECT_EQ(store.LastContaining(1, ""), 0);
+}
+
+TEST(TraceGroupTest, ReadsRunAcrossRecordedEntries) {
+  TraceGroup group({{Read("one"), Write("1"), Read("two"), Write("2")},
+                    {Read("one"), Write("1"), Read("three")}});
+  // the peer sent both requests before reading any response
+  ConsumeRead(&group, "onetwo");
+  ASSERT_TRUE(group.NextIsWrite());
+  EXPECT_EQ(group.NextCommonWrite(), "1");
+  ASSERT_TRUE(group.NextIsWrite());
+  EXPECT_EQ(group.NextCommonWrite(), "2");
+  EXPECT_TRUE(group.AllEmpty());
+}
@@ -0,0 +1,361 @@
+#include <gtest/gtest.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "airreplay/trace.h"
+
+using airreplay::Trace;
+using airreplay::TraceOptions;
+using airreplay::TraceSegment;
+
+namespace {
+bool Exists(const std::string &filename) {
+  return std::filesystem::exists(filename);
+}
+
+std::string Payload(int pos) { return "entry " + std::to_string(pos); }
+
+// records entries [0, count) of 100 bytes each. Every checkpoint_every-th
+// entry is recorded as a checkpoint
+void RecordEntries(Trace *trace, int count, int checkpoint_every = 0) {
+  for (int i = 0; i < count; i++) {
+    std::string payload = Payload(i);
+    payload.resize(100, '.');
+    if (checkpoint_every > 0 && i % checkpoint_every == 0) {
+      airreplay::OpequeEntry entry;
+      entry.set_bytes_message(payload);
+      entry.set_body_size(payload.size());
+      ASSERT_EQ(trace->RecordCheckpoint(entry), i);
+    } else {
+      ASSERT_EQ(trace->Record(payload), i);
+    }
+  }
+}
+
+// expects replay from the last checkpoint at or before `before` to start
+// with the entry at pos
+void ExpectReplayStart(std::string prefix, int before, int pos,
+                       bool at_checkpoint) {
+  TraceOptions options;
+  options.replay_from_checkpoint_before = before;
+  Trace replay(prefix, airreplay::Mode::kReplay, true, options);
+  EXPECT_EQ(replay.StartedAtCheckpoint(), at_checkpoint) << before;
+  EXPECT_EQ(replay.pos(), pos) << before;
+  ASSERT_TRUE(replay.HasNext());
+  int next_pos;
+  airreplay::OpequeEntry entry = replay.ReplayNext(&next_pos);
+  EXPECT_EQ(next_pos, pos);
+  EXPECT_EQ(entry.bytes_message().substr(0, Payload(pos).size()),
+            Payload(pos));
+}
+
+struct IndexedCheckpoint {
+  int pos;
+  std::string filename;
+  long offset;
+};
+
+std::vector<IndexedCheckpoint> ReadCheckpointIndex(
+    const std::string &indexname) {
+  std::vector<IndexedCheckpoint> checkpoints;
+  std::ifstream index(indexname);
+  IndexedCheckpoint checkpoint;
+  while (index >> checkpoint.pos >> checkpoint.filename >>
+         checkpoint.offset) {
+    checkpoints.push_back(checkpoint);
+  }
+  return checkpoints;
+}
+
+std::vector<TraceSegment> ReadManifest(const std::string &manifestname) {
+  std::vector<TraceSegment> segments;
+  std::ifstream manifest(manifestname);
+  TraceSegment segment;
+  while (manifest >> segment.filename >> segment.first_pos >>
+         segment.last_pos >> segment.bytes) {
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+// every test records into a fresh directory
+class TraceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_cwd_ = std::filesystem::current_path();
+    char dir[] = "/tmp/trace-test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+    std::filesystem::current_path(dir_);
+  }
+
+  void TearDown() override {
+    std::filesystem::current_path(old_cwd_);
+    std::filesystem::remove_all(dir_);
+  }
+
+  std::string prefix_ = "trace";
+  std::filesystem::path old_cwd_;
+  std::string dir_;
+};
+}  // namespace
+
+TEST_F(TraceTest, RotatesBySize) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+  RecordEntries(&trace, 10);
+
+  const std::vector<TraceSegment> &segments = trace.segments();
+  ASSERT_GT(segments.size(), 2);
+  int next_pos = 0;
+  for (size_t i = 0; i < segments.size(); i++) {
+    EXPECT_EQ(segments[i].filename,
+              prefix_ + ".seg" + std::to_string(i) + ".bin");
+    EXPECT_TRUE(Exists(segments[i].filename));
+    EXPECT_EQ(segments[i].first_pos, next_pos);
+    next_pos = segments[i].last_pos + 1;
+    // a segment is closed by the entry that takes it past segment_bytes
+    if (i + 1 < segments.size()) {
+      EXPECT_GE(segments[i].bytes, options.segment_bytes);
+      EXPECT_LT(segments[i].bytes, options.segment_bytes + 150);
+    }
+  }
+  EXPECT_EQ(next_pos, 10);
+  EXPECT_FALSE(Exists(prefix_ + ".bin"));
+}
+
+TEST_F(TraceTest, RotatesByDuration) {
+  TraceOptions options;
+  options.segment_duration = std::chrono::seconds(1);
+  Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+  trace.Record(Payload(0));
+  ASSERT_EQ(trace.segments().size(), 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  // the first entry after the deadline still goes to the old segment
+  trace.Record(Payload(1));
+  trace.Record(Payload(2));
+
+  const std::vector<TraceSegment> &segments = trace.segments();
+  ASSERT_EQ(segments.size(), 2);
+  EXPECT_EQ(segments[0].first_pos, 0);
+  EXPECT_EQ(segments[0].last_pos, 1);
+  EXPECT_EQ(segments[1].first_pos, 2);
+  EXPECT_EQ(segments[1].last_pos, 2);
+}
+
+TEST_F(TraceTest, RetentionDeletesTheOldestSegments) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  options.retention_bytes = 1000;
+  std::vector<TraceSegment> segments;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+    RecordEntries(&trace, 30);
+    segments = trace.segments();
+  }
+
+  ASSERT_GT(segments.size(), 1);
+  EXPECT_GT(segments.front().first_pos, 0);
+  EXPECT_EQ(segments.back().last_pos, 29);
+  size_t total = 0;
+  for (const auto &segment : segments) total += segment.bytes;
+  EXPECT_LE(total, options.retention_bytes);
+  // the manifest lists exactly the live segments, as of the last write
+  EXPECT_EQ(ReadManifest(prefix_ + ".manifest").size(), segments.size());
+  for (int i = 0; i < 30; i++) {
+    std::string segprefix = prefix_ + ".seg" + std::to_string(i);
+    bool live = false;
+    for (const auto &segment : segments) {
+      live = live || segment.filename == segprefix + ".bin";
+    }
+    EXPECT_EQ(Exists(segprefix + ".bin"), live) << segprefix;
+    EXPECT_EQ(Exists(segprefix + ".txt"), live) << segprefix;
+  }
+}
+
+TEST_F(TraceTest, RetentionKeepsTheLiveSegment) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  // less than a single segment
+  options.retention_bytes = 1;
+  Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+  RecordEntries(&trace, 10);
+
+  ASSERT_EQ(trace.segments().size(), 1);
+  EXPECT_EQ(trace.segments().front().filename, trace.tracename());
+  EXPECT_TRUE(Exists(trace.tracename()));
+  // entries keep going to the segment started at the last rotation
+  int first_pos = trace.segments().front().first_pos;
+  trace.Record(Payload(10));
+  ASSERT_EQ(trace.segments().size(), 1);
+  EXPECT_EQ(trace.segments().front().first_pos, first_pos);
+  EXPECT_EQ(trace.segments().front().last_pos, 10);
+}
+
+TEST_F(TraceTest, ManifestListsTheSegments) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  std::vector<TraceSegment> segments;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+    RecordEntries(&trace, 10);
+    segments = trace.segments();
+  }
+  // the destructor brings the size of the last segment up to date
+  std::vector<TraceSegment> manifest = ReadManifest(prefix_ + ".manifest");
+  ASSERT_EQ(manifest.size(), segments.size());
+  for (size_t i = 0; i < segments.size(); i++) {
+    EXPECT_EQ(manifest[i].filename, segments[i].filename);
+    EXPECT_EQ(manifest[i].first_pos, segments[i].first_pos);
+    EXPECT_EQ(manifest[i].last_pos, segments[i].last_pos);
+    EXPECT_EQ(manifest[i].bytes, segments[i].bytes);
+    EXPECT_EQ(std::filesystem::file_size(segments[i].filename),
+              segments[i].bytes);
+  }
+  EXPECT_FALSE(Exists(prefix_ + ".manifest.tmp"));
+
+  // recording again over the trace removes the old segments
+  options.segment_bytes = 0;
+  { Trace trace(prefix_, airreplay::Mode::kRecord, true, options); }
+  for (const auto &segment : segments) {
+    EXPECT_FALSE(Exists(segment.filename));
+  }
+  EXPECT_FALSE(Exists(prefix_ + ".manifest"));
+}
+
+TEST_F(TraceTest, KeepsEarlierTracesWithoutOverwrite) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, false, options);
+    RecordEntries(&trace, 10);
+  }
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, false, options);
+    RecordEntries(&trace, 2);
+  }
+  // an unsegmented trace takes the next number too
+  { Trace trace(prefix_, airreplay::Mode::kRecord, false); }
+
+  EXPECT_TRUE(Exists(prefix_ + ".0.manifest"));
+  EXPECT_TRUE(Exists(prefix_ + ".0.seg0.bin"));
+  EXPECT_TRUE(Exists(prefix_ + ".1.manifest"));
+  EXPECT_EQ(ReadManifest(prefix_ + ".1.manifest").front().filename,
+            prefix_ + ".1.seg0.bin");
+  EXPECT_TRUE(Exists(prefix_ + ".2.bin"));
+  EXPECT_FALSE(Exists(prefix_ + ".2.manifest"));
+  EXPECT_EQ(airreplay::ReadTraceEntries(prefix_ + ".0").size(), 10);
+  EXPECT_EQ(airreplay::ReadTraceEntries(prefix_ + ".1").size(), 2);
+}
+
+TEST_F(TraceTest, ReplaysAcrossSegments) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  options.retention_bytes = 1000;
+  int first_live;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+    RecordEntries(&trace, 30);
+    first_live = trace.segments().front().first_pos;
+  }
+
+  int first_pos;
+  std::deque<airreplay::OpequeEntry> entries =
+      airreplay::ReadTraceEntries(prefix_, &first_pos);
+  EXPECT_EQ(first_pos, first_live);
+  ASSERT_EQ(entries.size(), 30 - first_live);
+  int end_pos;
+  airreplay::TraceExtent(prefix_, &first_pos, &end_pos);
+  EXPECT_EQ(first_pos, first_live);
+  EXPECT_EQ(end_pos, 30);
+
+  Trace replay(prefix_, airreplay::Mode::kReplay);
+  EXPECT_EQ(replay.pos(), first_live);
+  for (int i = first_live; i < 30; i++) {
+    int pos;
+    airreplay::OpequeEntry entry = replay.ReplayNext(&pos);
+    EXPECT_EQ(pos, i);
+    EXPECT_EQ(entry.bytes_message().substr(0, Payload(i).size()), Payload(i));
+  }
+  EXPECT_FALSE(replay.HasNext());
+}
+
+TEST_F(TraceTest, StartsAtTheLastCheckpointBefore) {
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord);
+    RecordEntries(&trace, 10, 4);
+  }
+  // checkpoints at 0, 4 and 8
+  ExpectReplayStart(prefix_, 3, 0, true);
+  ExpectReplayStart(prefix_, 4, 4, true);
+  ExpectReplayStart(prefix_, 7, 4, true);
+  ExpectReplayStart(prefix_, 100, 8, true);
+}
+
+TEST_F(TraceTest, ReplaysFromTheHeadWithoutCheckpoint) {
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord);
+    RecordEntries(&trace, 10);
+  }
+  ExpectReplayStart(prefix_, 5, 0, false);
+}
+
+TEST_F(TraceTest, CheckpointThatRotatesStaysInItsSegment) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  std::vector<TraceSegment> segments;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+    RecordEntries(&trace, 10, 1);
+    segments = trace.segments();
+  }
+  ASSERT_GT(segments.size(), 2);
+
+  // the last entry of every closed segment made Record rotate. Its offset
+  // was taken before, so it still points into the segment holding it
+  std::vector<IndexedCheckpoint> index =
+      ReadCheckpointIndex(prefix_ + ".ckpt_index");
+  ASSERT_EQ(index.size(), 10);
+  for (const auto &segment : segments) {
+    for (int pos = segment.first_pos; pos <= segment.last_pos; pos++) {
+      EXPECT_EQ(index[pos].filename, segment.filename) << pos;
+    }
+  }
+  for (size_t i = 0; i + 1 < segments.size(); i++) {
+    ExpectReplayStart(prefix_, segments[i].last_pos, segments[i].last_pos,
+                      true);
+  }
+}
+
+TEST_F(TraceTest, StartsAtCheckpointInALaterSegmentAfterRetention) {
+  TraceOptions options;
+  options.segment_bytes = 350;
+  options.retention_bytes = 1000;
+  std::vector<TraceSegment> segments;
+  {
+    Trace trace(prefix_, airreplay::Mode::kRecord, true, options);
+    RecordEntries(&trace, 30, 2);
+    segments = trace.segments();
+  }
+  int first_live = segments.front().first_pos;
+  ASSERT_GT(first_live, 0);
+  ASSERT_LT(segments.front().last_pos, 28);
+
+  // 28 is in a later segment than the first live one
+  ExpectReplayStart(prefix_, 29, 28, true);
+  // checkpoints in deleted segments are skipped, so without a live one at or
+  // before the position replay starts at the first live entry
+  if (first_live % 2 != 0) {
+    ExpectReplayStart(prefix_, first_live, first_live, false);
+  } else {
+    ExpectReplayStart(prefix_, first_live - 1, first_live, false);
+  }
+}
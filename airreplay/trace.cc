@@ -2,103 +2,467 @@
 
 #include <glog/logging.h>
 
+#include <string.h>
+
+#include <algorithm>
 #include <iomanip>
+#include <numeric>
 #include <sstream>
 
 #include "airreplay.pb.h"
+#include "trace_format.h"
 
 namespace airreplay {
 
-Trace::Trace(std::string &traceprefix, Mode mode, bool overwrite)
-    : mode_(mode), soft_consumed_(nullptr) {
+namespace {
+// debug txt file recorded alongside a binary segment
+std::string SegmentTxtName(const std::string &binname) {
+  return binname.substr(0, binname.size() - std::string(".bin").size()) +
+         ".txt";
+}
+
+std::vector<TraceSegment> ReadManifestFile(const std::string &manifestname) {
+  std::vector<TraceSegment> segments;
+  std::ifstream manifest(manifestname);
+  TraceSegment segment;
+  while (manifest >> segment.filename >> segment.first_pos >>
+         segment.last_pos >> segment.bytes) {
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+// calls on_record with the serialized OpequeEntry of every record of a
+// single binary trace file (framed or legacy). offset, when nonzero, is the
+// byte offset of the first record. A missing file has no records unless
+// must_exist is set
+template <typename F>
+void ForEachRecord(const std::string &filename, std::streamoff offset,
+                   bool must_exist, F on_record) {
+  std::ifstream file(filename, std::ios::in | std::ios::binary);
+  if (!file) {
+    if (must_exist) {
+      throw std::runtime_error("trace segment " + filename +
+                               " listed in the manifest does not exist");
+    }
+    return;
+  }
+  file.seekg(0, std::ios::end);
+  std::streamoff file_size = std::max<std::streamoff>(file.tellg(), 0);
+  std::string contents(file_size, '\0');
+  file.seekg(0, std::ios::beg);
+  file.read(contents.data(), contents.size());
+
+  uint32_t version;
+  if (format::HasFileHeader(contents, &version)) {
+    if (version != format::kFormatVersion) {
+      throw std::runtime_error("unsupported trace format version " +
+                               std::to_string(version));
+    }
+    format::RecordReader reader(std::string_view(contents).substr(
+        std::max<std::streamoff>(offset, format::kFileHeaderSize)));
+    std::string_view payload;
+    while (reader.Next(&payload)) on_record(payload);
+    if (reader.corrupted() > 0) {
+      LOG(WARNING) << "trace " << filename << ": skipped "
+                   << reader.corrupted() << " damaged regions ("
+                   << reader.skipped_bytes() << " bytes)";
+    }
+    return;
+  }
+  if (offset > 0) {
+    throw std::runtime_error("cannot start a legacy trace " + filename +
+                             " from a checkpoint");
+  }
+  // traces recorded before the framed format: host-endian size_t length
+  // followed by the OpequeEntry bytes, no integrity checks
+  size_t pos = 0;
+  while (pos < contents.size()) {
+    size_t headerLen;
+    if (contents.size() - pos < sizeof(size_t)) {
+      throw std::runtime_error("trace file is corrupted " +
+                               std::to_string(contents.size() - pos));
+    }
+    memcpy(&headerLen, contents.data() + pos, sizeof(size_t));
+    pos += sizeof(size_t);
+    if (contents.size() - pos < headerLen) {
+      throw std::runtime_error(
+          "trace file is corrupted "
+          "buffer " +
+          std::to_string(contents.size() - pos));
+    }
+    on_record(std::string_view(contents).substr(pos, headerLen));
+    pos += headerLen;
+  }
+}
+
+// appends the entries of a single binary trace file to entries
+void LoadTraceFile(const std::string &filename, std::streamoff offset,
+                   bool must_exist,
+                   std::deque<airreplay::OpequeEntry> *entries) {
+  ForEachRecord(filename, offset, must_exist,
+                [entries](std::string_view payload) {
+                  airreplay::OpequeEntry header;
+                  // framed records passed their checksum so this is what the
+                  // recorder wrote
+                  if (!header.ParseFromArray(payload.data(), payload.size())) {
+                    throw std::runtime_error(
+                        "trace record failed to parse after " +
+                        std::to_string(entries->size()) + " events");
+                  }
+                  entries->push_back(std::move(header));
+                });
+}
+}  // namespace
+
+std::deque<airreplay::OpequeEntry> ReadTraceEntries(
+    const std::string &traceprefix, int *first_pos) {
+  std::string manifestname = traceprefix + ".manifest";
+  std::deque<airreplay::OpequeEntry> entries;
+  if (first_pos != nullptr) *first_pos = 0;
+  if (!std::ifstream(manifestname)) {
+    LoadTraceFile(traceprefix + ".bin", 0, false, &entries);
+    return entries;
+  }
+  std::vector<TraceSegment> segments = ReadManifestFile(manifestname);
+  if (first_pos != nullptr && !segments.empty()) {
+    *first_pos = segments.front().first_pos;
+  }
+  for (const auto &segment : segments) {
+    LoadTraceFile(segment.filename, 0, true, &entries);
+  }
+  return entries;
+}
+
+void TraceExtent(const std::string &traceprefix, int *first_pos,
+                 int *end_pos) {
+  std::string manifestname = traceprefix + ".manifest";
+  *first_pos = 0;
+  long records = 0;
+  auto count = [&records](std::string_view) { records++; };
+  if (!std::ifstream(manifestname)) {
+    ForEachRecord(traceprefix + ".bin", 0, false, count);
+  } else {
+    // the manifest is rewritten at rotations only, so the records of the
+    // segments are counted rather than trusting last_pos
+    std::vector<TraceSegment> segments = ReadManifestFile(manifestname);
+    if (!segments.empty()) *first_pos = segments.front().first_pos;
+    for (const auto &segment : segments) {
+      ForEachRecord(segment.filename, 0, true, count);
+    }
+  }
+  *end_pos = *first_pos + records;
+}
+
+void CoalesceSocketEntries(std::deque<airreplay::OpequeEntry> *entries) {
+  if (entries->empty()) {
+    return;
+  }
+  std::deque<airreplay::OpequeEntry> coalesced;
+  coalesced.push_back(std::move(entries->front()));
+  entries->pop_front();
+
+  while (!entries->empty()) {
+    auto &reg_header = entries->front();
+    auto &compacted_header = coalesced.back();
+    DCHECK(compacted_header.rr_debug_string() == "Socket Read" ||
+           compacted_header.rr_debug_string() == "Socket Write" ||
+           compacted_header.rr_debug_string().find("Socket writev of") !=
+               std::string::npos)
+        << "got " << compacted_header.rr_debug_string();
+    if (reg_header.rr_debug_string() == compacted_header.rr_debug_string()) {
+      compacted_header.set_body_size(compacted_header.body_size() +
+                                     reg_header.body_size());
+      compacted_header.mutable_bytes_message()->append(
+          reg_header.bytes_message());
+    } else {
+      coalesced.push_back(std::move(reg_header));
+    }
+    entries->pop_front();
+  }
+  *entries = std::move(coalesced);
+}
+
+const std::string &PayloadBytes(const airreplay::OpequeEntry &entry) {
+  return entry.has_message() ? entry.message().value() : entry.bytes_message();
+}
+
+Trace::Trace(std::string &traceprefix, Mode mode, bool overwrite,
+             TraceOptions options)
+    : mode_(mode),
+      options_(options),
+      traceprefix_(traceprefix),
+      tracetxt_(nullptr),
+      tracebin_(nullptr),
+      soft_consumed_(nullptr) {
   if (mode == Mode::kRecord && !overwrite) {
     int i = 0;
-    while (std::ifstream(tracename_ + "." + std::to_string(i) + ".bin")) {
+    while (std::ifstream(traceprefix + "." + std::to_string(i) + ".bin") ||
+           std::ifstream(traceprefix + "." + std::to_string(i) + ".manifest")) {
       i++;
     }
-    tracename_ += "." + std::to_string(i);
-    txttracename_ += "." + std::to_string(i);
+    traceprefix_ += "." + std::to_string(i);
   }
-  txttracename_ = traceprefix + ".txt";
-  tracename_ = traceprefix + ".bin";
+  manifestname_ = traceprefix_ + ".manifest";
+  indexname_ = traceprefix_ + ".ckpt_index";
+  txttracename_ = traceprefix_ + ".txt";
+  tracename_ = traceprefix_ + ".bin";
   pos_ = 0;
 
-  if (mode == Mode::kRecord && overwrite) {
-    std::remove(txttracename_.c_str());
-    std::remove(tracename_.c_str());
+  if (mode == Mode::kRecord) {
+    if (overwrite) {
+      for (const auto &segment : ReadManifestFile(manifestname_)) {
+        std::remove(segment.filename.c_str());
+        std::remove(SegmentTxtName(segment.filename).c_str());
+      }
+      std::remove(manifestname_.c_str());
+      std::remove(indexname_.c_str());
+      std::remove(txttracename_.c_str());
+      std::remove(tracename_.c_str());
+    }
+
+    if (Segmented()) {
+      OpenSegment();
+      WriteManifest();
+    } else {
+      OpenFiles();
+    }
+    return;
   }
 
-  tracetxt_ = new std::fstream(txttracename_.c_str(),
-                               std::ios::in | std::ios::out | std::ios::app);
-  tracebin_ = new std::fstream(tracename_.c_str(),
-                               std::ios::in | std::ios::out | std::ios::app);
+  bool segmented = static_cast<bool>(std::ifstream(manifestname_));
+  if (segmented) {
+    segments_ = ReadManifestFile(manifestname_);
+    if (!segments_.empty()) {
+      pos_ = segments_.front().first_pos;
+    }
+  }
 
-  if (mode == Mode::kReplay) {
-    tracebin_->seekg(0, std::ios::beg);
+  TraceCheckpoint start;
+  if (options_.replay_from_checkpoint_before >= 0) {
+    if (FindCheckpoint(options_.replay_from_checkpoint_before, &start)) {
+      LOG(INFO) << "starting replay at checkpoint @" << start.pos << " ("
+                << start.filename << "+" << start.offset << ")";
+      pos_ = start.pos;
+      started_at_checkpoint_ = true;
+    } else {
+      LOG(WARNING) << "no checkpoint at or before position "
+                   << options_.replay_from_checkpoint_before
+                   << ". Replaying from the head of the trace";
+    }
+  }
 
-    ssize_t nread;
-    airreplay::OpequeEntry header;
-    size_t headerLen;
-    std::vector<char> buf;
-    /*peek() below is to force eof to be set if next byte is eof*/
-    while (tracebin_->peek(), !tracebin_->eof()) {
-      tracebin_->read((char *)&headerLen, sizeof(size_t));
-      nread = tracebin_->gcount();
-      if (nread < sizeof(size_t)) {
-        throw std::runtime_error("trace file is corrupted " +
-                                 std::to_string(nread));
-      }
-      buf.reserve(headerLen);
-      tracebin_->read(buf.data(), headerLen);
-      nread = tracebin_->gcount();
-      if (nread < headerLen) {
-        throw std::runtime_error(
-            "trace file is corrupted "
-            "buffer " +
-            std::to_string(nread));
-      }
-      if (!header.ParseFromArray(buf.data(), headerLen)) {
-        throw std::runtime_error("trace file is corrupted. parsed" +
-                                 std::to_string(traceEvents_.size()) +
-                                 " events");
-      }
-      traceEvents_.push_back(header);
+  if (segmented) {
+    bool reached_start = !started_at_checkpoint_;
+    for (const auto &segment : segments_) {
+      // segments before the one holding the checkpoint are not loaded
+      reached_start = reached_start || segment.filename == start.filename;
+      if (!reached_start) continue;
+      LoadTraceFile(segment.filename,
+                    segment.filename == start.filename ? start.offset : 0,
+                    true, &traceEvents_);
     }
-    std::cerr << "trace parsed " << traceEvents_.size()
-              << " events for replay \n";
-    const std::atomic<bool> &do_exit = debug_thread_exit_;
-    debug_thread_ = std::thread(&Trace::DebugThread, this, &do_exit);
+  } else {
+    LoadTraceFile(tracename_, started_at_checkpoint_ ? start.offset : 0,
+                  false, &traceEvents_);
   }
+  std::cerr << "trace parsed " << traceEvents_.size()
+            << " events for replay \n";
+  const std::atomic<bool> &do_exit = debug_thread_exit_;
+  debug_thread_ = std::thread(&Trace::DebugThread, this, &do_exit);
 }
 
 Trace::~Trace() {
-  tracetxt_->close();
-  tracebin_->close();
+  if (mode_ == Mode::kRecord && Segmented() && tracebin_ != nullptr) {
+    // a destructor must not throw. The manifest written at the last rotation
+    // still lists every segment, only the size of the last one is stale
+    try {
+      WriteManifest();
+    } catch (const std::exception &e) {
+      LOG(ERROR) << e.what();
+    }
+  }
+  if (tracetxt_ != nullptr) tracetxt_->close();
+  if (tracebin_ != nullptr) tracebin_->close();
   debug_thread_exit_ = true;
   if (debug_thread_.joinable()) {
     debug_thread_.join();
   }
 }
 
+bool Trace::Segmented() {
+  return options_.segment_bytes > 0 || options_.segment_duration.count() > 0;
+}
+
+void Trace::OpenFiles() {
+  if (options_.write_txt) {
+    tracetxt_ = new std::fstream(txttracename_.c_str(),
+                                 std::ios::in | std::ios::out | std::ios::app);
+  }
+  tracebin_ = new std::fstream(tracename_.c_str(),
+                               std::ios::in | std::ios::out | std::ios::app);
+
+  tracebin_->seekp(0, std::ios::end);
+  if (tracebin_->tellp() == 0) {
+    std::string file_header = format::FileHeader();
+    tracebin_->write(file_header.data(), file_header.size());
+    tracebin_->flush();
+  }
+}
+
+void Trace::CloseFiles() {
+  if (tracetxt_ != nullptr) tracetxt_->close();
+  tracebin_->close();
+  delete tracetxt_;
+  delete tracebin_;
+  tracetxt_ = nullptr;
+  tracebin_ = nullptr;
+}
+
+void Trace::OpenSegment() {
+  std::string segprefix =
+      traceprefix_ + ".seg" + std::to_string(next_segment_++);
+  txttracename_ = segprefix + ".txt";
+  tracename_ = segprefix + ".bin";
+  std::remove(txttracename_.c_str());
+  std::remove(tracename_.c_str());
+  OpenFiles();
+
+  segments_.push_back(
+      {tracename_, pos_, pos_ - 1, format::kFileHeaderSize});
+  segment_start_ = std::chrono::steady_clock::now();
+}
+
+void Trace::Rotate() {
+  CloseFiles();
+  OpenSegment();
+  EnforceRetention();
+  WriteManifest();
+}
+
+void Trace::EnforceRetention() {
+  if (options_.retention_bytes == 0) return;
+
+  size_t total = 0;
+  for (const auto &segment : segments_) {
+    total += segment.bytes;
+  }
+  while (total > options_.retention_bytes && segments_.size() > 1) {
+    const TraceSegment &oldest = segments_.front();
+    std::remove(oldest.filename.c_str());
+    std::remove(SegmentTxtName(oldest.filename).c_str());
+    LOG(INFO) << "trace retention: deleted segment " << oldest.filename
+              << " with entries [" << oldest.first_pos << ", "
+              << oldest.last_pos << "]";
+    total -= oldest.bytes;
+    segments_.erase(segments_.begin());
+  }
+}
+
+// the manifest is a text file with one "<filename> <first_pos> <last_pos>
+// <bytes>" line per live segment. It is rewritten through a temporary file so
+// a crash never leaves a half-written manifest behind
+void Trace::WriteManifest() {
+  std::string tmpname = manifestname_ + ".tmp";
+  {
+    std::ofstream manifest(tmpname, std::ios::out | std::ios::trunc);
+    for (const auto &segment : segments_) {
+      manifest << segment.filename << " " << segment.first_pos << " "
+               << segment.last_pos << " " << segment.bytes << "\n";
+    }
+  }
+  if (std::rename(tmpname.c_str(), manifestname_.c_str()) != 0) {
+    throw std::runtime_error("failed to write trace manifest " +
+                             manifestname_);
+  }
+}
+
+// the checkpoint index is a text file with one "<pos> <filename> <offset>"
+// line per recorded checkpoint where offset is the byte offset of the
+// checkpoint record in the binary file
+bool Trace::FindCheckpoint(int before, TraceCheckpoint *checkpoint) {
+  std::ifstream index(indexname_);
+  TraceCheckpoint candidate;
+  bool found = false;
+  while (index >> candidate.pos >> candidate.filename >> candidate.offset) {
+    if (candidate.pos > before) break;
+    bool live = segments_.empty();
+    for (const auto &segment : segments_) {
+      live = live || segment.filename == candidate.filename;
+    }
+    // checkpoints in segments removed by retention cannot be used
+    if (live) {
+      *checkpoint = candidate;
+      found = true;
+    }
+  }
+  return found;
+}
+
 std::string Trace::tracename() { return tracename_; }
+const std::vector<TraceSegment> &Trace::segments() { return segments_; }
 std::size_t Trace::size() { return traceEvents_.size(); }
 bool Trace::isReplay() { return mode_; }
 int Trace::pos() { return pos_; }
 
 int Trace::Record(const airreplay::OpequeEntry &header) {
   assert(mode_ == Mode::kRecord);
-  *tracetxt_ << header.ShortDebugString() << std::endl;
+  if (tracetxt_ != nullptr) {
+    *tracetxt_ << header.ShortDebugString() << std::endl;
+  }
 #ifdef USE_OLD_PROTOBUF
   size_t hdr_len = header.ByteSize();
 #else
   size_t hdr_len = header.ByteSizeLong();
 #endif
-  tracebin_->write((char *)&hdr_len, sizeof(size_t));
-  header.SerializeToOstream(tracebin_);
+  std::string payload;
+  payload.reserve(hdr_len);
+  header.SerializeToString(&payload);
+  // the payload is written as is, entries may be large
+  format::RecordFrame frame = format::FrameRecord(payload);
+  tracebin_->write(frame.head, frame.head_size);
+  tracebin_->write(payload.data(), payload.size());
+  tracebin_->write(frame.tail, sizeof(frame.tail));
+  size_t record_size = frame.head_size + payload.size() + sizeof(frame.tail);
+
+  if (options_.flush_each_entry) Flush();
+  if (!Segmented()) {
+    return pos_++;
+  }
+
+  TraceSegment &current = segments_.back();
+  current.bytes += record_size;
+  current.last_pos = pos_;
+  int pos = pos_++;
+  if ((options_.segment_bytes > 0 &&
+       current.bytes >= options_.segment_bytes) ||
+      (options_.segment_duration.count() > 0 &&
+       std::chrono::steady_clock::now() - segment_start_ >=
+           options_.segment_duration)) {
+    Rotate();
+  }
+  return pos;
+}
+
+int Trace::RecordCheckpoint(const airreplay::OpequeEntry &header) {
+  assert(mode_ == Mode::kRecord);
+  tracebin_->seekp(0, std::ios::end);
+  std::streamoff offset = tracebin_->tellp();
+  // Record may rotate to a new segment so remember where this one goes
+  std::string filename = tracename_;
+  int pos = Record(header);
+
+  std::ofstream index(indexname_, std::ios::out | std::ios::app);
+  index << pos << " " << filename << " " << offset << "\n";
+  return pos;
+}
 
-  tracetxt_->flush();
+bool Trace::StartedAtCheckpoint() { return started_at_checkpoint_; }
+
+void Trace::Flush() {
+  assert(mode_ == Mode::kRecord);
+  if (tracetxt_ != nullptr) tracetxt_->flush();
   tracebin_->flush();
-  return pos_++;
 }
 
 int Trace::Record(const std::string &payload, const std::string &debug_string) {
@@ -173,6 +537,10 @@ bool Trace::SoftConsumeHead(const OpequeEntry &expectedHead) {
   return true;
 }
 
+bool Trace::IsSoftConsumed(const OpequeEntry &head) {
+  return soft_consumed_ == &head;
+}
+
 void Trace::DebugThread(const std::atomic<bool> &do_exit) {
   assert(mode_ == Mode::kReplay);
 
@@ -189,68 +557,262 @@ void Trace::DebugThread(const std::atomic<bool> &do_exit) {
 //  we do not accidentally pass more data to the wire than needed
 void Trace::Coalesce() {
   assert(mode_ == Mode::kReplay);
-  if (traceEvents_.empty()) {
-    return;
-  }
   int orig_len = traceEvents_.size();
-  std::deque<airreplay::OpequeEntry> newTraceEvents;
-  newTraceEvents.push_back(traceEvents_.front());
-  traceEvents_.pop_front();
+  CoalesceSocketEntries(&traceEvents_);
+  LOG(INFO) << "Coalesced " << orig_len << " to " << traceEvents_.size()
+            << std::endl;
+}
 
-  while (!traceEvents_.empty()) {
-    auto &reg_header = traceEvents_.front();
-    auto &compacted_header = newTraceEvents.back();
-    DCHECK(compacted_header.rr_debug_string() == "Socket Read" ||
-           compacted_header.rr_debug_string() == "Socket Write" ||
-           compacted_header.rr_debug_string().find("Socket writev of") !=
-               std::string::npos)
-        << "got " << compacted_header.rr_debug_string();
-    if (reg_header.rr_debug_string() == compacted_header.rr_debug_string()) {
-      compacted_header.set_body_size(compacted_header.body_size() +
-                                     reg_header.body_size());
-      compacted_header.mutable_bytes_message()->append(
-          reg_header.bytes_message());
-    } else {
-      newTraceEvents.push_back(reg_header);
+namespace {
+TraceStore::Kind EntryKind(const airreplay::OpequeEntry &entry) {
+  const std::string &debug_string = entry.rr_debug_string();
+  if (debug_string.find("Socket Read") != std::string::npos) {
+    return TraceStore::kRead;
+  }
+  if (debug_string.find("Socket Write") != std::string::npos ||
+      debug_string.find("Socket writev of") != std::string::npos) {
+    return TraceStore::kWrite;
+  }
+  return TraceStore::kOther;
+}
+
+// the bytes of the entry leading to child from offset pos on, cut to len
+std::string_view ReadKey(const TraceStore::Node &child, int pos, size_t len) {
+  if (child.bytes.size() <= (size_t)pos) return std::string_view();
+  return child.bytes.substr(pos, len);
+}
+}  // namespace
+
+TraceStore::TraceStore(std::vector<std::vector<airreplay::OpequeEntry>> traces)
+    : traces_(std::move(traces)) {
+  nodes_.emplace_back();
+  for (int i = 0; i < (int)traces_.size(); i++) {
+    nodes_[kRoot].traces.push_back(i);
+  }
+  // nodes_ grows while it is walked, so nodes are accessed by index
+  for (size_t n = 0; n < nodes_.size(); n++) {
+    size_t entry = nodes_[n].entry;
+    std::vector<std::pair<std::pair<Kind, std::string_view>, int>> live;
+    int ended = 0;
+    for (int trace : nodes_[n].traces) {
+      if (entry >= traces_[trace].size()) {
+        ended++;
+        continue;
+      }
+      const auto &header = traces_[trace][entry];
+      live.push_back({{EntryKind(header), header.bytes_message()}, trace});
+    }
+    std::sort(live.begin(), live.end());
+
+    std::vector<int> children;
+    size_t read_children = 0;
+    for (size_t k = 0; k < live.size(); k++) {
+      if (k == 0 || live[k].first != live[k - 1].first) {
+        children.push_back(nodes_.size());
+        Node child;
+        child.entry = entry + 1;
+        child.kind = live[k].first.first;
+        child.bytes = live[k].first.second;
+        if (child.kind == kRead) read_children++;
+        nodes_.push_back(std::move(child));
+      }
+      nodes_.back().traces.push_back(live[k].second);
     }
-    traceEvents_.pop_front();
+    nodes_[n].ended = ended;
+    nodes_[n].children = std::move(children);
+    nodes_[n].read_children = read_children;
   }
-  traceEvents_ = std::move(newTraceEvents);
-  LOG(INFO) << "Coalesced " << orig_len << " to " << traceEvents_.size()
-            << std::endl;
+
+  index_.resize(traces_.size());
+  for (int i = 0; i < (int)traces_.size(); i++) {
+    BuildIndex(i);
+  }
+}
+
+void TraceStore::BuildIndex(int trace) {
+  const auto &entries = traces_[trace];
+  SuffixIndex &index = index_[trace];
+  size_t total = 0;
+  for (const auto &entry : entries) {
+    index.starts.push_back(total);
+    total += entry.bytes_message().size();
+  }
+  if (total > UINT32_MAX) {
+    throw std::runtime_error("TraceStore: trace is too large to index");
+  }
+  index.starts.push_back(total);
+  if (total == 0) return;
+
+  // rank[i] orders suffix i by its first k bytes. Doubling k until the only
+  // ties left are suffixes equal to their end sorts the suffixes. Each round
+  // is two linear passes: the order by the second k bytes comes from the
+  // previous round, and a stable counting sort by the first k bytes ends it
+  std::vector<uint32_t> end_of(total), rank(total), next(total);
+  std::vector<uint32_t> order(total), count;
+  for (size_t e = 0, i = 0; e < entries.size(); e++) {
+    for (unsigned char c : entries[e].bytes_message()) {
+      end_of[i] = index.starts[e + 1];
+      rank[i++] = c + 1;
+    }
+  }
+  std::vector<uint32_t> &suffixes = index.suffixes;
+  suffixes.resize(total);
+  uint32_t ranks = 256;
+  auto sort_by_rank = [&]() {
+    count.assign(ranks + 2, 0);
+    for (uint32_t i : order) count[rank[i] + 1]++;
+    std::partial_sum(count.begin(), count.end(), count.begin());
+    for (uint32_t i : order) suffixes[count[rank[i]]++] = i;
+  };
+  std::iota(order.begin(), order.end(), 0);
+  sort_by_rank();
+  for (size_t k = 1;; k *= 2) {
+    // rank of the k bytes after the first k, 0 past the end of the entry
+    auto second = [&](uint32_t i) -> uint32_t {
+      size_t j = i + k;
+      return j < end_of[i] ? rank[j] : 0;
+    };
+    size_t n = 0;
+    for (uint32_t i = 0; i < total; i++) {
+      if (second(i) == 0) order[n++] = i;
+    }
+    for (uint32_t s : suffixes) {
+      if (s >= k && end_of[s - k] == end_of[s]) order[n++] = s - k;
+    }
+    sort_by_rank();
+    bool sorted = true;
+    next[suffixes[0]] = 1;
+    for (size_t i = 1; i < total; i++) {
+      uint32_t a = suffixes[i - 1];
+      uint32_t b = suffixes[i];
+      bool same = rank[a] == rank[b] && second(a) == second(b);
+      next[b] = next[a] + (same ? 0 : 1);
+      if (same && end_of[b] - b > 2 * k) sorted = false;
+    }
+    rank.swap(next);
+    ranks = rank[suffixes[total - 1]];
+    if (sorted) break;
+  }
+
+  size_t blocks = (total + kBlock - 1) / kBlock;
+  index.block_max.assign(2 * blocks, 0);
+  for (size_t i = 0; i < total; i++) {
+    uint32_t &leaf = index.block_max[blocks + i / kBlock];
+    leaf = std::max(leaf, (uint32_t)EntryOf(trace, suffixes[i]));
+  }
+  for (size_t b = blocks - 1; b > 0; b--) {
+    index.block_max[b] =
+        std::max(index.block_max[2 * b], index.block_max[2 * b + 1]);
+  }
+}
+
+int TraceStore::EntryOf(int trace, uint32_t suffix) const {
+  const auto &starts = index_[trace].starts;
+  return std::upper_bound(starts.begin(), starts.end(), suffix) -
+         starts.begin() - 1;
 }
 
-TraceGroup::TraceGroup() {}
-void TraceGroup::AddTrace(std::deque<airreplay::OpequeEntry> &&trace) {
-  traces_.push_back(std::move(trace));
+std::string_view TraceStore::SuffixAt(int trace, uint32_t suffix) const {
+  int entry = EntryOf(trace, suffix);
+  std::string_view bytes = traces_[trace][entry].bytes_message();
+  return bytes.substr(suffix - index_[trace].starts[entry]);
 }
 
+long TraceStore::LastContaining(int trace, std::string_view needle) const {
+  if (needle.empty()) return (long)traces_[trace].size() - 1;
+  const SuffixIndex &index = index_[trace];
+  auto prefix = [&](uint32_t suffix) {
+    return SuffixAt(trace, suffix).substr(0, needle.size());
+  };
+  auto begin = index.suffixes.begin();
+  auto end = index.suffixes.end();
+  auto first = std::lower_bound(begin, end, needle, [&](uint32_t s, auto key) {
+    return prefix(s) < key;
+  });
+  auto last = std::upper_bound(first, end, needle, [&](auto key, uint32_t s) {
+    return key < prefix(s);
+  });
+
+  // every suffix in [lo, hi) starts with needle. The last entry holding one
+  // is the max over the range: partial blocks are scanned, whole blocks are
+  // looked up in the max tree
+  size_t lo = first - begin;
+  size_t hi = last - begin;
+  long last_entry = -1;
+  auto scan = [&](size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+      long entry = EntryOf(trace, index.suffixes[i]);
+      last_entry = std::max(last_entry, entry);
+    }
+  };
+  size_t first_block = (lo + kBlock - 1) / kBlock;
+  size_t last_block = hi / kBlock;
+  if (first_block >= last_block) {
+    scan(lo, hi);
+    return last_entry;
+  }
+  scan(lo, first_block * kBlock);
+  scan(last_block * kBlock, hi);
+  size_t blocks = index.block_max.size() / 2;
+  for (size_t l = first_block + blocks, r = last_block + blocks; l < r;
+       l /= 2, r /= 2) {
+    if (l & 1) last_entry = std::max(last_entry, (long)index.block_max[l++]);
+    if (r & 1) last_entry = std::max(last_entry, (long)index.block_max[--r]);
+  }
+  return last_entry;
+}
+
+TraceGroup::TraceGroup() : TraceGroup(std::make_shared<TraceStore>()) {}
+
 TraceGroup::TraceGroup(std::vector<std::deque<airreplay::OpequeEntry>> traces)
-    : traces_(traces) {}
+    : TraceGroup([&traces]() {
+        std::vector<std::vector<airreplay::OpequeEntry>> entries;
+        for (auto &trace : traces) {
+          entries.emplace_back(std::make_move_iterator(trace.begin()),
+                               std::make_move_iterator(trace.end()));
+        }
+        return std::make_shared<TraceStore>(std::move(entries));
+      }()) {}
+
+TraceGroup::TraceGroup(std::shared_ptr<const TraceStore> store)
+    : store_(std::move(store)) {
+  cursors_.push_back(Enter(TraceStore::kRoot));
+}
 
-bool TraceGroup::NextIs(std::string val, bool empty_is_ok = true) {
-  for (auto &trace : traces_) {
-    if (trace.empty()) {
-      LOG(INFO) << "TraceGroup::NextIsReadOrEmpty: trace is empty" << std::endl;
-      return empty_is_ok;
+TraceGroup::Cursor TraceGroup::Enter(int node) const {
+  Cursor cursor;
+  cursor.node = node;
+  cursor.hi = store_->node(node).children.size();
+  return cursor;
+}
+
+bool TraceGroup::NextIs(TraceStore::Kind kind, bool empty_is_ok) {
+  for (const Cursor &cursor : cursors_) {
+    const auto &node = store_->node(cursor.node);
+    if (cursor.pos == 0 && node.ended > 0) {
+      LOG(INFO) << "TraceGroup::NextIs: trace is empty" << std::endl;
+      if (!empty_is_ok) return false;
+      continue;
     }
-    auto &header = trace.front();
-    if (header.rr_debug_string().find(val) == std::string::npos) {
+    if (cursor.lo == cursor.hi) continue;
+    // children are sorted by kind, so checking both ends covers the range
+    if (store_->node(node.children[cursor.lo]).kind != kind ||
+        store_->node(node.children[cursor.hi - 1]).kind != kind) {
       return false;
     }
   }
   return true;
 }
 
-bool TraceGroup::NextIsWrite() {
-  return NextIs("Socket Write", false) || NextIs("Socket writev of", false);
-}
+bool TraceGroup::NextIsWrite() { return NextIs(TraceStore::kWrite, false); }
 
-bool TraceGroup::NextIsReadOrEmpty() { return NextIs("Socket Read", true); }
+bool TraceGroup::NextIsReadOrEmpty() {
+  return NextIs(TraceStore::kRead, true);
+}
 
 bool TraceGroup::AllEmpty() {
-  for (const auto &trace : traces_) {
-    if (!trace.empty()) {
+  for (const Cursor &cursor : cursors_) {
+    if (cursor.pos != 0 || !store_->node(cursor.node).children.empty()) {
       return false;
     }
   }
@@ -258,63 +820,110 @@ bool TraceGroup::AllEmpty() {
 }
 
 void TraceGroup::ConsumeRead(uint8_t *buffer, int len) {
-  std::vector<std::deque<airreplay::OpequeEntry>> updated_traces;
-  bool pop_front = false;
-  for (auto &trace : traces_) {
-    int remaining_on_head = -1;
+  Consume(std::string_view(reinterpret_cast<const char *>(buffer), len));
+}
+
+void TraceGroup::Consume(std::string_view read) {
+  std::vector<Cursor> cursors;
+  for (Cursor &cursor : cursors_) {
+    Advance(std::move(cursor), read, &cursors);
+  }
+  SetCursors(std::move(cursors));
+}
 
-    if (trace.empty()) {
-      LOG(INFO) << "TraceGroup::ConsumeRead: trace is empty" << std::endl;
+void TraceGroup::Advance(Cursor start, std::string_view input,
+                         std::vector<Cursor> *out) const {
+  // cursors with the part of input still to match after them
+  std::vector<std::pair<Cursor, std::string_view>> pending;
+  pending.emplace_back(std::move(start), input);
+  while (!pending.empty()) {
+    Cursor cursor = std::move(pending.back().first);
+    std::string_view read = pending.back().second;
+    pending.pop_back();
+    const auto &node = store_->node(cursor.node);
+    if (read.empty()) {
+      out->push_back(std::move(cursor));
       continue;
     }
-    auto &header = trace.front();
-    if (remaining_on_head == -1) remaining_on_head = header.body_size() - pos_;
-
-    // all traces must agree how large the read is
-    if (header.rr_debug_string() != "Socket Read") {
-      throw std::runtime_error(
-          "TraceGroup::ConsumeRead: header.rr_debug_string() != \"Socket "
-          "Read\"");
+    if (cursor.pos == 0) {
+      if (node.read_children == 0 && !node.children.empty()) {
+        // the peer sent its next request before the recorded responses to
+        // the previous one were written. Matched once they are
+        cursor.unread.append(read);
+        out->push_back(std::move(cursor));
+        continue;
+      }
+      // traces that ended are dropped, all others must be reading
+      if (node.read_children != node.children.size()) {
+        throw std::runtime_error(
+            "TraceGroup::ConsumeRead: header.rr_debug_string() != \"Socket "
+            "Read\"");
+      }
+      cursor.lo = 0;
+      cursor.hi = node.read_children;
     }
 
-    if (len > remaining_on_head) {
-      LOG(INFO) << "TraceGroup::ConsumeRead: len=" + std::to_string(len) +
-                       " > remaining_on_head=" +
-                       std::to_string(remaining_on_head)
-                << "DROPPING THE TRACE FROM THE GROUP" << std::endl;
-      continue;
+    // the children in [lo, hi) share their first pos bytes and are sorted,
+    // so the ones continuing with read are a contiguous subrange
+    int pos = cursor.pos;
+    auto begin = node.children.begin() + cursor.lo;
+    auto end = node.children.begin() + cursor.hi;
+    auto first = std::lower_bound(begin, end, read, [&](int child, auto key) {
+      return ReadKey(store_->node(child), pos, key.size()) < key;
+    });
+    auto last = std::upper_bound(first, end, read, [&](auto key, int child) {
+      return key < ReadKey(store_->node(child), pos, key.size());
+    });
+
+    // read may also run past the end of entries into the next ones, as
+    // recorded entries are only boundaries of the stream. Those sort before
+    // the range, and each is followed by a cursor of its own
+    bool matched = first != last;
+    for (auto it = begin; it != first; it++) {
+      std::string_view rest = store_->node(*it).bytes.substr(pos);
+      if (rest.size() < read.size() && read.substr(0, rest.size()) == rest) {
+        pending.emplace_back(Enter(*it), read.substr(rest.size()));
+        matched = true;
+      }
     }
-
-    if (memcmp(header.bytes_message().substr(pos_).data(), buffer, len) != 0) {
-      LOG(INFO) << "TraceGroup::ConsumeRead: "
-                   "memcmp(header.bytes_message().data(), buffer, len) != 0"
-                << std::endl;
+    if (!matched) {
+      LOG(INFO) << "TraceGroup:: no trace matches the read" << std::endl;
       continue;
-    } else {
-      LOG(INFO) << "actually found a trace with matching message" << std::endl;
     }
-
-    if (len == remaining_on_head) {
-      pop_front = true;
+    if (first == last) continue;
+
+    LOG(INFO) << "TraceGroup:: Updated traces from " << cursor.hi - cursor.lo
+              << " distinct entries to " << last - first << std::endl;
+    cursor.lo = first - node.children.begin();
+    cursor.hi = last - node.children.begin();
+    cursor.pos += read.size();
+    // the shortest entry sorts first. If it was read fully, the next read
+    // may start the next entry of its traces or continue a longer entry
+    const auto &shortest = store_->node(node.children[cursor.lo]);
+    if (shortest.bytes.size() == (size_t)cursor.pos) {
+      out->push_back(Enter(node.children[cursor.lo]));
+      cursor.lo++;
     }
-    updated_traces.push_back(std::move(trace));
+    if (cursor.lo < cursor.hi) out->push_back(std::move(cursor));
   }
+}
 
-  if (!pop_front) {
-    // we did not drop the head but just consumed len bytes from it. update pos_
-    // to reflect that.
-    pos_ += len;
-  } else {
-    for (auto &trace : updated_traces) {
-      DCHECK(trace.front().body_size() == pos_ + len);
-      trace.pop_front();
+void TraceGroup::SetCursors(std::vector<Cursor> cursors) {
+  // cursors that followed different entries reach different nodes, so
+  // duplicates only come from equal cursors splitting the same way
+  cursors_.clear();
+  for (Cursor &cursor : cursors) {
+    bool seen = false;
+    for (const Cursor &other : cursors_) {
+      if (other.node == cursor.node && other.pos == cursor.pos &&
+          other.lo == cursor.lo && other.hi == cursor.hi &&
+          other.unread == cursor.unread) {
+        seen = true;
+        break;
+      }
     }
-    pos_ = 0;
+    if (!seen) cursors_.push_back(std::move(cursor));
   }
-
-  LOG(INFO) << "TraceGroup:: Updated traces from length " << traces_.size()
-            << " to " << updated_traces.size() << std::endl;
-  traces_ = std::move(updated_traces);
 }
 
 std::string toHex(const std::string &m) {
@@ -327,73 +936,72 @@ std::string toHex(const std::string &m) {
 }
 
 bool TraceGroup::StillBefore(const airreplay::OpequeEntry &msg) {
-  for (auto &trace : traces_) {
-    if (trace.empty()) {
-      LOG(INFO) << "TraceGroup::StillBefore: trace is empty" << std::endl;
-      continue;
-    }
-
-    bool in_curr_trace = false;
-    for (const auto &header : trace) {
-
-      if (header.bytes_message().find(msg.message().value().substr(
-              10, msg.message().value().size() - 12)) != std::string::npos) {
-        LOG(INFO) << "TraceGroup::StillBefore: header.rr_debug_string()=" +
-                         header.rr_debug_string() +
-                         " msg.rr_debug_string()=" + msg.rr_debug_string() +
-                         " msg_body=(" + msg.message().value() + ")" +
-                         " header_body=(" + header.bytes_message() + ")"
-                  << std::endl;
-        in_curr_trace = true;
-        break;
+  std::string_view needle = PayloadBytes(msg);
+  if (needle.size() >= 12) needle = needle.substr(10, needle.size() - 12);
+  for (const Cursor &cursor : cursors_) {
+    const auto &node = store_->node(cursor.node);
+    for (size_t c = cursor.lo; c < cursor.hi; c++) {
+      for (int trace : store_->node(node.children[c]).traces) {
+        if (store_->LastContaining(trace, needle) < (long)node.entry) {
+          return false;
+        }
       }
     }
-    if (!in_curr_trace) {
-      return false;
-    }
   }
   return true;
 }
 
 int TraceGroup::NextCommonWrite(uint8_t *buffer, int buffer_len) {
-  DCHECK(traces_.size() > 0);
-  std::string msg = traces_.front().front().bytes_message();
-  DCHECK(msg.size() == traces_.front().front().body_size());
-
-  if (msg.size() > buffer_len) {
-    throw std::runtime_error("write size is bigger than buffer");
+  for (const Cursor &cursor : cursors_) {
+    const auto &node = store_->node(cursor.node);
+    if (cursor.pos == 0 && !node.children.empty() &&
+        store_->node(node.children.front()).bytes.size() >
+            (size_t)buffer_len) {
+      throw std::runtime_error("write size is bigger than buffer");
+    }
   }
+  std::string msg = NextCommonWrite();
+  memcpy(buffer, msg.data(), msg.size());
+  return msg.size();
+}
 
-  for (auto &tarce : traces_) {
-    if (tarce.empty()) {
-      throw std::runtime_error("trace is empty");
-    }
-    auto &header = tarce.front();
-    if (header.rr_debug_string() != "Socket Write" &&
-        header.rr_debug_string().find("Socket writev of") ==
-            std::string::npos) {
+std::string TraceGroup::NextCommonWrite() {
+  return std::string(NextCommonWriteView());
+}
+
+std::string_view TraceGroup::NextCommonWriteView() {
+  if (cursors_.empty()) {
+    throw std::runtime_error("trace is empty");
+  }
+  std::string_view msg;
+  for (size_t i = 0; i < cursors_.size(); i++) {
+    const auto &node = store_->node(cursors_[i].node);
+    if (cursors_[i].pos != 0) {
       throw std::runtime_error("trace is not a write");
     }
-    if (header.body_size() != msg.size()) {
-      LOG(INFO) << "TraceGroup::NextCommonWrite: header.body_size() =" +
-                       std::to_string(header.body_size()) +
-                       " != msg.size()=" + std::to_string(msg.size())
-                << std::endl;
-      throw std::runtime_error("trace is not a write of the same size" +
-                               std::to_string(header.body_size()) + " vs " +
-                               std::to_string(msg.size()));
+    if (node.ended > 0 || node.children.empty()) {
+      throw std::runtime_error("trace is empty");
     }
-
-    if (memcmp(header.bytes_message().data(), msg.data(), msg.size()) != 0) {
+    for (int child : node.children) {
+      if (store_->node(child).kind != TraceStore::kWrite) {
+        throw std::runtime_error("trace is not a write");
+      }
+    }
+    // children are distinct entries, so the traces disagree on the write
+    std::string_view bytes = store_->node(node.children.front()).bytes;
+    if (node.children.size() > 1 || (i > 0 && bytes != msg)) {
       throw std::runtime_error("trace is not a write of the same data");
     }
+    msg = bytes;
   }
 
-  memcpy(buffer, msg.data(), msg.size());
-  for (auto &trace : traces_) {
-    trace.pop_front();
+  std::vector<Cursor> cursors;
+  for (const Cursor &cursor : cursors_) {
+    int child = store_->node(cursor.node).children.front();
+    Advance(Enter(child), cursor.unread, &cursors);
   }
-  return msg.size();
+  SetCursors(std::move(cursors));
+  return msg;
 }
 
 }  // namespace airreplay
\ No newline at end of file
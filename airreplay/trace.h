@@ -1,30 +1,109 @@
 #ifndef TRACE_H
 #define TRACE_H
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <deque>
 #include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 #include "airreplay.pb.h"
 
 namespace airreplay {
 enum Mode { kRecord, kReplay };
 
-// group of traces, used to figure out what to replay as a as server
+// serialized message of a RecordReplay entry. Kinds with a registered type
+// are recorded as plain bytes, all others as an Any
+const std::string &PayloadBytes(const airreplay::OpequeEntry &entry);
+
+// socket traces loaded once and shared read-only by every TraceGroup, so
+// replaying many connections against them copies no recorded bytes.
+// The traces are indexed as a trie of their entries. Traces that recorded the
+// same entries so far share a node, and the children of a node (one per
+// distinct next entry) are sorted by kind and bytes, so the children that
+// start with the bytes read so far are a contiguous range found by binary
+// search. Each trace also gets a suffix array, to find the last entry that
+// holds a message without scanning the trace
+class TraceStore {
+ public:
+  enum Kind { kRead, kWrite, kOther };
+  struct Node {
+    // index of the next entry of the traces under this node
+    size_t entry = 0;
+    // traces whose first `entry` entries lead to this node
+    std::vector<int> traces;
+    // how many of them have no more entries
+    int ended = 0;
+    // one per distinct next entry, sorted by (kind, bytes). Reads come first
+    std::vector<int> children;
+    size_t read_children = 0;
+    // the entry leading to this node from its parent
+    Kind kind = kOther;
+    std::string_view bytes;
+  };
+  static constexpr int kRoot = 0;
+
+  explicit TraceStore(
+      std::vector<std::vector<airreplay::OpequeEntry>> traces = {});
+  TraceStore(const TraceStore &) = delete;
+  TraceStore &operator=(const TraceStore &) = delete;
+
+  const std::vector<std::vector<airreplay::OpequeEntry>> &traces() const {
+    return traces_;
+  }
+  const Node &node(int index) const { return nodes_[index]; }
+  // the index of the last entry of trace whose bytes contain needle, or -1.
+  // A binary search in the trace's suffix index, so it neither scans nor
+  // copies the recorded bytes
+  long LastContaining(int trace, std::string_view needle) const;
+
+ private:
+  // suffix array of one trace. Every entry's bytes are a separate string:
+  // suffixes hold byte offsets into the concatenated entries and end at the
+  // end of their entry, so a match never spans two entries
+  struct SuffixIndex {
+    // offset of each entry, and the total size last
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> suffixes;
+    // max tree over the entries of blocks of kBlock suffixes, leaves last
+    std::vector<uint32_t> block_max;
+  };
+  static constexpr size_t kBlock = 64;
+
+  std::vector<std::vector<airreplay::OpequeEntry>> traces_;
+  std::vector<Node> nodes_;
+  std::vector<SuffixIndex> index_;
+
+  void BuildIndex(int trace);
+  // the entry holding byte offset suffix of trace, and its bytes from there
+  int EntryOf(int trace, uint32_t suffix) const;
+  std::string_view SuffixAt(int trace, uint32_t suffix) const;
+};
+
 class TraceGroup {
  public:
   TraceGroup();
   TraceGroup(std::vector<std::deque<airreplay::OpequeEntry>> traces);
+  // all traces of store are candidates. Copies of a TraceGroup share store
+  // and only copy the cursors
+  explicit TraceGroup(std::shared_ptr<const TraceStore> store);
 
-  void AddTrace(std::deque<airreplay::OpequeEntry> &&trace);
   // returns true if all members of the trace group have a Socket Read at the
   // next position
   bool AllEmpty();
   bool NextIsReadOrEmpty();
-  // goes through referenced traces and advances all traces that had a read
-  // operation with the exact value corresponding to the passed buffer. all
-  // traces that had a read with a different value are dropped from the current
-  // TraceGroup
+  // goes through referenced traces and advances all traces whose recorded
+  // reads continue with the passed buffer. all traces that read different
+  // bytes are dropped from the current TraceGroup. Reads are matched as a
+  // stream: a buffer may end inside a recorded read or run past its end into
+  // the next one, and bytes the peer sent before the recorded writes are kept
+  // until those are replayed. Matching traces are found by binary search
+  // among the distinct next entries, so the cost does not grow with the
+  // number of traces
   void ConsumeRead(uint8_t *buffer, int len);
   // returns true if all members of the trace group have a Socket Write at the
   // next position
@@ -35,14 +114,88 @@ class TraceGroup {
   // so, clients are expected to check whether a common write is available via a
   // NextIsWrite Call
   int NextCommonWrite(uint8_t *buffer, int buffer_len);
+  // same, but returns the write whatever its size
+  std::string NextCommonWrite();
+  // same, without copying. The bytes belong to the shared TraceStore and
+  // stay valid as long as this group or a copy of it does
+  std::string_view NextCommonWriteView();
 
+  // returns true if every candidate trace still has msg at or after the next
+  // entry. msg is matched without its 10 byte header and 2 byte trailer,
+  // payloads too short to have them are matched whole
   bool StillBefore(const airreplay::OpequeEntry &msg);
 
  private:
-  std::vector<std::deque<airreplay::OpequeEntry>> traces_;
-  int pos_ = 0;
+  // a position in the trie: the node of the entries replayed so far, the
+  // range of its children that match the pos bytes read of the next entry,
+  // and bytes read ahead of recorded writes, matched once they are replayed
+  struct Cursor {
+    int node = TraceStore::kRoot;
+    size_t lo = 0;
+    size_t hi = 0;
+    int pos = 0;
+    std::string unread;
+  };
+
+  std::shared_ptr<const TraceStore> store_;
+  // one cursor per way the bytes read so far split into recorded entries,
+  // as a read may complete entries of different lengths. Empty once no
+  // trace matches what was read
+  std::vector<Cursor> cursors_;
 
-  bool NextIs(std::string debug_string_prefix, bool empty_is_ok);
+  Cursor Enter(int node) const;
+  void Consume(std::string_view read);
+  // matches input from start on and adds the cursors it ends in to out
+  void Advance(Cursor start, std::string_view input,
+               std::vector<Cursor> *out) const;
+  void SetCursors(std::vector<Cursor> cursors);
+  bool NextIs(TraceStore::Kind kind, bool empty_is_ok);
+};
+
+// Controls rotation of a recorded trace into numbered segments.
+// With both thresholds at zero (the default) the trace is a single
+// <prefix>.bin file. Otherwise it is written as <prefix>.seg<N>.bin (plus the
+// matching .txt) and a new segment is started once the current one reaches
+// segment_bytes or has been open for segment_duration. <prefix>.manifest lists
+// the live segments in order and is what replay reads.
+struct TraceOptions {
+  size_t segment_bytes = 0;
+  std::chrono::seconds segment_duration{0};
+  // when nonzero, the oldest segments are deleted once the binary segments
+  // together exceed this many bytes. The segment being written is never
+  // deleted
+  size_t retention_bytes = 0;
+
+  // replay only. When non-negative, replay starts at the last checkpoint
+  // recorded at or before this position instead of at the head of the trace.
+  // The checkpoint is located through <prefix>.ckpt_index so entries before
+  // it are never parsed
+  int replay_from_checkpoint_before = -1;
+
+  // record only. Also writes every entry in text form to the .txt file next
+  // to the binary trace, for debugging. Costs a text serialization and a
+  // flush per entry
+  bool write_txt = true;
+
+  // record only. Flushes the trace files after every entry so that a crash
+  // loses none. Writers that record in batches turn it off and call
+  // Trace::Flush after each batch
+  bool flush_each_entry = true;
+};
+
+struct TraceCheckpoint {
+  int pos = -1;
+  std::string filename;
+  std::streamoff offset = 0;
+};
+
+struct TraceSegment {
+  std::string filename;
+  // positions of the first and last entries stored in the segment.
+  // last_pos == first_pos - 1 for a segment with no entries yet
+  int first_pos;
+  int last_pos;
+  size_t bytes;
 };
 
 // Single-threaded trace representation
@@ -50,19 +203,32 @@ class TraceGroup {
 // envoked at a time
 class Trace {
  public:
-  Trace(std::string &traceprefix, Mode mode, bool overwrite = true);
+  Trace(std::string &traceprefix, Mode mode, bool overwrite = true,
+        TraceOptions options = {});
   Trace(const Trace &) = delete;
   Trace &operator=(const Trace &) = delete;
   Trace(Trace &&) = default;
   Trace &operator=(Trace &&) = default;
   ~Trace();
 
+  // name of the binary file currently being recorded to
   std::string tracename();
+  const std::vector<TraceSegment> &segments();
   std::size_t size();
   bool isReplay();
   int pos();
+  // throws std::runtime_error, recording nothing, for entries larger than
+  // format::kMaxRecordSize
   int Record(const airreplay::OpequeEntry &header);
   int Record(const std::string &payload, const std::string &debug_string = "");
+  // same as Record but also adds the entry to the checkpoint index so replay
+  // can later start from it
+  int RecordCheckpoint(const airreplay::OpequeEntry &header);
+  // writes the entries recorded since the last flush to the trace files
+  void Flush();
+  // true if replay started at a checkpoint (see
+  // TraceOptions::replay_from_checkpoint_before) and not at the trace head
+  bool StartedAtCheckpoint();
   bool HasNext();
   const OpequeEntry &PeekNext(int *pos);
   OpequeEntry ReplayNext(int *pos);
@@ -71,6 +237,8 @@ class Trace {
   // asserts that expectedHead is the next message in the trace and consumes it
   void ConsumeHead(const OpequeEntry &expectedHead);
   bool SoftConsumeHead(const OpequeEntry &expectedHead);
+  // true if head was soft-consumed and is still waiting to be consumed
+  bool IsSoftConsumed(const OpequeEntry &head);
   // Utility function used to coalsece sequential socket reads and sequential
   // socket writes in replay. must be called right after construction  (pos_ =
   // 0)
@@ -83,6 +251,10 @@ class Trace {
 
  private:
   Mode mode_;
+  TraceOptions options_;
+  std::string traceprefix_;
+  std::string manifestname_;
+  std::string indexname_;
   std::string txttracename_;
   std::string tracename_;
   std::fstream *tracetxt_;
@@ -91,12 +263,42 @@ class Trace {
 
   // the index of the next message to be recorded or replayed
   int pos_ = 0;
+
+  // live segments, oldest first. Only populated for segmented traces
+  std::vector<TraceSegment> segments_;
+  int next_segment_ = 0;
+  bool started_at_checkpoint_ = false;
+  std::chrono::steady_clock::time_point segment_start_;
   std::thread debug_thread_;
   // used by Trace destructor to terminate the debug thread
   std::atomic<bool> debug_thread_exit_ = false;
   void DebugThread(const std::atomic<bool> &do_exit);
+  bool FindCheckpoint(int before, TraceCheckpoint *checkpoint);
+
+  bool Segmented();
+  void OpenFiles();
+  void CloseFiles();
+  void OpenSegment();
+  // closes the current segment and starts the next one
+  void Rotate();
+  void EnforceRetention();
+  void WriteManifest();
 };
 
+// reads the entries of the trace recorded at traceprefix (a single
+// <prefix>.bin or the segments of <prefix>.manifest) without the replay
+// bookkeeping of Trace, so no debug thread is started. first_pos, when given,
+// is set to the position of the first entry
+std::deque<airreplay::OpequeEntry> ReadTraceEntries(
+    const std::string &traceprefix, int *first_pos = nullptr);
+// positions [*first_pos, *end_pos) of the entries of the trace recorded at
+// traceprefix. Counts the records without parsing them
+void TraceExtent(const std::string &traceprefix, int *first_pos,
+                 int *end_pos);
+// merges each run of socket reads and each run of socket writes into a
+// single entry, see Trace::Coalesce
+void CoalesceSocketEntries(std::deque<airreplay::OpequeEntry> *entries);
+
 }  // namespace airreplay
 
 #endif /* TRACE_H */
\ No newline at end of file
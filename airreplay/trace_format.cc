@@ -0,0 +1,210 @@
+#include "trace_format.h"
+
+#include <string.h>
+
+#include <array>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace airreplay {
+namespace format {
+
+namespace {
+
+// reflected Castagnoli polynomial
+constexpr uint32_t kCrc32cPoly = 0x82f63b78;
+
+std::array<uint32_t, 256> MakeCrc32cTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPoly : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t Crc32cSoftware(const char *data, size_t len, uint32_t crc) {
+  static const std::array<uint32_t, 256> table = MakeCrc32cTable();
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t Crc32cSSE42(const char *data,
+                                                        size_t len,
+                                                        uint32_t crc) {
+  uint64_t c = ~crc & 0xffffffffu;
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+    data += sizeof(word);
+    len -= sizeof(word);
+  }
+  uint32_t c32 = static_cast<uint32_t>(c);
+  while (len > 0) {
+    c32 = _mm_crc32_u8(c32, static_cast<uint8_t>(*data));
+    data++;
+    len--;
+  }
+  return ~c32;
+}
+
+bool HaveSSE42() {
+  static const bool have = __builtin_cpu_supports("sse4.2");
+  return have;
+}
+#endif
+
+void PutFixed32(uint32_t v, char *out) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+  }
+}
+
+uint32_t GetFixed32(const char *in) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(in);
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+         (uint32_t(p[3]) << 24);
+}
+
+// returns the number of bytes written (at most 5)
+size_t PutVarint32(uint32_t v, char *out) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = static_cast<char>(v);
+  return n;
+}
+
+// returns the number of bytes consumed or 0 if buf does not start with a
+// valid varint32
+size_t GetVarint32(std::string_view buf, uint32_t *v) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < buf.size() && i < 5; i++) {
+    uint8_t byte = static_cast<uint8_t>(buf[i]);
+    result |= uint32_t(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *v = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+uint32_t Crc32c(const char *data, size_t len, uint32_t crc) {
+#if defined(__x86_64__)
+  if (HaveSSE42()) {
+    return Crc32cSSE42(data, len, crc);
+  }
+#endif
+  return Crc32cSoftware(data, len, crc);
+}
+
+std::string FileHeader() {
+  std::string header(kFileMagic, sizeof(kFileMagic));
+  char version[4];
+  PutFixed32(kFormatVersion, version);
+  header.append(version, sizeof(version));
+  return header;
+}
+
+bool HasFileHeader(std::string_view buf, uint32_t *version) {
+  if (buf.size() < kFileHeaderSize ||
+      memcmp(buf.data(), kFileMagic, sizeof(kFileMagic)) != 0) {
+    return false;
+  }
+  if (version != nullptr) {
+    *version = GetFixed32(buf.data() + sizeof(kFileMagic));
+  }
+  return true;
+}
+
+RecordFrame FrameRecord(std::string_view payload) {
+  // readers would skip the record as garbage, and the varint32 length cannot
+  // hold more than 4 GB
+  if (payload.size() > kMaxRecordSize) {
+    throw std::runtime_error("trace record of " +
+                             std::to_string(payload.size()) +
+                             " bytes exceeds the limit of " +
+                             std::to_string(kMaxRecordSize));
+  }
+  RecordFrame frame;
+  PutFixed32(kRecordMarker, frame.head);
+  size_t len_size = PutVarint32(payload.size(), frame.head + 4);
+  frame.head_size = 4 + len_size;
+  uint32_t checksum = Crc32c(frame.head + 4, len_size);
+  checksum = Crc32c(payload.data(), payload.size(), checksum);
+  PutFixed32(checksum, frame.tail);
+  return frame;
+}
+
+void AppendRecord(std::string_view payload, std::string *out) {
+  RecordFrame frame = FrameRecord(payload);
+  out->reserve(out->size() + frame.head_size + payload.size() +
+               sizeof(frame.tail));
+  out->append(frame.head, frame.head_size);
+  out->append(payload.data(), payload.size());
+  out->append(frame.tail, sizeof(frame.tail));
+}
+
+RecordReader::RecordReader(std::string_view buf) : buf_(buf) {}
+
+bool RecordReader::Next(std::string_view *payload) {
+  while (pos_ < buf_.size()) {
+    std::string_view rest = buf_.substr(pos_);
+    if (rest.size() < 4 || GetFixed32(rest.data()) != kRecordMarker) {
+      Resync();
+      continue;
+    }
+
+    uint32_t len = 0;
+    size_t len_size = GetVarint32(rest.substr(4), &len);
+    if (len_size == 0 || len > kMaxRecordSize ||
+        4 + len_size + len + 4 > rest.size()) {
+      Resync();
+      continue;
+    }
+
+    const char *len_start = rest.data() + 4;
+    uint32_t checksum = Crc32c(len_start, len_size + len);
+    if (checksum != GetFixed32(len_start + len_size + len)) {
+      Resync();
+      continue;
+    }
+
+    *payload = rest.substr(4 + len_size, len);
+    pos_ += 4 + len_size + len + 4;
+    return true;
+  }
+  return false;
+}
+
+void RecordReader::Resync() {
+  char marker[4];
+  PutFixed32(kRecordMarker, marker);
+  size_t next = buf_.find(std::string_view(marker, sizeof(marker)), pos_ + 1);
+  if (next == std::string_view::npos) {
+    next = buf_.size();
+  }
+  corrupted_++;
+  skipped_bytes_ += next - pos_;
+  pos_ = next;
+}
+
+}  // namespace format
+}  // namespace airreplay
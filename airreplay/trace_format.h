@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+namespace airreplay {
+namespace format {
+
+// On-disk layout of a binary (.bin) trace:
+//
+//   file header: "AIRRTRC\0" | version (fixed32 LE)
+//   record:      marker (fixed32 LE) | length (varint32) | payload |
+//                crc32c(length varint + payload) (fixed32 LE)
+//
+// The per-record marker lets the reader resynchronize after a torn write or a
+// bit flip: a record whose length or checksum does not check out is skipped
+// and parsing continues at the next marker.
+// Traces written before the framed format was introduced have no file header
+// and are parsed with the legacy (host-endian size_t length) reader.
+constexpr char kFileMagic[8] = {'A', 'I', 'R', 'R', 'T', 'R', 'C', '\0'};
+constexpr uint32_t kFormatVersion = 1;
+constexpr size_t kFileHeaderSize = sizeof(kFileMagic) + sizeof(uint32_t);
+constexpr uint32_t kRecordMarker = 0x9a52527e;
+// upper bound on a single record, used to reject garbage lengths early
+constexpr uint32_t kMaxRecordSize = 1u << 28;
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU
+// supports it and falls back to a table-driven implementation otherwise.
+uint32_t Crc32c(const char *data, size_t len, uint32_t crc = 0);
+
+std::string FileHeader();
+// returns true if buf starts with a framed-format file header. Sets *version
+// to the version stored in the header when it is non-null
+bool HasFileHeader(std::string_view buf, uint32_t *version = nullptr);
+// appends payload to out as a single framed record
+void AppendRecord(std::string_view payload, std::string *out);
+// the bytes that go before and after payload in its record, so that a large
+// payload can be written out without copying it into the record.
+// AppendRecord and FrameRecord throw std::runtime_error for payloads larger
+// than kMaxRecordSize
+struct RecordFrame {
+  char head[9];
+  size_t head_size;
+  char tail[4];
+};
+RecordFrame FrameRecord(std::string_view payload);
+
+// Iterates over the records of a framed trace held in memory.
+// Damaged records are skipped, not reported as errors: Next() only returns
+// payloads whose checksum matched. corrupted() and skipped_bytes() report how
+// much of the input was lost.
+class RecordReader {
+ public:
+  // buf must outlive the reader and must not include the file header
+  explicit RecordReader(std::string_view buf);
+
+  // returns false once there are no more intact records
+  bool Next(std::string_view *payload);
+
+  size_t corrupted() const { return corrupted_; }
+  size_t skipped_bytes() const { return skipped_bytes_; }
+
+ private:
+  // moves pos_ to the next record marker after the current position
+  void Resync();
+
+  std::string_view buf_;
+  size_t pos_ = 0;
+  size_t corrupted_ = 0;
+  size_t skipped_bytes_ = 0;
+};
+
+}  // namespace format
+}  // namespace airreplay
@@ -0,0 +1,153 @@
+#include "worker_process.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+namespace airreplay {
+
+WorkerProcess::WorkerProcess(const std::vector<std::string> &command,
+                             const std::map<std::string, std::string> &env,
+                             const std::string &workdir,
+                             const std::string &logpath)
+    : start_(std::chrono::steady_clock::now()) {
+  pid_ = fork();
+  if (pid_ < 0) {
+    throw std::runtime_error("fork failed: " + std::string(strerror(errno)));
+  }
+  if (pid_ > 0) return;
+
+  // own process group so a stalled worker can be killed with its children
+  setpgid(0, 0);
+  for (const auto &kv : env) {
+    setenv(kv.first.c_str(), kv.second.c_str(), 1);
+  }
+  int log = open(logpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log >= 0) {
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    close(log);
+  }
+  if (!workdir.empty() && chdir(workdir.c_str()) != 0) {
+    std::cerr << "chdir " << workdir << " failed: " << strerror(errno)
+              << std::endl;
+    _exit(126);
+  }
+  std::vector<char *> args;
+  for (const auto &arg : command) {
+    args.push_back(const_cast<char *>(arg.c_str()));
+  }
+  args.push_back(nullptr);
+  execvp(args[0], args.data());
+  std::cerr << "exec " << args[0] << " failed: " << strerror(errno)
+            << std::endl;
+  _exit(127);
+}
+
+WorkerProcess::WorkerProcess(WorkerProcess &&other) noexcept
+    : pid_(other.pid_),
+      start_(other.start_),
+      end_(other.end_),
+      done_(other.done_),
+      passed_(other.passed_),
+      outcome_(std::move(other.outcome_)) {
+  other.pid_ = -1;
+  other.done_ = true;
+}
+
+WorkerProcess::~WorkerProcess() {
+  if (pid_ > 0 && !done_) {
+    Kill("driver exited");
+  }
+}
+
+bool WorkerProcess::Poll() {
+  if (done_) return true;
+
+  int status;
+  if (waitpid(pid_, &status, WNOHANG) != pid_) return false;
+
+  end_ = std::chrono::steady_clock::now();
+  done_ = true;
+  passed_ = WIFEXITED(status) && WEXITSTATUS(status) == kReachedStopAtStatus;
+  outcome_ = WIFEXITED(status)
+                 ? "exit " + std::to_string(WEXITSTATUS(status))
+                 : "signal " + std::to_string(WTERMSIG(status));
+  return true;
+}
+
+void WorkerProcess::Kill(const std::string &reason) {
+  if (done_) return;
+
+  kill(-pid_, SIGKILL);
+  int status;
+  waitpid(pid_, &status, 0);
+  end_ = std::chrono::steady_clock::now();
+  done_ = true;
+  passed_ = false;
+  outcome_ = reason;
+}
+
+std::chrono::duration<double> WorkerProcess::elapsed() const {
+  return (done_ ? end_ : std::chrono::steady_clock::now()) - start_;
+}
+
+std::string SlotPorts(const std::vector<int> &ports, int slot, int stride) {
+  std::string shifted;
+  for (int port : ports) {
+    if (!shifted.empty()) shifted += ",";
+    shifted += std::to_string(port + slot * stride);
+  }
+  return shifted;
+}
+
+std::string SlotMockPorts(const std::vector<int> &ports, int slot,
+                          int stride) {
+  std::string mock_ports;
+  for (int port : ports) {
+    if (!mock_ports.empty()) mock_ports += ",";
+    mock_ports +=
+        std::to_string(port) + ":" + std::to_string(port + slot * stride);
+  }
+  return mock_ports;
+}
+
+std::vector<std::string> SubstituteCommand(
+    const std::vector<std::string> &command,
+    const std::map<std::string, std::string> &values) {
+  std::vector<std::string> substituted;
+  for (std::string arg : command) {
+    for (const auto &kv : values) {
+      std::string key = "{" + kv.first + "}";
+      size_t pos = 0;
+      while ((pos = arg.find(key, pos)) != std::string::npos) {
+        arg.replace(pos, key.size(), kv.second);
+        pos += kv.second.size();
+      }
+    }
+    substituted.push_back(arg);
+  }
+  return substituted;
+}
+
+void LinkFiles(const std::string &dir, const std::string &workdir) {
+  namespace fs = std::filesystem;
+  fs::create_directories(workdir);
+  fs::path source = fs::absolute(dir);
+  for (const auto &entry : fs::directory_iterator(source)) {
+    if (!entry.is_regular_file()) continue;
+    fs::path link = fs::path(workdir) / entry.path().filename();
+    std::error_code ec;
+    fs::remove(link, ec);
+    fs::create_symlink(entry.path(), link, ec);
+  }
+}
+
+}  // namespace airreplay
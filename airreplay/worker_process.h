@@ -0,0 +1,71 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace airreplay {
+
+// exit status of a replay that reached AIRREPLAY_STOP_AT. Not 0, so an
+// application that exits on its own before that position does not pass
+constexpr int kReachedStopAtStatus = 86;
+
+// A child process running a replay command. Used by the airreplay-bisect and
+// airreplay-farm drivers to run many replays in parallel.
+class WorkerProcess {
+ public:
+  // forks and execs command. env is added to the child's environment, the
+  // child runs in workdir (unless it is empty) and its stdout and stderr go
+  // to logpath
+  WorkerProcess(const std::vector<std::string> &command,
+                const std::map<std::string, std::string> &env,
+                const std::string &workdir, const std::string &logpath);
+  WorkerProcess(const WorkerProcess &) = delete;
+  WorkerProcess &operator=(const WorkerProcess &) = delete;
+  WorkerProcess(WorkerProcess &&other) noexcept;
+  ~WorkerProcess();
+
+  // reaps the worker if it exited. Returns true once it is done
+  bool Poll();
+  // kills the worker together with any processes it started
+  void Kill(const std::string &reason);
+
+  bool done() const { return done_; }
+  // true if the worker's replay reached AIRREPLAY_STOP_AT (exited with
+  // kReachedStopAtStatus)
+  bool passed() const { return passed_; }
+  const std::string &outcome() const { return outcome_; }
+  // wall time since start, or until exit once done
+  std::chrono::duration<double> elapsed() const;
+
+ private:
+  pid_t pid_ = -1;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point end_;
+  bool done_ = false;
+  bool passed_ = false;
+  std::string outcome_;
+};
+
+// Concurrent replays in worker slots 0, 1, ... each get the mock-server ports
+// shifted by slot * stride, so their mock servers do not collide. The mock
+// servers still replay the socket traces named after the recorded ports.
+
+// ports shifted for slot, comma separated. What the replayed command must
+// connect to instead of the recorded ports
+std::string SlotPorts(const std::vector<int> &ports, int slot, int stride);
+// AIRREPLAY_MOCK_PORTS for slot, as <recorded>:<listen> pairs
+std::string SlotMockPorts(const std::vector<int> &ports, int slot,
+                          int stride);
+// replaces every {key} in the arguments of command by its value
+std::vector<std::string> SubstituteCommand(
+    const std::vector<std::string> &command,
+    const std::map<std::string, std::string> &values);
+// links every file of dir into workdir, which is created if needed, so a
+// worker running there finds the traces and socket traces it replays
+void LinkFiles(const std::string &dir, const std::string &workdir);
+
+}  // namespace airreplay
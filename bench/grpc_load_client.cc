@@ -0,0 +1,313 @@
+// grpc_load_client: drives greeter_server or route_guide_server with a closed
+// or open loop load and reports throughput and a latency histogram.
+//
+// Usage:
+//   grpc_load_client --service greeter|route_guide
+//                    --rpc unary|server_stream|client_stream|bidi
+//                    [--target HOST:PORT] [--loop closed|open]
+//                    [--concurrency N] [--rate CALLS_PER_SECOND]
+//                    [--duration SECONDS] [--warmup SECONDS]
+//                    [--stream_len N] [--label TEXT]
+//
+// Closed loop: each of the --concurrency threads starts its next call as soon
+// as the previous one completes. Open loop: calls are scheduled at a fixed
+// --rate and issued by --concurrency threads. Latency is measured from the
+// scheduled start, so the time a call waits for a free thread is counted and
+// an overloaded server shows up as latency instead of a lower offered load.
+//
+// The rpcs map to route_guide's GetFeature (unary), ListFeatures
+// (server_stream, returns the features of the example client's rectangle),
+// RecordRoute (client_stream) and RouteChat (bidi). Client and bidi streaming
+// calls send --stream_len messages. Greeter only has the unary SayHello.
+//
+// Prints one "RESULT key=value ..." line for scripts (see run_overhead.sh)
+// followed by the histogram. Calls completing during --warmup are not counted.
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "helloworld.grpc.pb.h"
+#include "histogram.h"
+#include "route_guide.grpc.pb.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string target = "localhost:50051";
+  std::string service;
+  std::string rpc;
+  std::string loop = "closed";
+  int concurrency = 8;
+  double rate = 1000;
+  std::chrono::duration<double> duration{10};
+  std::chrono::duration<double> warmup{2};
+  int stream_len = 10;
+  std::string label;
+};
+
+void Usage() {
+  std::cerr << "usage: grpc_load_client --service greeter|route_guide "
+               "--rpc unary|server_stream|client_stream|bidi "
+               "[--target HOST:PORT] [--loop closed|open] [--concurrency N] "
+               "[--rate CALLS_PER_SECOND] [--duration SECONDS] "
+               "[--warmup SECONDS] [--stream_len N] [--label TEXT]"
+            << std::endl;
+  exit(2);
+}
+
+Options ParseArgs(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) Usage();
+    std::string value = argv[++i];
+    if (arg == "--target") {
+      options.target = value;
+    } else if (arg == "--service") {
+      options.service = value;
+    } else if (arg == "--rpc") {
+      options.rpc = value;
+    } else if (arg == "--loop") {
+      options.loop = value;
+    } else if (arg == "--concurrency") {
+      options.concurrency = std::max(1, std::stoi(value));
+    } else if (arg == "--rate") {
+      options.rate = std::stod(value);
+    } else if (arg == "--duration") {
+      options.duration = std::chrono::duration<double>(std::stod(value));
+    } else if (arg == "--warmup") {
+      options.warmup = std::chrono::duration<double>(std::stod(value));
+    } else if (arg == "--stream_len") {
+      options.stream_len = std::max(1, std::stoi(value));
+    } else if (arg == "--label") {
+      options.label = value;
+    } else {
+      Usage();
+    }
+  }
+  bool known_rpc = options.rpc == "unary" || options.rpc == "server_stream" ||
+                   options.rpc == "client_stream" || options.rpc == "bidi";
+  if (!known_rpc || (options.loop != "closed" && options.loop != "open") ||
+      options.rate <= 0) {
+    Usage();
+  }
+  if (options.service == "greeter" && options.rpc != "unary") {
+    std::cerr << "greeter only has a unary rpc" << std::endl;
+    exit(2);
+  }
+  if (options.service != "greeter" && options.service != "route_guide") {
+    Usage();
+  }
+  return options;
+}
+
+// issues the calls of one scenario. Stubs are thread safe and shared by the
+// worker threads
+class Caller {
+ public:
+  Caller(const Options &options, std::shared_ptr<grpc::Channel> channel)
+      : options_(options),
+        greeter_(helloworld::Greeter::NewStub(channel)),
+        route_guide_(routeguide::RouteGuide::NewStub(channel)) {}
+
+  // returns whether the call succeeded
+  bool Call(uint64_t seq) {
+    if (options_.service == "greeter") return SayHello(seq);
+    if (options_.rpc == "unary") return GetFeature(seq);
+    if (options_.rpc == "server_stream") return ListFeatures();
+    if (options_.rpc == "client_stream") return RecordRoute(seq);
+    return RouteChat(seq);
+  }
+
+ private:
+  static routeguide::Point MakePoint(uint64_t seq, int i) {
+    routeguide::Point point;
+    point.set_latitude(400000000 + (seq * 7919 + i) % 20000000);
+    point.set_longitude(-750000000 + (seq * 104729 + i) % 20000000);
+    return point;
+  }
+
+  bool SayHello(uint64_t seq) {
+    grpc::ClientContext context;
+    helloworld::HelloRequest request;
+    helloworld::HelloReply reply;
+    request.set_name("load " + std::to_string(seq));
+    return greeter_->SayHello(&context, request, &reply).ok();
+  }
+
+  bool GetFeature(uint64_t seq) {
+    grpc::ClientContext context;
+    routeguide::Feature feature;
+    return route_guide_->GetFeature(&context, MakePoint(seq, 0), &feature)
+        .ok();
+  }
+
+  bool ListFeatures() {
+    grpc::ClientContext context;
+    routeguide::Rectangle rect;
+    rect.mutable_lo()->set_latitude(400000000);
+    rect.mutable_lo()->set_longitude(-750000000);
+    rect.mutable_hi()->set_latitude(420000000);
+    rect.mutable_hi()->set_longitude(-730000000);
+    auto reader = route_guide_->ListFeatures(&context, rect);
+    routeguide::Feature feature;
+    while (reader->Read(&feature)) {
+    }
+    return reader->Finish().ok();
+  }
+
+  bool RecordRoute(uint64_t seq) {
+    grpc::ClientContext context;
+    routeguide::RouteSummary summary;
+    auto writer = route_guide_->RecordRoute(&context, &summary);
+    for (int i = 0; i < options_.stream_len; i++) {
+      if (!writer->Write(MakePoint(seq, i))) break;
+    }
+    writer->WritesDone();
+    return writer->Finish().ok();
+  }
+
+  // all notes of a call share a location so the server echoes the earlier
+  // ones back. Responses are small enough to be read after the last write.
+  // The server keeps every note, so its per-message cost grows with the run
+  bool RouteChat(uint64_t seq) {
+    grpc::ClientContext context;
+    auto stream = route_guide_->RouteChat(&context);
+    routeguide::RouteNote note;
+    *note.mutable_location() = MakePoint(seq, 0);
+    for (int i = 0; i < options_.stream_len; i++) {
+      note.set_message("note " + std::to_string(i));
+      if (!stream->Write(note)) break;
+    }
+    stream->WritesDone();
+    routeguide::RouteNote echoed;
+    while (stream->Read(&echoed)) {
+    }
+    return stream->Finish().ok();
+  }
+
+  const Options &options_;
+  std::unique_ptr<helloworld::Greeter::Stub> greeter_;
+  std::unique_ptr<routeguide::RouteGuide::Stub> route_guide_;
+};
+
+struct WorkerResult {
+  Histogram latency;
+  uint64_t errors = 0;
+};
+
+struct Schedule {
+  Clock::time_point start;
+  Clock::time_point measure_from;
+  Clock::time_point end;
+  std::chrono::duration<double> interval;
+  std::atomic<uint64_t> next{0};
+};
+
+uint64_t Micros(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void ClosedLoop(Caller *caller, Schedule *schedule, WorkerResult *result) {
+  while (true) {
+    Clock::time_point begin = Clock::now();
+    if (begin >= schedule->end) return;
+    bool ok = caller->Call(schedule->next++);
+    if (begin < schedule->measure_from) continue;
+    if (ok) {
+      result->latency.Record(Micros(Clock::now() - begin));
+    } else {
+      result->errors++;
+    }
+  }
+}
+
+void OpenLoop(Caller *caller, Schedule *schedule, WorkerResult *result) {
+  while (true) {
+    uint64_t seq = schedule->next++;
+    auto scheduled =
+        schedule->start + std::chrono::duration_cast<Clock::duration>(
+                              schedule->interval * (double)seq);
+    if (scheduled >= schedule->end) return;
+    std::this_thread::sleep_until(scheduled);
+    bool ok = caller->Call(seq);
+    if (scheduled < schedule->measure_from) continue;
+    if (ok) {
+      result->latency.Record(Micros(Clock::now() - scheduled));
+    } else {
+      result->errors++;
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = ParseArgs(argc, argv);
+  auto channel =
+      grpc::CreateChannel(options.target, grpc::InsecureChannelCredentials());
+  if (!channel->WaitForConnected(Clock::now() + std::chrono::seconds(10))) {
+    std::cerr << "could not connect to " << options.target << std::endl;
+    return 1;
+  }
+  Caller caller(options, channel);
+
+  Schedule schedule;
+  schedule.start = Clock::now();
+  schedule.measure_from =
+      schedule.start +
+      std::chrono::duration_cast<Clock::duration>(options.warmup);
+  schedule.end = schedule.measure_from +
+                 std::chrono::duration_cast<Clock::duration>(options.duration);
+  schedule.interval = std::chrono::duration<double>(1.0 / options.rate);
+
+  std::vector<WorkerResult> results(options.concurrency);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < options.concurrency; i++) {
+    workers.emplace_back(options.loop == "closed" ? ClosedLoop : OpenLoop,
+                         &caller, &schedule, &results[i]);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  // open loop calls still in flight at end complete after it
+  double seconds =
+      std::chrono::duration<double>(
+          std::max(Clock::now(), schedule.end) - schedule.measure_from)
+          .count();
+
+  Histogram latency;
+  uint64_t errors = 0;
+  for (const auto &result : results) {
+    latency.Merge(result.latency);
+    errors += result.errors;
+  }
+  std::cout << std::fixed << std::setprecision(1) << "RESULT service="
+            << options.service << " rpc=" << options.rpc
+            << " loop=" << options.loop << " label=" << options.label
+            << " concurrency=" << options.concurrency;
+  if (options.loop == "open") std::cout << " rate=" << options.rate;
+  std::cout << " calls=" << latency.count() << " errors=" << errors
+            << " seconds=" << seconds
+            << " calls_per_sec=" << latency.count() / seconds
+            << " mean_us=" << latency.mean()
+            << " p50_us=" << latency.Percentile(0.5)
+            << " p90_us=" << latency.Percentile(0.9)
+            << " p99_us=" << latency.Percentile(0.99)
+            << " p999_us=" << latency.Percentile(0.999)
+            << " max_us=" << latency.max() << "\n";
+  latency.Print(std::cout);
+  return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Measures the per-call overhead of the LD_PRELOAD socket capture.
+#
+# Usage: bench/run_capture_overhead.sh <build dir> [socket_capture_bench args...]
+#
+# For a few write sizes runs socket_capture_bench plain and with
+# libairreplay_capture.so preloaded, recording into a scratch directory, and
+# prints both RESULT lines. Extra args are passed to every run, e.g.
+# --iterations 5000000.
+set -u
+
+BUILD=$(cd "$1" && pwd)
+shift
+OUT=${OUT:-airreplay-capture-overhead.$$}
+mkdir -p "$OUT"
+
+for bytes in 64 1024 16384; do
+  "$BUILD/bench/socket_capture_bench" --bytes "$bytes" --label off "$@"
+  # a fresh directory per run, the traces are not needed
+  rm -rf "$OUT/traces" && mkdir -p "$OUT/traces"
+  AIRREPLAY_CAPTURE_DIR="$OUT/traces" \
+    LD_PRELOAD="$BUILD/libairreplay_capture.so" \
+    "$BUILD/bench/socket_capture_bench" --bytes "$bytes" --label capture "$@"
+done
+rm -rf "$OUT"
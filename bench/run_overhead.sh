@@ -0,0 +1,71 @@
+#!/bin/bash
+# Measures the overhead of recording with AirReplay on the gRPC examples.
+#
+# Usage: bench/run_overhead.sh <build dir> [grpc_load_client args...]
+#
+# For greeter_server and route_guide_server, every rpc type and both closed
+# and open loop, starts a fresh server with AirReplay off, recording without
+# the txt trace and recording with it, then runs grpc_load_client against it.
+# Extra args are passed to every grpc_load_client run, e.g. --duration 30 or
+# --rate 5000 (the open loop rate).
+# Prints the RESULT line of every run, full output goes to $OUT (default
+# airreplay-overhead.<pid>).
+set -u
+
+BUILD=$(cd "$1" && pwd)
+shift
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-airreplay-overhead.$$}
+PORT=50051
+mkdir -p "$OUT"
+
+# runs "$@" as the server with the AirReplay mode $1
+start_server() {
+  local airmode=$1
+  shift
+  local env=()
+  case $airmode in
+    record) env=(AIRREPLAY_MODE=record AIRREPLAY_TXT_TRACE=0) ;;
+    record_txt) env=(AIRREPLAY_MODE=record) ;;
+  esac
+  # a fresh trace per run
+  rm -rf "$OUT/trace" && mkdir -p "$OUT/trace"
+  env "${env[@]}" AIRREPLAY_TRACE="$OUT/trace/server" "$@" \
+    > "$OUT/server.log" 2>&1 &
+  SERVER=$!
+}
+
+stop_server() {
+  kill "$SERVER" 2> /dev/null
+  wait "$SERVER" 2> /dev/null
+}
+trap stop_server EXIT
+
+run() {
+  local service=$1 rpc=$2 loop=$3 airmode=$4
+  shift 4
+  start_server "$airmode" "$@"
+  local log="$OUT/$service.$rpc.$loop.$airmode.log"
+  "$BUILD/bench/grpc_load_client" --target "localhost:$PORT" \
+    --service "$service" --rpc "$rpc" --loop "$loop" --label "$airmode" \
+    "${CLIENT_ARGS[@]}" > "$log" 2>&1
+  grep '^RESULT' "$log" || echo "FAILED $service $rpc $loop $airmode, see $log"
+  stop_server
+}
+
+CLIENT_ARGS=("$@")
+for loop in closed open; do
+  for airmode in off record record_txt; do
+    run greeter unary "$loop" "$airmode" \
+      "$BUILD/hello_world/greeter_server" --port=$PORT
+  done
+done
+for rpc in unary server_stream client_stream bidi; do
+  for loop in closed open; do
+    for airmode in off record record_txt; do
+      run route_guide "$rpc" "$loop" "$airmode" \
+        "$BUILD/route_guide/route_guide_server" \
+        --db_path="$SRC/route_guide/route_guide_db.json"
+    done
+  done
+done
@@ -0,0 +1,138 @@
+// socket_capture_bench: measures what libairreplay_capture.so adds to the
+// calls it interposes. Run it once plain and once with LD_PRELOAD (see
+// run_capture_overhead.sh) and compare.
+//
+// Usage:
+//   socket_capture_bench [--iterations N] [--bytes N] [--label TEXT]
+//
+// Each iteration writes --bytes and reads them back on the same thread, so
+// the time is that of the system calls and whatever the interposer does
+// around them:
+//   pipe  a pipe, which the interposer only looks up and passes through
+//   tcp   a loopback TCP connection accepted and connected in the process,
+//         whose bytes the interposer records
+// Prints one "RESULT key=value ..." line with the nanoseconds per call.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  long iterations = 1000000;
+  size_t bytes = 64;
+  std::string label;
+};
+
+void Usage() {
+  std::cerr << "usage: socket_capture_bench [--iterations N] [--bytes N] "
+               "[--label TEXT]"
+            << std::endl;
+  exit(2);
+}
+
+Options ParseArgs(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) Usage();
+    std::string value = argv[++i];
+    if (arg == "--iterations") {
+      options.iterations = std::max(1L, std::stol(value));
+    } else if (arg == "--bytes") {
+      options.bytes = std::max(1UL, std::stoul(value));
+    } else if (arg == "--label") {
+      options.label = value;
+    } else {
+      Usage();
+    }
+  }
+  // the socket buffers hold a whole write, so one thread can do both ends
+  if (options.bytes > 64 * 1024) Usage();
+  return options;
+}
+
+// nanoseconds per call of writing and reading back iterations times
+double Measure(int write_fd, int read_fd, const Options &options) {
+  std::vector<char> out(options.bytes, 'x');
+  std::vector<char> in(options.bytes);
+  auto start = Clock::now();
+  for (long i = 0; i < options.iterations; i++) {
+    if (write(write_fd, out.data(), out.size()) != (ssize_t)out.size()) {
+      std::cerr << "short write" << std::endl;
+      exit(1);
+    }
+    for (size_t got = 0; got < in.size();) {
+      ssize_t n = read(read_fd, in.data() + got, in.size() - got);
+      if (n <= 0) {
+        std::cerr << "read failed" << std::endl;
+        exit(1);
+      }
+      got += n;
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  return ns / (2.0 * options.iterations);
+}
+
+// a connected pair of loopback TCP sockets, accepted and connected here
+void TcpPair(int *client, int *server) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(address);
+  if (bind(listener, (struct sockaddr *)&address, len) != 0 ||
+      listen(listener, 1) != 0 ||
+      getsockname(listener, (struct sockaddr *)&address, &len) != 0) {
+    std::cerr << "failed to listen" << std::endl;
+    exit(1);
+  }
+  *client = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(*client, (struct sockaddr *)&address, len) != 0) {
+    std::cerr << "failed to connect" << std::endl;
+    exit(1);
+  }
+  *server = accept(listener, nullptr, nullptr);
+  close(listener);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = ParseArgs(argc, argv);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    std::cerr << "pipe failed" << std::endl;
+    return 1;
+  }
+  double pipe_ns = Measure(fds[1], fds[0], options);
+  close(fds[0]);
+  close(fds[1]);
+
+  int client, server;
+  TcpPair(&client, &server);
+  double tcp_ns = Measure(client, server, options);
+  close(client);
+  close(server);
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "RESULT label=" << options.label
+            << " iterations=" << options.iterations
+            << " bytes=" << options.bytes << " pipe_ns_per_call=" << pipe_ns
+            << " tcp_ns_per_call=" << tcp_ns << "\n";
+  return 0;
+}
@@ -19,11 +19,13 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/strings/str_format.h"
 
+#include <grpcpp/create_channel.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
@@ -34,6 +36,8 @@
 #include "helloworld.grpc.pb.h"
 #endif
 
+#include "grpc_interceptors.h"
+
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -57,6 +61,9 @@ class GreeterServiceImpl final : public Greeter::Service {
 void RunServer(uint16_t port) {
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
   GreeterServiceImpl service;
+  // see AirreplayFromEnv for the AIRREPLAY_* variables
+  std::unique_ptr<airreplay::Airreplay> airr =
+      airreplay::AirreplayFromEnv("greeter_server");
 
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -66,10 +73,27 @@ void RunServer(uint16_t port) {
   // Register "service" as the instance through which we'll communicate with
   // clients. In this case it corresponds to an *synchronous* service.
   builder.RegisterService(&service);
+  if (airr) {
+    std::vector<
+        std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>>
+        creators;
+    creators.push_back(
+        std::make_unique<airreplay::GrpcServerInterceptorFactory>(airr.get()));
+    builder.experimental().SetInterceptorCreators(std::move(creators));
+  }
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
 
+  std::unique_ptr<airreplay::GrpcReproducer> reproducer;
+  if (airr && airr->isReplay()) {
+    // re-sends the recorded calls to this server
+    reproducer = std::make_unique<airreplay::GrpcReproducer>(
+        airr.get(),
+        grpc::CreateChannel(absl::StrFormat("localhost:%d", port),
+                            grpc::InsecureChannelCredentials()));
+  }
+
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
   server->Wait();
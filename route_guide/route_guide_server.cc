@@ -22,10 +22,13 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
+#include "grpc_interceptors.h"
 #include "helper.h"
 
 #include <grpc/grpc.h>
+#include <grpcpp/create_channel.h>
 #include <grpcpp/security/server_credentials.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
@@ -172,12 +175,31 @@ class RouteGuideImpl final : public RouteGuide::Service {
 void RunServer(const std::string& db_path) {
   std::string server_address("0.0.0.0:50051");
   RouteGuideImpl service(db_path);
+  // see AirreplayFromEnv for the AIRREPLAY_* variables
+  std::unique_ptr<airreplay::Airreplay> airr =
+      airreplay::AirreplayFromEnv("route_guide_server");
 
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
+  if (airr) {
+    std::vector<
+        std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>>
+        creators;
+    creators.push_back(
+        std::make_unique<airreplay::GrpcServerInterceptorFactory>(airr.get()));
+    builder.experimental().SetInterceptorCreators(std::move(creators));
+  }
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
+
+  std::unique_ptr<airreplay::GrpcReproducer> reproducer;
+  if (airr && airr->isReplay()) {
+    // re-sends the recorded calls to this server
+    reproducer = std::make_unique<airreplay::GrpcReproducer>(
+        airr.get(), grpc::CreateChannel("localhost:50051",
+                                        grpc::InsecureChannelCredentials()));
+  }
   server->Wait();
 }
 